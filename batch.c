@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <setjmp.h>
+#include "common.h"
+#include "main.h"
+#include "load.h"
+#include "fd.h"
+#include "paths.h"
+#include "memmap.h"
+#include "batch.h"
+
+/*  exe32-linux --batch <jobs file> [status file]
+ *
+ *  runs the programs listed in the jobs file one after another in this process, one per line:
+ *
+ *    <directory><TAB><progname> [parameters ...] [<infile] [>outfile] [2>errfile]
+ *
+ *  blank lines and lines starting with '#' are skipped, and relative directories are taken
+ *  from the directory the batch was started in. After each job its program and heap are
+ *  unmapped and its files and directory search are closed, the next job maps its program
+ *  again from the image cache. The status file gets a "<line> <exit status>" line per job.
+ */
+
+static jmp_buf job_exit;
+static int batch_dir_fd = -1;
+
+// splits a command line in place, double quotes keep spaces in a parameter
+static int split_cmdline(char *cmd, char **argv) {
+    int argc = 0;
+
+    while (*cmd != '\0') {
+        char *dst;
+        int quoted = 0;
+
+        while (*cmd == ' ' || *cmd == '\t')
+            cmd++;
+        if (*cmd == '\0')
+            break;
+
+        argv[argc++] = dst = cmd;
+        while (*cmd != '\0' && (quoted || (*cmd != ' ' && *cmd != '\t'))) {
+            if (*cmd == '"')
+                quoted = !quoted;
+            else
+                *dst++ = *cmd;
+            cmd++;
+        }
+        if (*cmd != '\0')
+            cmd++;
+        *dst = '\0';
+    }
+
+    argv[argc] = NULL;
+    return argc;
+}
+
+static int redirect_fd(int fd, const char *path, int flags) {
+    int new_fd = open(path, flags, 0666);
+
+    if (new_fd == -1) {
+        PRINT_ERR("Cannot open \"%s\": %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    dup2(new_fd, fd);
+    close(new_fd);
+    return 0;
+}
+
+// runs a program until it exits, then puts the process back the way it was before
+static int exec_job(char *progname, char *args, char *env) {
+    int status;
+
+    if ((status = setjmp(job_exit)) == 0) {
+        load_set_exit_jmp(&job_exit);
+        exec_prog(load_prog(progname), args, env);
+        status = 0; // returned from the program instead of exiting
+    }
+    load_set_exit_jmp(NULL);
+
+    close_fd_handles();
+    reset_wrappers();
+    mem_unmap_all();
+
+    return status & 0xff;
+}
+
+// runs the job of a line from a jobs file, returns its exit status
+int batch_job(char *line, const char *jobs_path, int lineno, char *env) {
+    char *cmd = strchr(line, '\t'), **argv, *progname, *args = NULL;
+    char *redir_paths[3] = { NULL, NULL, NULL };
+    int saved_fds[3] = { -1, -1, -1 };
+    int argc, nparams = 0, i, ret = 2;
+
+    if (cmd == NULL) {
+        PRINT_ERR("%s:%d: expected <directory><TAB><command>\n", jobs_path, lineno);
+        return 2;
+    }
+    *cmd++ = '\0';
+
+    argv = malloc((strlen(cmd) / 2 + 2) * sizeof(char *));
+    argc = split_cmdline(cmd, argv);
+    for (i = 0; i < argc; i++) {
+        if (argv[i][0] == '<')
+            redir_paths[0] = argv[i] + 1;
+        else if (argv[i][0] == '>')
+            redir_paths[1] = argv[i] + 1;
+        else if (argv[i][0] == '2' && argv[i][1] == '>')
+            redir_paths[2] = argv[i] + 2;
+        else
+            argv[nparams++] = argv[i];
+    }
+    if (nparams == 0) {
+        PRINT_ERR("%s:%d: no program to run\n", jobs_path, lineno);
+        goto batch_job_free;
+    }
+
+    if (fchdir(batch_dir_fd) || (line[0] != '\0' && chdir(line))) {
+        PRINT_ERR("%s:%d: cannot change directory to \"%s\": %s\n", jobs_path, lineno, line, strerror(errno));
+        goto batch_job_free;
+    }
+
+    fflush(NULL);
+    for (i = 0; i < 3; i++) {
+        if (redir_paths[i] == NULL) continue;
+
+        saved_fds[i] = dup(i);
+        if (redirect_fd(i, redir_paths[i], i == 0 ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC))
+            goto batch_job_restore;
+    }
+
+    progname = fix_progname(argv[0]);
+    if (nparams > 1) {
+        size_t args_size = 1;
+
+        for (i = 1; i < nparams; i++)
+            args_size += strlen(argv[i]) + 3;
+        args = malloc(args_size);
+        join_args(args, nparams - 1, argv + 1);
+    }
+
+    PRINT_DBG("> batch: %s:%d: running \"%s\" in \"%s\"\n", jobs_path, lineno, progname, line);
+    ret = exec_job(progname, args, env);
+    free(progname);
+    free(args);
+
+batch_job_restore:
+    fflush(NULL);
+    for (i = 0; i < 3; i++) {
+        if (saved_fds[i] == -1) continue;
+
+        dup2(saved_fds[i], i);
+        close(saved_fds[i]);
+    }
+
+batch_job_free:
+    free(argv);
+    return ret;
+}
+
+/*  reads the next job line into line, without blank lines, comments and the line break.
+ *  returns 1 for a job, 0 at the end of the file or -1 if a line doesn't fit.
+ */
+int batch_read_job(FILE *fjobs, char *line, int size, const char *jobs_path, int *lineno) {
+    while (fgets(line, size, fjobs) != NULL) {
+        size_t len = strlen(line);
+
+        (*lineno)++;
+        if (len == (size_t) size - 1 && line[len-1] != '\n' && !feof(fjobs)) {
+            PRINT_ERR("%s:%d: line is too long\n", jobs_path, *lineno);
+            return -1;
+        }
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+            line[--len] = '\0';
+        if (line[0] != '\0' && line[0] != '#')
+            return 1;
+    }
+
+    return 0;
+}
+
+// jobs change to their directory from the one the batch was started in
+int batch_start(void) {
+    if ((batch_dir_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        PRINT_ERR("Cannot open the current directory: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+void batch_finish(void) {
+    fchdir(batch_dir_fd);
+    close(batch_dir_fd);
+    batch_dir_fd = -1;
+}
+
+// returns 0 if every job succeeded, otherwise the exit status of the first job that failed
+int run_batch(const char *jobs_path, const char *status_path, char *env) {
+    FILE *fjobs, *fstatus = NULL;
+    char line[BATCH_MAX_LINE];
+    int lineno = 0, ret = 0, lock = exe32_lock, read_ret;
+
+    if ((fjobs = fopen(jobs_path, "r")) == NULL) {
+        PRINT_ERR("Cannot open jobs file \"%s\": %s\n", jobs_path, strerror(errno));
+        return 2;
+    }
+    if (status_path != NULL && (fstatus = fopen(status_path, "w")) == NULL) {
+        PRINT_ERR("Cannot open status file \"%s\": %s\n", status_path, strerror(errno));
+        fclose(fjobs);
+        return 2;
+    }
+    if (batch_start()) {
+        fclose(fjobs);
+        if (fstatus != NULL) fclose(fstatus);
+        return 2;
+    }
+
+    while ((read_ret = batch_read_job(fjobs, line, sizeof(line), jobs_path, &lineno)) > 0) {
+        int status = batch_job(line, jobs_path, lineno, env);
+
+        // every job takes the lock for itself
+        unlock_wait();
+        exe32_lock = lock;
+
+        if (fstatus != NULL) {
+            fprintf(fstatus, "%d %d\n", lineno, status);
+            fflush(fstatus);
+        }
+        if (status != 0) {
+            PRINT_ERR("%s:%d: exited with status %d\n", jobs_path, lineno, status);
+            if (ret == 0)
+                ret = status;
+        }
+    }
+
+    if (read_ret < 0 && ret == 0)
+        ret = 2;
+
+    batch_finish();
+    fclose(fjobs);
+    if (fstatus != NULL) fclose(fstatus);
+    return ret;
+}
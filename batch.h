@@ -0,0 +1,14 @@
+#ifndef EXE32_BATCH_H
+#define EXE32_BATCH_H
+
+#include <stdio.h>
+
+#define BATCH_MAX_LINE 8192
+
+int batch_start(void);
+void batch_finish(void);
+int batch_read_job(FILE *, char *, int, const char *, int *);
+int batch_job(char *, const char *, int, char *);
+int run_batch(const char *, const char *, char *);
+
+#endif // EXE32_BATCH_H
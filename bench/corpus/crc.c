@@ -0,0 +1,141 @@
+/* checksums and a small run-length coder, for the benchmark corpus */
+
+#define CRC32_POLY 0xedb88320UL
+
+static unsigned long crc_table[256];
+static int crc_table_ready;
+
+static void make_crc_table(void)
+{
+    unsigned long c;
+    int n, k;
+
+    for (n = 0; n < 256; n++) {
+        c = (unsigned long) n;
+        for (k = 0; k < 8; k++)
+            c = c & 1 ? CRC32_POLY ^ (c >> 1) : c >> 1;
+        crc_table[n] = c;
+    }
+    crc_table_ready = 1;
+}
+
+unsigned long crc32(unsigned long crc, const unsigned char *buf, unsigned int len)
+{
+    if (!crc_table_ready)
+        make_crc_table();
+
+    crc = crc ^ 0xffffffffUL;
+    while (len >= 4) {
+        crc = crc_table[(crc ^ buf[0]) & 0xff] ^ (crc >> 8);
+        crc = crc_table[(crc ^ buf[1]) & 0xff] ^ (crc >> 8);
+        crc = crc_table[(crc ^ buf[2]) & 0xff] ^ (crc >> 8);
+        crc = crc_table[(crc ^ buf[3]) & 0xff] ^ (crc >> 8);
+        buf += 4;
+        len -= 4;
+    }
+    while (len--)
+        crc = crc_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffffUL;
+}
+
+unsigned long adler32(unsigned long adler, const unsigned char *buf, unsigned int len)
+{
+    unsigned long a = adler & 0xffff, b = (adler >> 16) & 0xffff;
+
+    while (len > 0) {
+        unsigned int n = len < 3800 ? len : 3800;
+
+        len -= n;
+        while (n--) {
+            a += *buf++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+unsigned short fletcher16(const unsigned char *buf, unsigned int len)
+{
+    unsigned int a = 0, b = 0;
+
+    while (len--) {
+        a = (a + *buf++) % 255;
+        b = (b + a) % 255;
+    }
+    return (unsigned short) ((b << 8) | a);
+}
+
+/* runs of 3 to 130 equal bytes become a count byte over 0x80 and the byte,
+   anything else is copied in blocks of up to 128 after a count byte below it */
+int rle_encode(const unsigned char *in, int len, unsigned char *out)
+{
+    int i = 0, o = 0;
+
+    while (i < len) {
+        int run = 1;
+
+        while (i + run < len && run < 130 && in[i + run] == in[i])
+            run++;
+        if (run >= 3) {
+            out[o++] = (unsigned char) (0x80 + run - 3);
+            out[o++] = in[i];
+            i += run;
+        }
+        else {
+            int start = i, n = 0;
+
+            while (i < len && n < 128) {
+                if (i + 2 < len && in[i] == in[i + 1] && in[i] == in[i + 2])
+                    break;
+                i++;
+                n++;
+            }
+            out[o++] = (unsigned char) (n - 1);
+            while (start < i)
+                out[o++] = in[start++];
+        }
+    }
+    return o;
+}
+
+int rle_decode(const unsigned char *in, int len, unsigned char *out, int max)
+{
+    int i = 0, o = 0;
+
+    while (i < len) {
+        int c = in[i++];
+
+        if (c >= 0x80) {
+            int run = c - 0x80 + 3;
+
+            if (i >= len || o + run > max)
+                return -1;
+            while (run--)
+                out[o++] = in[i];
+            i++;
+        }
+        else {
+            int n = c + 1;
+
+            if (i + n > len || o + n > max)
+                return -1;
+            while (n--)
+                out[o++] = in[i++];
+        }
+    }
+    return o;
+}
+
+int check_round_trip(const unsigned char *data, int len, unsigned char *enc, unsigned char *dec)
+{
+    int n = rle_encode(data, len, enc), m;
+
+    m = rle_decode(enc, n, dec, len);
+    if (m != len)
+        return 1;
+    return crc32(0, data, len) != crc32(0, dec, len)
+        || adler32(1, data, len) != adler32(1, dec, len)
+        || fletcher16(data, len) != fletcher16(dec, len);
+}
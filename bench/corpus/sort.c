@@ -0,0 +1,218 @@
+/* sorting and searching over arrays of records, for the benchmark corpus */
+
+struct rec {
+    int key;
+    unsigned short flags;
+    unsigned short len;
+    char name[24];
+};
+
+typedef int (*cmp_func)(const struct rec *, const struct rec *);
+
+static int cmp_key(const struct rec *a, const struct rec *b)
+{
+    return a->key < b->key ? -1 : a->key > b->key;
+}
+
+static int cmp_name(const struct rec *a, const struct rec *b)
+{
+    const char *p = a->name, *q = b->name;
+
+    while (*p && *p == *q) {
+        p++;
+        q++;
+    }
+    return (unsigned char) *p - (unsigned char) *q;
+}
+
+static void swap(struct rec *a, struct rec *b)
+{
+    struct rec t = *a;
+
+    *a = *b;
+    *b = t;
+}
+
+void insertion_sort(struct rec *v, int n, cmp_func cmp)
+{
+    int i, j;
+
+    for (i = 1; i < n; i++) {
+        struct rec t = v[i];
+
+        for (j = i; j > 0 && cmp(&v[j - 1], &t) > 0; j--)
+            v[j] = v[j - 1];
+        v[j] = t;
+    }
+}
+
+static void sift_down(struct rec *v, int root, int n, cmp_func cmp)
+{
+    int child;
+
+    while ((child = 2 * root + 1) < n) {
+        if (child + 1 < n && cmp(&v[child], &v[child + 1]) < 0)
+            child++;
+        if (cmp(&v[root], &v[child]) >= 0)
+            return;
+        swap(&v[root], &v[child]);
+        root = child;
+    }
+}
+
+void heap_sort(struct rec *v, int n, cmp_func cmp)
+{
+    int i;
+
+    for (i = n / 2 - 1; i >= 0; i--)
+        sift_down(v, i, n, cmp);
+    for (i = n - 1; i > 0; i--) {
+        swap(&v[0], &v[i]);
+        sift_down(v, 0, i, cmp);
+    }
+}
+
+static struct rec *median3(struct rec *a, struct rec *b, struct rec *c, cmp_func cmp)
+{
+    if (cmp(a, b) < 0) {
+        if (cmp(b, c) < 0)
+            return b;
+        return cmp(a, c) < 0 ? c : a;
+    }
+    if (cmp(a, c) < 0)
+        return a;
+    return cmp(b, c) < 0 ? c : b;
+}
+
+static void quick_sort_depth(struct rec *v, int n, cmp_func cmp, int depth)
+{
+    while (n > 16) {
+        struct rec *pivot;
+        int i, j;
+
+        if (depth-- == 0) {
+            heap_sort(v, n, cmp);
+            return;
+        }
+        pivot = median3(&v[0], &v[n / 2], &v[n - 1], cmp);
+        swap(pivot, &v[n - 1]);
+
+        for (i = 0, j = 0; j < n - 1; j++) {
+            if (cmp(&v[j], &v[n - 1]) < 0)
+                swap(&v[i++], &v[j]);
+        }
+        swap(&v[i], &v[n - 1]);
+
+        /* recurse into the smaller half, loop on the larger */
+        if (i < n - i - 1) {
+            quick_sort_depth(v, i, cmp, depth);
+            v += i + 1;
+            n -= i + 1;
+        }
+        else {
+            quick_sort_depth(v + i + 1, n - i - 1, cmp, depth);
+            n = i;
+        }
+    }
+    insertion_sort(v, n, cmp);
+}
+
+void quick_sort(struct rec *v, int n, cmp_func cmp)
+{
+    int depth = 0, m;
+
+    for (m = n; m > 1; m >>= 1)
+        depth += 2;
+    quick_sort_depth(v, n, cmp, depth);
+}
+
+void merge_sort(struct rec *v, struct rec *tmp, int n, cmp_func cmp)
+{
+    int width, i;
+
+    for (width = 1; width < n; width *= 2) {
+        for (i = 0; i < n; i += 2 * width) {
+            int lo = i, mid = i + width, hi = i + 2 * width, a, b, k;
+
+            if (mid > n)
+                mid = n;
+            if (hi > n)
+                hi = n;
+            for (a = lo, b = mid, k = lo; k < hi; k++) {
+                if (a < mid && (b >= hi || cmp(&v[a], &v[b]) <= 0))
+                    tmp[k] = v[a++];
+                else
+                    tmp[k] = v[b++];
+            }
+        }
+        for (i = 0; i < n; i++)
+            v[i] = tmp[i];
+    }
+}
+
+int binary_search(const struct rec *v, int n, int key)
+{
+    int lo = 0, hi = n - 1;
+
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (v[mid].key == key)
+            return mid;
+        if (v[mid].key < key)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1;
+}
+
+int is_sorted(const struct rec *v, int n, cmp_func cmp)
+{
+    int i;
+
+    for (i = 1; i < n; i++) {
+        if (cmp(&v[i - 1], &v[i]) > 0)
+            return 0;
+    }
+    return 1;
+}
+
+static unsigned long seed = 1;
+
+static int next_random(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return (int) ((seed >> 16) & 0x7fff);
+}
+
+void fill_records(struct rec *v, int n)
+{
+    static const char letters[] = "abcdefghijklmnopqrstuvwxyz";
+    int i, j;
+
+    for (i = 0; i < n; i++) {
+        v[i].key = next_random();
+        v[i].flags = (unsigned short) (i & 7);
+        v[i].len = (unsigned short) (4 + next_random() % 16);
+        for (j = 0; j < v[i].len; j++)
+            v[i].name[j] = letters[next_random() % 26];
+        v[i].name[j] = '\0';
+    }
+}
+
+int sort_all(struct rec *v, struct rec *tmp, int n)
+{
+    int bad = 0;
+
+    fill_records(v, n);
+    quick_sort(v, n, cmp_key);
+    bad += !is_sorted(v, n, cmp_key);
+    quick_sort(v, n, cmp_name);
+    bad += !is_sorted(v, n, cmp_name);
+    merge_sort(v, tmp, n, cmp_key);
+    bad += !is_sorted(v, n, cmp_key);
+    heap_sort(v, n, cmp_name);
+    bad += !is_sorted(v, n, cmp_name);
+    return bad;
+}
@@ -0,0 +1,53 @@
+# word copy and fill loops, for the benchmark corpus
+
+	.text
+	.align	2
+	.globl	copy_words
+	.ent	copy_words
+copy_words:
+	.set	noreorder
+	beq	$6, $0, 2f
+	nop
+1:	lw	$8, 0($5)
+	addiu	$5, $5, 4
+	sw	$8, 0($4)
+	addiu	$6, $6, -1
+	bne	$6, $0, 1b
+	addiu	$4, $4, 4
+2:	jr	$31
+	nop
+	.set	reorder
+	.end	copy_words
+
+	.align	2
+	.globl	fill_words
+	.ent	fill_words
+fill_words:
+	.set	noreorder
+	beq	$6, $0, 2f
+	nop
+1:	sw	$5, 0($4)
+	addiu	$6, $6, -1
+	bne	$6, $0, 1b
+	addiu	$4, $4, 4
+2:	jr	$31
+	nop
+	.set	reorder
+	.end	fill_words
+
+	.align	2
+	.globl	sum_words
+	.ent	sum_words
+sum_words:
+	.set	noreorder
+	beq	$5, $0, 2f
+	move	$2, $0
+1:	lw	$8, 0($4)
+	addiu	$5, $5, -1
+	addu	$2, $2, $8
+	bne	$5, $0, 1b
+	addiu	$4, $4, 4
+2:	jr	$31
+	nop
+	.set	reorder
+	.end	sum_words
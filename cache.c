@@ -0,0 +1,948 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <linux/fs.h>
+#include "common.h"
+#include "main.h"
+#include "cache.h"
+#include "depfile.h"
+
+/*  Result cache (EXE32_CACHE=<dir>)
+ *
+ *  The loader sees every file a program opens, creates, removes or looks up, so it can
+ *  cache whole runs without knowing anything about the programs. A run is keyed by the
+ *  contents of the program file, the working directory, the parameters and the environment
+ *  (without the variables that change from shell to shell, see env_ignored). That key
+ *  names a manifest, which lists the inputs of earlier runs with the same key:
+ *
+ *    exe32-cache-manifest 1
+ *    E <result key>        (one per run, newest first)
+ *    I <hash> <path>       file that was read, with the hash of its contents
+ *    M <path>              file that was looked for and not found
+ *    F <path>              file that was found (D for a directory)
+ *
+ *  If all of the inputs of a run are still the same, its created files, its stdout and
+ *  stderr and its exit status are restored from r/<result key>/ instead of running it.
+ *  A run that spawns programs, changes directories, lists directories, reads stdin or
+ *  modifies files it did not create is not cached (the programs it spawns are, on their own).
+ *
+ *  EXE32_CACHE_SIZE=<size>[K|M|G] limits the size of the results (1G by default), the
+ *  least recently used ones are removed when a new one goes over it. Restored files are
+ *  reflinked when the filesystem can, copied otherwise, or hardlinked with EXE32_CACHE_HARDLINK=1.
+ */
+
+#define CACHE_VERSION "exe32-cache 1"
+#define MANIFEST_HEADER "exe32-cache-manifest 1"
+#define MAX_MANIFEST_ENTRIES 16
+#define MAX_CAPTURE 0x100000
+#define DEFAULT_CACHE_SIZE (1024 * 1024 * 1024LL)
+
+#define FNV1A64_INIT 0xcbf29ce484222325ULL
+
+struct cache_dep {
+    char kind; // I, M, F or D like in the manifest
+    char *path;
+    uint64_t hash;
+};
+
+struct capture {
+    char *data;
+    size_t len, size;
+};
+
+static char *cache_dir = NULL;
+static int cache_state = 0; // 0 = not initialized, 1 = enabled, -1 = disabled
+static int cache_hardlink = 0;
+static long long cache_size_limit = DEFAULT_CACHE_SIZE;
+
+int cache_recording = 0;
+static const char *uncacheable_reason;
+static char run_key[17];
+static struct cache_dep *deps;
+static int ndeps, max_deps;
+static char **outputs;
+static int noutputs, max_outputs;
+static struct capture captured[2]; // stdout, stderr
+
+// what happened to the last run, for EXE32_STATS
+static const char *last_result = "disabled";
+
+static uint64_t fnv1a64(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+
+    while (len--) {
+        hash ^= *bytes++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static int hash_file(const char *path, uint64_t *hash) {
+    unsigned char buf[0x10000];
+    ssize_t bread;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1)
+        return 1;
+
+    *hash = FNV1A64_INIT;
+    while ((bread = read(fd, buf, sizeof(buf))) > 0)
+        *hash = fnv1a64(*hash, buf, bread);
+    close(fd);
+
+    return bread < 0;
+}
+
+static char *cache_path(const char *sub, const char *name) {
+    char *path = malloc(strlen(cache_dir) + strlen(sub) + strlen(name) + 3);
+
+    sprintf(path, "%s/%s%s%s", cache_dir, sub, name[0] ? "/" : "", name);
+    return path;
+}
+
+static long long parse_size(const char *str) {
+    char *end;
+    long long size = strtoll(str, &end, 10);
+
+    switch (*end) {
+        case 'G': case 'g': size *= 1024;
+        // fallthrough
+        case 'M': case 'm': size *= 1024;
+        // fallthrough
+        case 'K': case 'k': size *= 1024;
+    }
+    return size;
+}
+
+static int cache_init(void) {
+    char *env_cache = getenv("EXE32_CACHE"), *env_size = getenv("EXE32_CACHE_SIZE"), *sub;
+    const char *subdirs[] = { "m", "r", "i" };
+    unsigned i;
+
+    if (cache_state != 0)
+        return cache_state == 1;
+
+    cache_state = -1;
+    if (env_cache == NULL || env_cache[0] == '\0' || !strcmp(env_cache, "0"))
+        return 0;
+
+    if (mkdir(env_cache, 0777) && errno != EEXIST) {
+        PRINT_DBG("> cache: cannot create \"%s\" (%s)\n", env_cache, strerror(errno));
+        return 0;
+    }
+    if ((cache_dir = realpath(env_cache, NULL)) == NULL)
+        return 0;
+    for (i = 0; i < sizeof(subdirs) / sizeof(subdirs[0]); i++) {
+        sub = cache_path(subdirs[i], "");
+        mkdir(sub, 0777);
+        free(sub);
+    }
+
+    if (env_size != NULL && parse_size(env_size) > 0)
+        cache_size_limit = parse_size(env_size);
+    cache_hardlink = getenv("EXE32_CACHE_HARDLINK") != NULL && !strcmp(getenv("EXE32_CACHE_HARDLINK"), "1");
+
+    cache_state = 1;
+    return 1;
+}
+
+/* -- statistics, kept in <dir>/stats and updated under flock -- */
+
+enum { STAT_HITS, STAT_MISSES, STAT_UNCACHEABLE, STAT_STORED, STAT_EVICTED, STAT_SIZE, NUM_STATS };
+static const char *stat_names[NUM_STATS] = { "hits", "misses", "uncacheable", "stored", "evicted", "size" };
+
+static int stats_open(long long *stats) {
+    char *path = cache_path("stats", ""), name[32];
+    long long value;
+    FILE *f;
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666), i;
+
+    free(path);
+    memset(stats, 0, NUM_STATS * sizeof(long long));
+    if (fd == -1)
+        return -1;
+
+    flock(fd, LOCK_EX);
+    if ((f = fdopen(dup(fd), "r")) != NULL) {
+        while (fscanf(f, "%31s %lld\n", name, &value) == 2) {
+            for (i = 0; i < NUM_STATS; i++) {
+                if (!strcmp(name, stat_names[i]))
+                    stats[i] = value;
+            }
+        }
+        fclose(f);
+    }
+    return fd;
+}
+
+static void stats_close(int fd, const long long *stats) {
+    char buf[256];
+    int len = 0, i;
+
+    if (fd == -1) return;
+    for (i = 0; i < NUM_STATS; i++)
+        len += snprintf(buf + len, sizeof(buf) - len, "%s %lld\n", stat_names[i], stats[i]);
+    if (ftruncate(fd, 0) == 0)
+        pwrite(fd, buf, len, 0);
+    close(fd); // releases the lock
+}
+
+static void stats_add(int stat, long long value) {
+    long long stats[NUM_STATS];
+    int fd = stats_open(stats);
+
+    stats[stat] += value;
+    stats_close(fd, stats);
+}
+
+/* -- the key of a run -- */
+
+// variables that differ between shells and make levels, but not what a program does
+static int env_ignored(const char *var) {
+    static const char *prefixes[] = {
+        "EXE32_", "MAKEFLAGS=", "MFLAGS=", "MAKELEVEL=", "MAKE_TERM", "MAKEOVERRIDES=",
+        "OLDPWD=", "PWD=", "SHLVL=", "_=", "TERM", "COLORTERM=", "LS_COLORS=",
+        "SSH_", "DISPLAY=", "WINDOWID=", "XDG_SESSION", "DBUS_", NULL
+    };
+    int i;
+
+    for (i = 0; prefixes[i] != NULL; i++) {
+        if (!strncmp(var, prefixes[i], strlen(prefixes[i])))
+            return 1;
+    }
+    return 0;
+}
+
+/*  hashing the program file on every run would cost as much as loading it, so its hash is
+ *  kept in i/<hash of its path, size, mtime and inode>
+ */
+static int hash_program(const char *prog_path, uint64_t *hash) {
+    struct stat st;
+    char name[17], *path;
+    FILE *f;
+    uint64_t stat_hash;
+
+    if (stat(prog_path, &st))
+        return 1;
+    stat_hash = fnv1a64(FNV1A64_INIT, prog_path, strlen(prog_path));
+    stat_hash = fnv1a64(stat_hash, &st.st_size, sizeof(st.st_size));
+    stat_hash = fnv1a64(stat_hash, &st.st_mtim, sizeof(st.st_mtim));
+    stat_hash = fnv1a64(stat_hash, &st.st_ino, sizeof(st.st_ino));
+    snprintf(name, sizeof(name), "%016" PRIx64, stat_hash);
+    path = cache_path("i", name);
+
+    if ((f = fopen(path, "r")) != NULL) {
+        int found = fscanf(f, "%" SCNx64, hash) == 1;
+
+        fclose(f);
+        if (found) {
+            free(path);
+            return 0;
+        }
+    }
+
+    if (hash_file(prog_path, hash)) {
+        free(path);
+        return 1;
+    }
+    if ((f = fopen(path, "w")) != NULL) {
+        fprintf(f, "%016" PRIx64 "\n", *hash);
+        fclose(f);
+    }
+    free(path);
+    return 0;
+}
+
+static int make_run_key(const char *prog_path, const char *args, const char *env) {
+    uint64_t hash = fnv1a64(FNV1A64_INIT, CACHE_VERSION, sizeof(CACHE_VERSION)), prog_hash;
+    char *cwd = getcwd(NULL, 0);
+
+    if (cwd == NULL || hash_program(prog_path, &prog_hash)) {
+        free(cwd);
+        return 1;
+    }
+
+    hash = fnv1a64(hash, &prog_hash, sizeof(prog_hash));
+    hash = fnv1a64(hash, cwd, strlen(cwd) + 1);
+    if (args != NULL)
+        hash = fnv1a64(hash, args, strlen(args));
+    hash = fnv1a64(hash, "", 1);
+    for (; env != NULL && *env; env += strlen(env) + 1) {
+        if (!env_ignored(env))
+            hash = fnv1a64(hash, env, strlen(env) + 1);
+    }
+
+    free(cwd);
+    snprintf(run_key, sizeof(run_key), "%016" PRIx64, hash);
+    return 0;
+}
+
+/* -- restoring a result -- */
+
+static int copy_file(const char *src, const char *dst) {
+    char buf[0x10000];
+    ssize_t bread = 0;
+    int in_fd, out_fd, ret = 0;
+
+    if ((in_fd = open(src, O_RDONLY | O_CLOEXEC)) == -1)
+        return 1;
+    if ((out_fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) == -1) {
+        close(in_fd);
+        return 1;
+    }
+
+#ifdef FICLONE
+    // shares the blocks on btrfs, xfs and the like
+    if (ioctl(out_fd, FICLONE, in_fd) == 0)
+        goto copy_file_close;
+#endif
+    while ((bread = read(in_fd, buf, sizeof(buf))) > 0) {
+        if (write(out_fd, buf, bread) != bread) {
+            ret = 1;
+            break;
+        }
+    }
+    if (bread < 0)
+        ret = 1;
+
+#ifdef FICLONE
+copy_file_close:
+#endif
+    close(in_fd);
+    if (close(out_fd))
+        ret = 1;
+    if (ret)
+        remove(dst);
+    return ret;
+}
+
+// puts a file of a result in place, through a temporary file next to it
+static int materialize(const char *src, const char *dst) {
+    char *tmp = malloc(strlen(dst) + 32);
+    int ret = 1;
+
+    sprintf(tmp, "%s.exe32-tmp.%d", dst, getpid());
+    if ((cache_hardlink && link(src, tmp) == 0) || copy_file(src, tmp) == 0) {
+        if ((ret = rename(tmp, dst)) != 0)
+            remove(tmp);
+    }
+    free(tmp);
+    return ret;
+}
+
+static char *read_small_file(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    char *data;
+    long size;
+
+    if (f == NULL)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    rewind(f);
+    data = malloc(size + 1);
+    *len = fread(data, 1, size, f);
+    data[*len] = '\0';
+    fclose(f);
+    return data;
+}
+
+static void replay_output(const char *result_dir, const char *name, FILE *stream) {
+    char *path = malloc(strlen(result_dir) + strlen(name) + 2), *data;
+    size_t len;
+
+    sprintf(path, "%s/%s", result_dir, name);
+    if ((data = read_small_file(path, &len)) != NULL) {
+        fwrite(data, 1, len, stream);
+        fflush(stream);
+        free(data);
+    }
+    free(path);
+}
+
+// returns 0 and the exit status of the result if all of its files could be restored
+static int restore_result(const char *result_key, int *status) {
+    char *result_dir = cache_path("r", result_key), *files, *line, *next, *src;
+    size_t len;
+    int index = 0, ret = 0;
+
+    src = malloc(strlen(result_dir) + 16);
+    sprintf(src, "%s/files", result_dir);
+    if ((files = read_small_file(src, &len)) == NULL) {
+        free(src);
+        free(result_dir);
+        return 1;
+    }
+
+    for (line = files; *line; line = next) {
+        if ((next = strchr(line, '\n')) != NULL)
+            *next++ = '\0';
+        else
+            next = line + strlen(line);
+
+        if (index == 0) {
+            *status = atoi(line);
+        }
+        else {
+            sprintf(src, "%s/%d", result_dir, index - 1);
+            if (materialize(src, line)) {
+                PRINT_DBG("> cache: cannot restore \"%s\" (%s)\n", line, strerror(errno));
+                ret = 1;
+                break;
+            }
+            depfile_note('W', line);
+        }
+        index++;
+    }
+
+    if (ret == 0) {
+        replay_output(result_dir, "stdout", stdout);
+        replay_output(result_dir, "stderr", stderr);
+        utimes(result_dir, NULL); // for the LRU eviction
+    }
+
+    free(files);
+    free(src);
+    free(result_dir);
+    return ret;
+}
+
+static int dep_matches(char kind, const char *path, uint64_t hash) {
+    struct stat st;
+    uint64_t cur_hash;
+
+    switch (kind) {
+        case 'I':
+            return !hash_file(path, &cur_hash) && cur_hash == hash;
+        case 'M':
+            return stat(path, &st) && (errno == ENOENT || errno == ENOTDIR);
+        case 'F':
+            return !stat(path, &st) && !S_ISDIR(st.st_mode);
+        case 'D':
+            return !stat(path, &st) && S_ISDIR(st.st_mode);
+    }
+    return 0;
+}
+
+// finds an earlier run with the same inputs in the manifest, and restores its result
+static int lookup(int *status) {
+    char *path = cache_path("m", run_key), *manifest, *line, *next, *entry = NULL, result_key[17] = "";
+    size_t len;
+    int matching = 0, ret = 0;
+
+    manifest = read_small_file(path, &len);
+    free(path);
+    if (manifest == NULL || strncmp(manifest, MANIFEST_HEADER "\n", sizeof(MANIFEST_HEADER))) {
+        free(manifest);
+        return 0;
+    }
+
+    for (line = manifest + sizeof(MANIFEST_HEADER); *line; line = next) {
+        uint64_t hash = 0;
+        int path_pos = 2;
+
+        if ((next = strchr(line, '\n')) != NULL)
+            *next++ = '\0';
+        else
+            next = line + strlen(line);
+
+        if (line[0] == 'E') {
+            if (matching) break;
+            snprintf(result_key, sizeof(result_key), "%s", line + 2);
+            entry = next;
+            matching = 1;
+            continue;
+        }
+        if (!matching)
+            continue;
+
+        if (line[0] == 'I') {
+            hash = strtoull(line + 2, NULL, 16);
+            path_pos = 19;
+        }
+        if (strlen(line) < (size_t) path_pos || !dep_matches(line[0], line + path_pos, hash))
+            matching = 0;
+    }
+
+    if (matching && (ret = restore_result(result_key, status) == 0)) {
+        // the files the skipped run read still go into the dependency file
+        for (; entry < line; entry += strlen(entry) + 1) {
+            if (entry[0] == 'I')
+                depfile_note('R', entry + 19);
+        }
+    }
+    free(manifest);
+    return ret;
+}
+
+/* -- recording a run -- */
+
+static void reset_run(void) {
+    int i;
+
+    for (i = 0; i < ndeps; i++)
+        free(deps[i].path);
+    for (i = 0; i < noutputs; i++)
+        free(outputs[i]);
+    ndeps = noutputs = 0;
+    for (i = 0; i < 2; i++) {
+        free(captured[i].data);
+        captured[i].data = NULL;
+        captured[i].len = captured[i].size = 0;
+    }
+    cache_recording = 0;
+    uncacheable_reason = NULL;
+}
+
+static int find_output(const char *path) {
+    int i;
+
+    for (i = 0; i < noutputs; i++) {
+        if (!strcmp(outputs[i], path))
+            return i;
+    }
+    return -1;
+}
+
+static int find_dep(const char *path) {
+    int i;
+
+    for (i = 0; i < ndeps; i++) {
+        if (!strcmp(deps[i].path, path))
+            return i;
+    }
+    return -1;
+}
+
+static void add_dep(char kind, const char *path, uint64_t hash) {
+    if (find_dep(path) != -1 || find_output(path) != -1)
+        return;
+
+    if (ndeps == max_deps) {
+        max_deps = max_deps ? max_deps * 2 : 32;
+        deps = realloc(deps, max_deps * sizeof(struct cache_dep));
+    }
+    deps[ndeps].kind = kind;
+    deps[ndeps].path = strdup(path);
+    deps[ndeps].hash = hash;
+    ndeps++;
+}
+
+void cache_uncacheable(const char *reason) {
+    if (!cache_recording) return;
+
+    PRINT_DBG("> cache: not caching this run, it %s\n", reason);
+    uncacheable_reason = reason;
+    cache_recording = 0;
+}
+
+void cache_note_read(const char *path, int writable) {
+    uint64_t hash;
+
+    if (!cache_recording || find_output(path) != -1) return;
+
+    if (writable) {
+        cache_uncacheable("modifies a file it did not create");
+        return;
+    }
+    if (find_dep(path) == -1 && hash_file(path, &hash)) {
+        cache_uncacheable("reads a file it cannot hash");
+        return;
+    }
+    add_dep('I', path, hash);
+}
+
+void cache_note_lookup(const char *path, int exists, int is_dir) {
+    if (!cache_recording) return;
+    add_dep(exists ? (is_dir ? 'D' : 'F') : 'M', path, 0);
+}
+
+void cache_note_create(const char *path) {
+    if (!cache_recording || find_output(path) != -1) return;
+
+    if (noutputs == max_outputs) {
+        max_outputs = max_outputs ? max_outputs * 2 : 8;
+        outputs = realloc(outputs, max_outputs * sizeof(char *));
+    }
+    outputs[noutputs++] = strdup(path);
+}
+
+void cache_note_remove(const char *path) {
+    int i;
+
+    if (!cache_recording) return;
+
+    // removing a temporary file it created is fine
+    if ((i = find_output(path)) == -1) {
+        cache_uncacheable("removes a file it did not create");
+        return;
+    }
+    free(outputs[i]);
+    outputs[i] = outputs[--noutputs];
+}
+
+void cache_note_rename(const char *oldpath, const char *newpath) {
+    int i, j;
+
+    if (!cache_recording) return;
+
+    if ((i = find_output(oldpath)) == -1) {
+        cache_uncacheable("renames a file it did not create");
+        return;
+    }
+
+    // a file it replaces gets replaced again when the result is restored
+    if ((j = find_output(newpath)) != -1 && j != i) {
+        free(outputs[j]);
+        outputs[j] = outputs[--noutputs];
+        if (i == noutputs)
+            i = j;
+    }
+    free(outputs[i]);
+    outputs[i] = strdup(newpath);
+}
+
+// stream is the host fd the guest wrote to, only stdout and stderr are captured
+void cache_note_output(int stream, const void *data, size_t len) {
+    struct capture *cap;
+
+    if (!cache_recording || len == 0 || (stream != 1 && stream != 2)) return;
+
+    cap = &captured[stream == 2];
+    if (cap->len + len > MAX_CAPTURE) {
+        cache_uncacheable("writes too much to stdout or stderr");
+        return;
+    }
+    if (cap->len + len > cap->size) {
+        cap->size = cap->len + len > cap->size * 2 ? cap->len + len : cap->size * 2;
+        cap->data = realloc(cap->data, cap->size);
+    }
+    memcpy(cap->data + cap->len, data, len);
+    cap->len += len;
+}
+
+// a hardlinked result file would be changed in the cache too, so it is replaced instead
+void cache_prepare_create(const char *path) {
+    struct stat st;
+
+    if (cache_hardlink && !stat(path, &st) && st.st_nlink > 1)
+        remove(path);
+}
+
+/* -- storing a result -- */
+
+static int write_file(const char *path, const void *data, size_t len) {
+    FILE *f = fopen(path, "wb");
+
+    if (f == NULL) return 1;
+    if (len) fwrite(data, 1, len, f);
+    return ferror(f) | fclose(f);
+}
+
+static long long dir_size(const char *dir) {
+    DIR *d = opendir(dir);
+    struct dirent *dent;
+    long long size = 0;
+    int dir_fd;
+
+    if (d == NULL) return 0;
+    dir_fd = dirfd(d);
+    while ((dent = readdir(d)) != NULL) {
+        struct stat st;
+
+        if (!fstatat(dir_fd, dent->d_name, &st, 0) && S_ISREG(st.st_mode))
+            size += st.st_size;
+    }
+    closedir(d);
+    return size;
+}
+
+static void remove_dir(const char *dir) {
+    DIR *d = opendir(dir);
+    struct dirent *dent;
+
+    if (d != NULL) {
+        while ((dent = readdir(d)) != NULL) {
+            if (dent->d_name[0] != '.')
+                unlinkat(dirfd(d), dent->d_name, 0);
+        }
+        closedir(d);
+    }
+    rmdir(dir);
+}
+
+struct result_entry {
+    char name[32];
+    time_t mtime;
+    long long size;
+};
+
+static int result_mtime_cmp(const void *a, const void *b) {
+    const struct result_entry *ra = a, *rb = b;
+    return (ra->mtime > rb->mtime) - (ra->mtime < rb->mtime);
+}
+
+// removes the least recently used results until they're below 90% of the limit
+static void evict(long long *stats) {
+    char *results_dir = cache_path("r", ""), *path;
+    struct result_entry *entries = NULL;
+    int nentries = 0, max_entries = 0, i;
+    long long total = 0;
+    struct dirent *dent;
+    DIR *d;
+
+    if ((d = opendir(results_dir)) == NULL) {
+        free(results_dir);
+        return;
+    }
+    while ((dent = readdir(d)) != NULL) {
+        struct stat st;
+
+        if (dent->d_name[0] == '.' || strlen(dent->d_name) >= sizeof(entries[0].name)
+                || fstatat(dirfd(d), dent->d_name, &st, 0))
+            continue;
+        if (nentries == max_entries) {
+            max_entries = max_entries ? max_entries * 2 : 256;
+            entries = realloc(entries, max_entries * sizeof(struct result_entry));
+        }
+        strcpy(entries[nentries].name, dent->d_name);
+        entries[nentries].mtime = st.st_mtime;
+        path = cache_path("r", dent->d_name);
+        entries[nentries].size = dir_size(path);
+        free(path);
+        total += entries[nentries].size;
+        nentries++;
+    }
+    closedir(d);
+
+    qsort(entries, nentries, sizeof(struct result_entry), result_mtime_cmp);
+    for (i = 0; i < nentries && total > cache_size_limit / 10 * 9; i++) {
+        path = cache_path("r", entries[i].name);
+        remove_dir(path);
+        free(path);
+        total -= entries[i].size;
+        stats[STAT_EVICTED]++;
+    }
+
+    stats[STAT_SIZE] = total;
+    free(entries);
+    free(results_dir);
+}
+
+// adds the result in front of the other runs of the manifest
+static void add_manifest_entry(const char *result_key) {
+    char *path = cache_path("m", run_key), *tmp_path, *old, *line, *next;
+    size_t len;
+    int lock_fd, i, entries = 1, skipping = 0;
+    FILE *f;
+
+    tmp_path = malloc(strlen(path) + 32);
+    sprintf(tmp_path, "%s.tmp.%d", path, getpid());
+    lock_fd = open(path, O_RDONLY | O_CREAT | O_CLOEXEC, 0666);
+    if (lock_fd != -1)
+        flock(lock_fd, LOCK_EX);
+
+    if ((f = fopen(tmp_path, "w")) == NULL)
+        goto add_manifest_free;
+
+    fprintf(f, MANIFEST_HEADER "\nE %s\n", result_key);
+    for (i = 0; i < ndeps; i++) {
+        if (deps[i].kind == 'I')
+            fprintf(f, "I %016" PRIx64 " %s\n", deps[i].hash, deps[i].path);
+        else
+            fprintf(f, "%c %s\n", deps[i].kind, deps[i].path);
+    }
+
+    old = read_small_file(path, &len);
+    if (old != NULL && !strncmp(old, MANIFEST_HEADER "\n", sizeof(MANIFEST_HEADER))) {
+        for (line = old + sizeof(MANIFEST_HEADER); *line; line = next) {
+            if ((next = strchr(line, '\n')) != NULL)
+                *next++ = '\0';
+            else
+                next = line + strlen(line);
+
+            // the old entry of the same result is replaced by this one
+            if (line[0] == 'E') {
+                if (++entries > MAX_MANIFEST_ENTRIES)
+                    break;
+                skipping = !strcmp(line + 2, result_key);
+            }
+            if (!skipping)
+                fprintf(f, "%s\n", line);
+        }
+    }
+    free(old);
+
+    if (ferror(f) | fclose(f) || rename(tmp_path, path))
+        remove(tmp_path);
+
+add_manifest_free:
+    if (lock_fd != -1)
+        close(lock_fd);
+    free(tmp_path);
+    free(path);
+}
+
+static void store_result(int status) {
+    uint64_t hash = fnv1a64(FNV1A64_INIT, run_key, sizeof(run_key));
+    char result_key[17], *result_dir, *tmp_dir, *file_path;
+    long long stats[NUM_STATS], size;
+    FILE *files;
+    int i, stats_fd, failed = 0;
+
+    // files that were missing before and are created by the run don't need to stay missing
+    for (i = 0; i < ndeps; i++) {
+        if (deps[i].kind != 'I' && find_output(deps[i].path) != -1)
+            deps[i].kind = 0;
+        else
+            hash = fnv1a64(fnv1a64(hash, deps[i].path, strlen(deps[i].path) + 1), &deps[i].hash, sizeof(uint64_t));
+    }
+    for (i = 0; i < ndeps; i++) {
+        if (deps[i].kind == 0) {
+            free(deps[i].path);
+            deps[i--] = deps[--ndeps];
+        }
+    }
+    snprintf(result_key, sizeof(result_key), "%016" PRIx64, hash);
+
+    result_dir = cache_path("r", result_key);
+    tmp_dir = malloc(strlen(result_dir) + 32);
+    sprintf(tmp_dir, "%s.tmp.%d", result_dir, getpid());
+    file_path = malloc(strlen(tmp_dir) + 16);
+    if (mkdir(tmp_dir, 0777)) {
+        PRINT_DBG("> cache: cannot create \"%s\" (%s)\n", tmp_dir, strerror(errno));
+        goto store_result_free;
+    }
+
+    sprintf(file_path, "%s/files", tmp_dir);
+    if ((files = fopen(file_path, "w")) == NULL) {
+        failed = 1;
+    }
+    else {
+        fprintf(files, "%d\n", status);
+        for (i = 0; i < noutputs && !failed; i++) {
+            sprintf(file_path, "%s/%d", tmp_dir, i);
+            failed = copy_file(outputs[i], file_path);
+            fprintf(files, "%s\n", outputs[i]);
+        }
+        failed |= ferror(files) | fclose(files);
+    }
+    for (i = 0; i < 2 && !failed; i++) {
+        sprintf(file_path, "%s/%s", tmp_dir, i ? "stderr" : "stdout");
+        failed = write_file(file_path, captured[i].data, captured[i].len);
+    }
+
+    size = dir_size(tmp_dir);
+    if (failed || rename(tmp_dir, result_dir)) {
+        // failed, or another process stored the same result first
+        remove_dir(tmp_dir);
+        if (failed) {
+            PRINT_DBG("> cache: cannot store the result (%s)\n", strerror(errno));
+            goto store_result_free;
+        }
+    }
+    else {
+        stats_fd = stats_open(stats);
+        stats[STAT_STORED]++;
+        stats[STAT_SIZE] += size;
+        if (stats[STAT_SIZE] > cache_size_limit)
+            evict(stats);
+        stats_close(stats_fd, stats);
+    }
+
+    add_manifest_entry(result_key);
+    last_result = "miss, stored";
+
+store_result_free:
+    free(file_path);
+    free(tmp_dir);
+    free(result_dir);
+}
+
+/* -- called by the loader -- */
+
+/*  looks the run up before the program starts. returns 1 with the exit status of the
+ *  cached run once its files and output are restored, otherwise starts recording it.
+ */
+int cache_begin(const char *prog_path, const char *args, const char *env, int *status) {
+    reset_run();
+    if (!cache_init())
+        return 0;
+
+    if (make_run_key(prog_path, args, env)) {
+        last_result = "cannot compute the key";
+        return 0;
+    }
+    if (lookup(status)) {
+        PRINT_DBG("> cache: hit for %s, exit status %d\n", run_key, *status);
+        last_result = "hit";
+        stats_add(STAT_HITS, 1);
+        return 1;
+    }
+
+    PRINT_DBG("> cache: miss for %s\n", run_key);
+    last_result = "miss";
+    stats_add(STAT_MISSES, 1);
+    cache_recording = 1;
+    return 0;
+}
+
+// forgets the run without storing it, in a forked child that is going to run another program
+void cache_abandon(void) {
+    reset_run();
+}
+
+// stores the run when the program exits
+void cache_finish(int status) {
+    if (uncacheable_reason != NULL) {
+        last_result = uncacheable_reason;
+        stats_add(STAT_UNCACHEABLE, 1);
+    }
+    else if (cache_recording) {
+        cache_recording = 0;
+        fflush(NULL);
+        store_result(status);
+    }
+    reset_run();
+}
+
+void cache_print_stats(void) {
+    if (cache_state != 1)
+        PRINT_ERR("  cache: disabled\n");
+    else if (!strcmp(last_result, "hit") || !strncmp(last_result, "miss", 4))
+        PRINT_ERR("  cache: %s (%s)\n", last_result, run_key);
+    else
+        PRINT_ERR("  cache: not cached, it %s\n", last_result);
+}
+
+// exe32-linux --cache-stats
+int cache_show_stats(void) {
+    long long stats[NUM_STATS];
+    int fd, i;
+
+    if (!cache_init()) {
+        PRINT_ERR("The cache is disabled, set EXE32_CACHE=<dir> to enable it.\n");
+        return 1;
+    }
+
+    fd = stats_open(stats);
+    printf("cache directory  %s\n", cache_dir);
+    for (i = 0; i < NUM_STATS; i++)
+        printf("%-16s %lld\n", stat_names[i], stats[i]);
+    printf("%-16s %lld\n", "size limit", cache_size_limit);
+    if (stats[STAT_HITS] + stats[STAT_MISSES] > 0)
+        printf("%-16s %.1f%%\n", "hit rate", 100.0 * stats[STAT_HITS] / (stats[STAT_HITS] + stats[STAT_MISSES]));
+    if (fd != -1)
+        close(fd);
+    return 0;
+}
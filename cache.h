@@ -0,0 +1,24 @@
+#ifndef EXE32_CACHE_H
+#define EXE32_CACHE_H
+
+#include <stddef.h>
+
+extern int cache_recording;
+
+int cache_begin(const char *, const char *, const char *, int *);
+void cache_finish(int);
+void cache_abandon(void);
+
+void cache_uncacheable(const char *);
+void cache_note_read(const char *, int);
+void cache_note_lookup(const char *, int, int);
+void cache_note_create(const char *);
+void cache_note_remove(const char *);
+void cache_note_rename(const char *, const char *);
+void cache_note_output(int, const void *, size_t);
+void cache_prepare_create(const char *);
+
+void cache_print_stats(void);
+int cache_show_stats(void);
+
+#endif // EXE32_CACHE_H
@@ -3,6 +3,10 @@
 
 #include <string.h>
 
+#ifndef EXEPROGNAME
+#define EXEPROGNAME "exe32-linux"
+#endif
+
 typedef unsigned int uint;
 typedef unsigned long ulong;
 typedef unsigned short ushort;
@@ -11,6 +15,30 @@ __attribute__((format(printf,1,2))) void write_log(const char *, ...);
 
 #define UNUSED __attribute__((unused))
 
+#define ROUNDOFF(val, mul) (((val) + ((mul) - 1)) & ~((mul) - 1))
+#define ROUNDDOWN(val, mul) ((val) & ~((mul) - 1))
+
+// FNV-1a, for cache keys and checksums
+#define FNV1A_INIT 0x811c9dc5
+
+static inline uint fnv1a(uint hash, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+
+    while (len--) {
+        hash ^= *bytes++;
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+static inline uint fnv1a_str(uint hash, const char *str) {
+    while (*str) {
+        hash ^= (unsigned char) *str++;
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
 #define PRINT_ERR(...) fprintf(stderr, __VA_ARGS__)
 
 #ifndef NDEBUG
@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include "common.h"
+#include "depfile.h"
+
+/*  Dependency files (EXE32_DEPFILE=<file.d>)
+ *
+ *  Every file a program reads, creates, removes or renames is logged as "<R|W|D> <absolute path>"
+ *  to <file.d>.log.<pid>, which is passed to spawned programs in EXE32_DEPFILE_LOG so their
+ *  accesses end up in the same log. When the first loader exits it turns the log into a make
+ *  rule: the files that were created and still exist depend on the files that were read and
+ *  not created by the run. EXE32_DEPTARGET=<target> sets the target of the rule instead.
+ */
+
+#define MAX_LOG_LINE (PATH_MAX + 4)
+
+static char *depfile_path = NULL, *log_path = NULL;
+static int log_fd = -1;
+static pid_t owner_pid = 0;
+
+struct path_list {
+    char **paths;
+    int count, size;
+};
+
+static char *absolute_path(const char *path) {
+    char *cwd, *abs_path;
+
+    if (path[0] == '/' || (cwd = getcwd(NULL, 0)) == NULL)
+        return strdup(path);
+
+    abs_path = malloc(strlen(cwd) + strlen(path) + 2);
+    strcpy(abs_path, cwd);
+    strcat(abs_path, "/");
+    strcat(abs_path, path[0] == '.' && path[1] == '/' ? path + 2 : path);
+    free(cwd);
+    return abs_path;
+}
+
+static void depfile_finish(void);
+
+void depfile_init(void) {
+    char *env_depfile = getenv("EXE32_DEPFILE"), *env_log = getenv("EXE32_DEPFILE_LOG");
+
+    if (log_fd != -1) {
+        close(log_fd);
+        log_fd = -1;
+    }
+    free(log_path);
+    log_path = NULL;
+
+    if (env_log != NULL && env_log[0] != '\0') {
+        // spawned by a program that is already logging
+        log_path = strdup(env_log);
+    }
+    else if (env_depfile != NULL && env_depfile[0] != '\0') {
+        char pidstr[24];
+
+        depfile_path = absolute_path(env_depfile);
+        snprintf(pidstr, sizeof(pidstr), ".log.%d", getpid());
+        log_path = malloc(strlen(depfile_path) + strlen(pidstr) + 1);
+        strcpy(log_path, depfile_path);
+        strcat(log_path, pidstr);
+
+        owner_pid = getpid();
+        setenv("EXE32_DEPFILE_LOG", log_path, 1);
+        atexit(depfile_finish);
+    }
+    else return;
+
+    log_fd = open(log_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    if (log_fd == -1)
+        PRINT_ERR("Cannot open dependency log \"%s\": %s\n", log_path, strerror(errno));
+}
+
+void depfile_note(char kind, const char *path) {
+    char line[MAX_LOG_LINE], *abs_path;
+    int len;
+
+    if (log_fd == -1) return;
+
+    abs_path = absolute_path(path);
+    len = snprintf(line, sizeof(line), "%c %s\n", kind, abs_path);
+    free(abs_path);
+    // one write per line, so lines of processes writing at once don't mix
+    if (len < (int) sizeof(line))
+        write(log_fd, line, len);
+}
+
+static int list_find(struct path_list *list, const char *path) {
+    int i;
+
+    for (i = 0; i < list->count; i++) {
+        if (!strcmp(list->paths[i], path))
+            return i;
+    }
+    return -1;
+}
+
+static void list_add(struct path_list *list, const char *path) {
+    if (list_find(list, path) != -1) return;
+
+    if (list->count == list->size) {
+        list->size = list->size ? list->size * 2 : 64;
+        list->paths = realloc(list->paths, list->size * sizeof(char *));
+    }
+    list->paths[list->count++] = strdup(path);
+}
+
+static void list_remove(struct path_list *list, const char *path) {
+    int i = list_find(list, path);
+
+    if (i == -1) return;
+    free(list->paths[i]);
+    memmove(&list->paths[i], &list->paths[i+1], (list->count - i - 1) * sizeof(char *));
+    list->count--;
+}
+
+static void list_free(struct path_list *list) {
+    int i;
+
+    for (i = 0; i < list->count; i++)
+        free(list->paths[i]);
+    free(list->paths);
+}
+
+// paths are relative to the directory make runs the loader in, and escaped for make
+static void write_make_path(FILE *f, const char *path, const char *cwd, size_t cwd_len) {
+    if (!strncmp(path, cwd, cwd_len) && path[cwd_len] == '/')
+        path += cwd_len + 1;
+
+    for (; *path; path++) {
+        if (*path == ' ' || *path == '#' || *path == '\\')
+            fputc('\\', f);
+        else if (*path == '$')
+            fputc('$', f);
+        fputc(*path, f);
+    }
+}
+
+static void depfile_finish(void) {
+    struct path_list reads = { NULL, 0, 0 }, writes = { NULL, 0, 0 }, created = { NULL, 0, 0 };
+    char line[MAX_LOG_LINE], *cwd = getcwd(NULL, 0), *tmp_path, *target = getenv("EXE32_DEPTARGET");
+    size_t cwd_len;
+    FILE *flog, *fdep;
+    int i;
+
+    if (owner_pid != getpid() || log_path == NULL)
+        return;
+    if (cwd == NULL)
+        cwd = strdup("");
+    cwd_len = strlen(cwd);
+
+    if (log_fd != -1) {
+        close(log_fd);
+        log_fd = -1;
+    }
+    if ((flog = fopen(log_path, "r")) == NULL)
+        goto depfile_finish_free;
+
+    while (fgets(line, sizeof(line), flog) != NULL) {
+        char *path = line + 2;
+
+        line[strcspn(line, "\n")] = '\0';
+        switch (line[0]) {
+            case 'R':
+                list_add(&reads, path);
+                break;
+            case 'W':
+                list_add(&writes, path);
+                list_add(&created, path);
+                break;
+            case 'D':
+                list_remove(&writes, path);
+                break;
+        }
+    }
+    fclose(flog);
+
+    // files the run created itself are intermediates or targets, not dependencies
+    for (i = 0; i < created.count; i++)
+        list_remove(&reads, created.paths[i]);
+
+    tmp_path = malloc(strlen(depfile_path) + sizeof(".tmp"));
+    strcpy(tmp_path, depfile_path);
+    strcat(tmp_path, ".tmp");
+    if ((fdep = fopen(tmp_path, "w")) == NULL) {
+        PRINT_ERR("Cannot write dependency file \"%s\": %s\n", tmp_path, strerror(errno));
+        free(tmp_path);
+        goto depfile_finish_free;
+    }
+
+    // the rule's targets, then the dependencies
+    if (target != NULL && target[0] != '\0') {
+        write_make_path(fdep, target, cwd, cwd_len);
+    }
+    else {
+        int ntargets = 0;
+
+        for (i = 0; i < writes.count; i++) {
+            if (!access(writes.paths[i], F_OK)) {
+                if (ntargets++ > 0)
+                    fputc(' ', fdep);
+                write_make_path(fdep, writes.paths[i], cwd, cwd_len);
+            }
+        }
+    }
+    fputc(':', fdep);
+    for (i = 0; i < reads.count; i++) {
+        if (!access(reads.paths[i], F_OK)) {
+            fputs(" \\\n  ", fdep);
+            write_make_path(fdep, reads.paths[i], cwd, cwd_len);
+        }
+    }
+    fputc('\n', fdep);
+
+    // an empty rule for each dependency, so make doesn't fail when one is removed
+    for (i = 0; i < reads.count; i++) {
+        if (!access(reads.paths[i], F_OK)) {
+            fputc('\n', fdep);
+            write_make_path(fdep, reads.paths[i], cwd, cwd_len);
+            fputs(":\n", fdep);
+        }
+    }
+
+    if (ferror(fdep) | fclose(fdep) || rename(tmp_path, depfile_path)) {
+        PRINT_ERR("Cannot write dependency file \"%s\": %s\n", depfile_path, strerror(errno));
+        remove(tmp_path);
+    }
+    free(tmp_path);
+
+depfile_finish_free:
+    remove(log_path);
+    list_free(&reads);
+    list_free(&writes);
+    list_free(&created);
+    free(cwd);
+}
@@ -0,0 +1,7 @@
+#ifndef EXE32_DEPFILE_H
+#define EXE32_DEPFILE_H
+
+void depfile_init(void);
+void depfile_note(char, const char *);
+
+#endif // EXE32_DEPFILE_H
@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "dircache.h"
+
+/*  Directory cache for case-insensitive paths
+ *
+ *  replace_case_path looks names up here instead of reading the directory each time. A
+ *  directory is read once, the first time a name is looked up in it, and its names are
+ *  kept in a hash table by their lowercase form. Files and directories the program creates,
+ *  removes or renames are added and removed by the wrappers.
+ *
+ *  Other processes change directories too, so a name that isn't found makes the directory
+ *  be read again if it changed since (or changed too close to when it was read to tell).
+ *  A name that is found is trusted: at worst the file was removed and opening it fails
+ *  like it would have. Everything is forgotten when the program changes directories.
+ */
+
+#define DIR_BUCKETS 256
+
+struct dc_name {
+    struct dc_name *next;
+    uint hash;
+    char name[];
+};
+
+struct dc_dir {
+    struct dc_dir *next;
+    uint hash;
+    struct dc_name **names;
+    uint num_buckets, num_names;
+    struct timespec mtime;
+    time_t read_time;
+    char path[];    /* as replace_case_path builds it: "" for the current directory, else ending in '/' */
+};
+
+static struct dc_dir *dirs[DIR_BUCKETS];
+
+static uint stat_lookups = 0, stat_hits = 0, stat_reads = 0;
+
+static uint hash_path(const char *path, size_t len) {
+    uint hash = 2166136261u;
+
+    while (len--)
+        hash = (hash ^ (unsigned char) *path++) * 16777619u;
+    return hash;
+}
+
+static uint hash_name(const char *name, size_t len) {
+    uint hash = 2166136261u;
+
+    while (len--)
+        hash = (hash ^ (unsigned char) tolower((unsigned char) *name++)) * 16777619u;
+    return hash;
+}
+
+static void free_names(struct dc_dir *dir) {
+    uint i;
+
+    for (i = 0; i < dir->num_buckets; i++) {
+        struct dc_name *name = dir->names[i], *next;
+
+        for (; name != NULL; name = next) {
+            next = name->next;
+            free(name);
+        }
+    }
+    free(dir->names);
+    dir->names = NULL;
+    dir->num_buckets = dir->num_names = 0;
+}
+
+static void add_name(struct dc_dir *dir, const char *name, size_t len) {
+    uint hash = hash_name(name, len);
+    struct dc_name *dname = malloc(sizeof(*dname) + len + 1);
+
+    // the buckets only grow when the program adds many files
+    if (dir->num_names >= dir->num_buckets * 2) {
+        uint new_buckets = dir->num_buckets ? dir->num_buckets * 4 : 16, i;
+        struct dc_name **names = calloc(new_buckets, sizeof(*names));
+
+        for (i = 0; i < dir->num_buckets; i++) {
+            struct dc_name *n = dir->names[i], *next;
+
+            for (; n != NULL; n = next) {
+                next = n->next;
+                n->next = names[n->hash & (new_buckets - 1)];
+                names[n->hash & (new_buckets - 1)] = n;
+            }
+        }
+        free(dir->names);
+        dir->names = names;
+        dir->num_buckets = new_buckets;
+    }
+
+    dname->hash = hash;
+    memcpy(dname->name, name, len);
+    dname->name[len] = '\0';
+    dname->next = dir->names[hash & (dir->num_buckets - 1)];
+    dir->names[hash & (dir->num_buckets - 1)] = dname;
+    dir->num_names++;
+}
+
+// reads the directory, returns 1 if it can't
+static int read_dir(struct dc_dir *dir) {
+    struct dirent *dent;
+    struct stat st;
+    DIR *d;
+
+    free_names(dir);
+    if ((d = opendir(dir->path[0] ? dir->path : ".")) == NULL)
+        return 1;
+    fstat(dirfd(d), &st);
+    dir->mtime = st.st_mtim;
+    dir->read_time = time(NULL);
+    stat_reads++;
+
+    while ((dent = readdir(d)) != NULL)
+        add_name(dir, dent->d_name, strlen(dent->d_name));
+    closedir(d);
+    return 0;
+}
+
+// if the directory changed since it was read, or it can't be told
+static int dir_changed(struct dc_dir *dir) {
+    struct stat st;
+
+    if (stat(dir->path[0] ? dir->path : ".", &st))
+        return 1;
+    return st.st_mtim.tv_sec != dir->mtime.tv_sec || st.st_mtim.tv_nsec != dir->mtime.tv_nsec
+        || dir->mtime.tv_sec >= dir->read_time - 1;
+}
+
+static struct dc_dir *find_dir(const char *path, size_t len, int create) {
+    uint hash = hash_path(path, len);
+    struct dc_dir **pdir = &dirs[hash % DIR_BUCKETS], *dir;
+
+    for (dir = *pdir; dir != NULL; dir = dir->next) {
+        if (dir->hash == hash && !strncmp(dir->path, path, len) && dir->path[len] == '\0')
+            return dir;
+    }
+    if (!create)
+        return NULL;
+
+    dir = calloc(1, sizeof(*dir) + len + 1);
+    memcpy(dir->path, path, len);
+    dir->path[len] = '\0';
+    dir->hash = hash;
+    if (read_dir(dir)) {
+        free(dir);
+        return NULL;
+    }
+    dir->next = *pdir;
+    *pdir = dir;
+    return dir;
+}
+
+static struct dc_name *find_name(struct dc_dir *dir, const char *name, size_t len) {
+    uint hash = hash_name(name, len);
+    struct dc_name *dname, *found = NULL;
+
+    if (dir->num_buckets == 0)
+        return NULL;
+    for (dname = dir->names[hash & (dir->num_buckets - 1)]; dname != NULL; dname = dname->next) {
+        if (dname->hash != hash || strncasecmp(dname->name, name, len) || dname->name[len] != '\0')
+            continue;
+        // the exact name wins if there are more
+        if (!strncmp(dname->name, name, len))
+            return dname;
+        if (found == NULL)
+            found = dname;
+    }
+    return found;
+}
+
+/*  the real name of the first len bytes of name in the directory dir (built like
+ *  replace_case_path does), or NULL if there is none or the directory can't be read.
+ */
+const char *dircache_lookup(const char *dir_path, const char *name, size_t len) {
+    struct dc_dir *dir = find_dir(dir_path, strlen(dir_path), 1);
+    struct dc_name *dname;
+
+    stat_lookups++;
+    if (dir == NULL)
+        return NULL;
+
+    if ((dname = find_name(dir, name, len)) == NULL && dir_changed(dir)) {
+        read_dir(dir);
+        dname = find_name(dir, name, len);
+    }
+    if (dname == NULL)
+        return NULL;
+
+    stat_hits++;
+    return dname->name;
+}
+
+// splits a path into the directory as replace_case_path builds it and the name
+static struct dc_dir *path_dir(const char *path, const char **name) {
+    const char *slash = strrchr(path, '/');
+
+    if (slash == NULL) {
+        *name = path;
+        return find_dir("", 0, 0);
+    }
+    *name = slash + 1;
+    return find_dir(path, slash + 1 - path, 0);
+}
+
+void dircache_add(const char *path) {
+    const char *name;
+    struct dc_dir *dir = path_dir(path, &name);
+    struct dc_name *dname;
+
+    if (dir == NULL || *name == '\0')
+        return;
+    // another case of the name doesn't count
+    if ((dname = find_name(dir, name, strlen(name))) == NULL || strcmp(dname->name, name))
+        add_name(dir, name, strlen(name));
+}
+
+// forgets a removed file, or a directory and everything under it
+void dircache_remove(const char *path) {
+    const char *name;
+    struct dc_dir *dir = path_dir(path, &name);
+    size_t len = strlen(path);
+    uint i;
+
+    if (dir != NULL && *name != '\0' && dir->num_buckets > 0) {
+        struct dc_name **pname = &dir->names[hash_name(name, strlen(name)) & (dir->num_buckets - 1)];
+
+        for (; *pname != NULL; pname = &(*pname)->next) {
+            if (!strcmp((*pname)->name, name)) {
+                struct dc_name *dname = *pname;
+
+                *pname = dname->next;
+                free(dname);
+                dir->num_names--;
+                break;
+            }
+        }
+    }
+
+    for (i = 0; i < DIR_BUCKETS; i++) {
+        struct dc_dir **pdir = &dirs[i];
+
+        while (*pdir != NULL) {
+            struct dc_dir *d = *pdir;
+
+            if (!strncmp(d->path, path, len) && d->path[len] == '/') {
+                *pdir = d->next;
+                free_names(d);
+                free(d);
+            }
+            else pdir = &d->next;
+        }
+    }
+}
+
+void dircache_flush(void) {
+    uint i;
+
+    for (i = 0; i < DIR_BUCKETS; i++) {
+        while (dirs[i] != NULL) {
+            struct dc_dir *dir = dirs[i];
+
+            dirs[i] = dir->next;
+            free_names(dir);
+            free(dir);
+        }
+    }
+}
+
+void dircache_print_stats(void) {
+    PRINT_ERR("  dircache: %u lookups, %u found, %u directory reads\n", stat_lookups, stat_hits, stat_reads);
+}
@@ -0,0 +1,12 @@
+#ifndef EXE32_DIRCACHE_H
+#define EXE32_DIRCACHE_H
+
+#include <stddef.h>
+
+const char *dircache_lookup(const char *, const char *, size_t);
+void dircache_add(const char *);
+void dircache_remove(const char *);
+void dircache_flush(void);
+void dircache_print_stats(void);
+
+#endif // EXE32_DIRCACHE_H
@@ -1,32 +1,579 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
 #include "common.h"
 #include "fd.h"
 
-FILE *fd_fileptrs[NUM_FILEPTRS];
+/*  Guest file handles
+ *
+ *  Handles are host fds. Regular files the guest opens keep their own file position, so
+ *  seeking is only setting a number: files opened read-only are read from a mapping of the
+ *  whole file, the others with pread/pwrite at the position. The mapping is dropped when
+ *  the file is opened for writing, reads then use pread as well. Files may also be
+ *  truncated by the programs this one spawns, so after a spawn or a create the length of
+ *  a mapping is checked again before it's read, and a file that got shorter is read with
+ *  pread instead of faulting past its end. The standard handles are
+ *  shared with other processes and use the host's file offset with read/write instead.
+ *
+ *  Writes collect in a buffer of EXE32_WRITEBUF bytes per handle (64K by default, 0 writes
+ *  every write right away). It's written out when it's full, when a write doesn't continue
+ *  it, before the same file is read or opened through any handle, before the program looks
+ *  at file attributes, when the handle is closed or replaced by dup2, before a program is
+ *  spawned and at exit. Writes to a terminal or to stderr are written right away, so the
+ *  diagnostics of a program that crashes aren't lost, and stdout is written out before
+ *  writing to stderr (and the other way around) to keep their order when both go to the
+ *  same file. Reads from a pipe or terminal are buffered too. A write that fails when the
+ *  buffer is written out fails the close, or the program's exit status at exit.
+ */
 
-int append_fd(FILE *fstream) {
+#define DEFAULT_WRITE_BUF (64 * 1024)
+#define STREAM_READ_BUF 4096
+#define RESERVED_HOST_FDS 32 /* for the loader itself: logs, sockets, spawning */
+
+/*  The handle table starts with NUM_FILEPTRS slots and doubles when it's full, up to
+ *  EXE32_MAXFILES handles (1024 by default, and no more than the host lets the loader
+ *  open). New handles get the lowest free slot like DOS does, first_free remembers where
+ *  to start looking. dup and dup2 share a handle between slots, it's closed when the last
+ *  slot that has it is.
+ */
+struct fd_handle **fd_handles = NULL;
+int fd_table_size = 0;
+
+static struct fd_handle std_handles[3];
+static int first_free = 0, max_files = 0;
+
+static long write_buf_size = -1;
+
+static uint stat_reads = 0, stat_read_calls = 0;
+static uint stat_writes = 0, stat_write_calls = 0;
+static uint stat_seeks = 0, stat_seek_calls = 0;
+static int stat_max_handles = 0;
+static int pending_handles = 0; // regular files with something in their write buffer
+static uint files_gen = 0;      // bumped when files may have changed behind the mappings
+
+static void init_limits(void) {
+    char *env_size = getenv("EXE32_WRITEBUF"), *env_max = getenv("EXE32_MAXFILES");
+    struct rlimit rl;
+
+    write_buf_size = env_size != NULL ? atol(env_size) : DEFAULT_WRITE_BUF;
+    if (write_buf_size < 0)
+        write_buf_size = DEFAULT_WRITE_BUF;
+
+    max_files = env_max != NULL ? atoi(env_max) : DEFAULT_MAX_FILES;
+    if (max_files < NUM_FILEPTRS)
+        max_files = NUM_FILEPTRS;
+
+    // every handle is a host fd, ask for as many as the host allows if needed
+    if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < (rlim_t) max_files + RESERVED_HOST_FDS) {
+        rlim_t want = (rlim_t) max_files + RESERVED_HOST_FDS;
+
+        rl.rlim_cur = rl.rlim_max == RLIM_INFINITY || rl.rlim_max > want ? want : rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+        if (rl.rlim_cur < want) {
+            PRINT_DBG("> fd: the host only allows %lu files, %d handles at most\n", (ulong) rl.rlim_cur,
+                (int) rl.rlim_cur - RESERVED_HOST_FDS);
+            max_files = (int) rl.rlim_cur - RESERVED_HOST_FDS;
+            if (max_files < NUM_FILEPTRS)
+                max_files = NUM_FILEPTRS;
+        }
+    }
+}
+
+static struct fd_handle *new_handle(int fd, int flags) {
+    struct fd_handle *handle = calloc(1, sizeof(*handle));
+
+    handle->fd = fd;
+    handle->flags = flags;
+    return handle;
+}
+
+// puts a handle in the lowest free slot, returns the guest handle or -1 if the table is full
+static int add_handle(struct fd_handle *handle) {
+    int i;
+
+    for (i = first_free; i < fd_table_size && fd_handles[i] != NULL; i++);
+
+    if (i == fd_table_size) {
+        int new_size = fd_table_size * 2;
+
+        if (fd_table_size >= max_files)
+            return -1;
+        if (new_size > max_files)
+            new_size = max_files;
+        fd_handles = realloc(fd_handles, new_size * sizeof(*fd_handles));
+        memset(fd_handles + fd_table_size, 0, (new_size - fd_table_size) * sizeof(*fd_handles));
+        fd_table_size = new_size;
+    }
+
+    fd_handles[i] = handle;
+    handle->refs++;
+    first_free = i + 1;
+    if (i + 1 > stat_max_handles)
+        stat_max_handles = i + 1;
+    return i;
+}
+
+static int close_handle(struct fd_handle *handle);
+static int flush_same(dev_t dev, ino_t ino, int *flushed);
+
+static void drop_map(struct fd_handle *handle) {
+    munmap(handle->map, handle->map_len);
+    handle->map = NULL;
+    handle->map_len = 0;
+}
+
+// a file opened for writing may be truncated, and reading its mapping past the end would fault
+static void drop_maps(dev_t dev, ino_t ino) {
+    int i;
+
+    for (i = 0; i < fd_table_size; i++) {
+        struct fd_handle *handle = fd_handles[i];
+
+        if (handle != NULL && handle->map != NULL && handle->dev == dev && handle->ino == ino) {
+            PRINT_DBG("> fd: dropping the mapping of handle %d\n", i);
+            drop_map(handle);
+        }
+    }
+}
+
+/*  makes a handle of a host fd opened by the guest, and gives it the lowest free guest
+ *  handle. returns the guest handle or -1, and the host fd is closed if there is none.
+ */
+int fd_open(int fd, int flags) {
+    struct fd_handle *handle;
+    struct stat st;
+    int guest_fd;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        int flushed = 0;
+
+        flags |= FD_POSITIONAL;
+        // what other handles wrote to it, so the size is right
+        flush_same(st.st_dev, st.st_ino, &flushed);
+        if (flushed)
+            fstat(fd, &st);
+        if (flags & FD_WRITE)
+            drop_maps(st.st_dev, st.st_ino);
+    }
+    else if (isatty(fd)) {
+        flags |= FD_TTY;
+    }
+    handle = new_handle(fd, flags);
+    if (flags & FD_POSITIONAL) {
+        handle->dev = st.st_dev;
+        handle->ino = st.st_ino;
+    }
+
+    // read-only files are read from memory
+    if ((flags & (FD_POSITIONAL | FD_WRITE)) == FD_POSITIONAL && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (map != MAP_FAILED) {
+            handle->map = map;
+            handle->map_len = st.st_size;
+            handle->map_checked = files_gen;
+        }
+    }
+
+    if ((guest_fd = add_handle(handle)) == -1)
+        close_handle(handle);
+    return guest_fd;
+}
+
+int fd_dup(int guest_fd) {
+    return add_handle(fd_handles[guest_fd]);
+}
+
+int fd_dup2(int src_fd, int dest_fd) {
+    struct fd_handle *handle = fd_handles[src_fd];
+
+    if (src_fd == dest_fd)
+        return dest_fd;
+
+    // the source can't go away while the destination is released
+    handle->refs++;
+    fd_release(dest_fd);
+    fd_handles[dest_fd] = handle;
+    if (dest_fd == first_free)
+        first_free++;
+    return dest_fd;
+}
+
+void init_fd_handles(void) {
     int i;
-    for (i = 0; i < NUM_FILEPTRS; i++) {
-        if (fd_fileptrs[i] == NULL) {
-            fd_fileptrs[i] = fstream;
-            return i;
+
+    if (write_buf_size < 0)
+        init_limits();
+
+    if (fd_handles == NULL) {
+        fd_handles = calloc(NUM_FILEPTRS, sizeof(*fd_handles));
+        fd_table_size = NUM_FILEPTRS;
+    }
+
+    for (i = 0; i < 3; i++) {
+        struct fd_handle *handle = &std_handles[i];
+
+        free(handle->buf);
+        memset(handle, 0, sizeof(*handle));
+        handle->fd = i;
+        handle->flags = FD_STD | (i == 0 ? FD_READ : FD_WRITE) | (isatty(i) ? FD_TTY : 0);
+        handle->refs = 1;
+        fd_handles[i] = handle;
+    }
+
+    // stdaux and stdprn
+    fd_handles[3] = fd_handles[4] = &std_handles[2];
+    std_handles[2].refs += 2;
+    for (i = 5; i < fd_table_size; i++) {
+        fd_handles[i] = NULL;
+    }
+    first_free = 5;
+}
+
+static int write_all(struct fd_handle *handle, const char *data, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t b_write;
+
+        if (handle->flags & FD_POSITIONAL)
+            b_write = pwrite(handle->fd, data, len, offset);
+        else
+            b_write = write(handle->fd, data, len);
+        stat_write_calls++;
+
+        if (b_write < 0 && errno == EINTR) continue;
+        if (b_write <= 0) return 1;
+        data += b_write;
+        len -= b_write;
+        offset += b_write;
+    }
+    return 0;
+}
+
+// writes out the write buffer
+int fd_flush(struct fd_handle *handle) {
+    int ret;
+
+    if (handle->buf_len == 0 || !(handle->flags & FD_WRITE))
+        return 0;
+
+    ret = write_all(handle, handle->buf, handle->buf_len, handle->buf_off);
+    if (ret) {
+        PRINT_DBG("> fd: cannot write out %zu bytes (%s)\n", handle->buf_len, strerror(errno));
+    }
+    handle->buf_len = 0;
+    if (handle->flags & FD_POSITIONAL)
+        pending_handles--;
+    return ret;
+}
+
+// writes out the buffers of every handle on a file, returns 1 if one couldn't be
+static int flush_same(dev_t dev, ino_t ino, int *flushed) {
+    int i, ret = 0;
+
+    for (i = 0; pending_handles > 0 && i < fd_table_size; i++) {
+        struct fd_handle *handle = fd_handles[i];
+
+        if (handle != NULL && handle->buf_len > 0 && (handle->flags & FD_POSITIONAL)
+                && handle->dev == dev && handle->ino == ino) {
+            ret |= fd_flush(handle);
+            (*flushed)++;
         }
     }
+    return ret;
+}
+
+// writes out what any handle on the same file has buffered
+int fd_flush_file(struct fd_handle *handle) {
+    int flushed = 0;
+
+    if (!(handle->flags & FD_POSITIONAL))
+        return fd_flush(handle);
+    return flush_same(handle->dev, handle->ino, &flushed);
+}
+
+// returns 1 if something couldn't be written out
+int fd_flush_all(void) {
+    int i, ret = 0;
+
+    for (i = 0; i < fd_table_size; i++) {
+        if (fd_handles[i] != NULL)
+            ret |= fd_flush(fd_handles[i]);
+    }
+    return ret;
+}
+
+/*  the standard handles stay open when a program closes or replaces them,
+ *  they are shared with the programs it spawns and the later jobs of a batch.
+ */
+static int close_handle(struct fd_handle *handle) {
+    int ret = fd_flush(handle);
+
+    if (handle->flags & FD_STD)
+        return ret;
 
-    return -1;
+    if (handle->map != NULL)
+        munmap(handle->map, handle->map_len);
+    close(handle->fd);
+    free(handle->buf);
+    free(handle);
+    return ret;
 }
 
-void init_fd_fptrs(void) {
+// frees a guest handle, and closes the file if no other handle has it. returns 1 if what
+// was still buffered couldn't be written out
+int fd_release(int guest_fd) {
+    struct fd_handle *handle = fd_handles[guest_fd];
+
+    if (handle == NULL)
+        return 0;
+    fd_handles[guest_fd] = NULL;
+    if (guest_fd < first_free)
+        first_free = guest_fd;
+
+    if (--handle->refs > 0)
+        return fd_flush(handle);
+    return close_handle(handle);
+}
+
+/*  a forked copy of the loader that runs another program doesn't get the files of the
+ *  program it was forked from, like an exec'd one wouldn't. they are closed without
+ *  writing anything: the parent wrote its buffers out before forking, and keeps them.
+ */
+void fd_forget_parent(void) {
     int i;
 
-    fd_fileptrs[0] = stdin;
-    fd_fileptrs[1] = stdout;
-    fd_fileptrs[2] = stderr;
+    for (i = 0; i < fd_table_size; i++) {
+        struct fd_handle *handle = fd_handles[i];
+
+        if (handle == NULL)
+            continue;
+        fd_handles[i] = NULL;
+        if (handle->flags & FD_STD || --handle->refs > 0)
+            continue;
+        if (handle->map != NULL)
+            munmap(handle->map, handle->map_len);
+        close(handle->fd);
+        free(handle->buf);
+        free(handle);
+    }
+    pending_handles = 0;
+
+    init_fd_handles();
+}
+
+// closes the files a program left open and resets the table
+void close_fd_handles(void) {
+    int i;
+
+    for (i = 0; i < fd_table_size; i++)
+        fd_release(i);
+
+    init_fd_handles();
+}
+
+static size_t read_stream(struct fd_handle *handle, char *data, size_t size) {
+    size_t done = 0;
+
+    if (handle->flags & FD_WRITE)
+        fd_flush(handle);
+
+    // reads as much as asked for, like fread did
+    while (done < size) {
+        ssize_t b_read;
+
+        if (handle->buf_pos < handle->buf_len) {
+            size_t len = handle->buf_len - handle->buf_pos;
+
+            if (len > size - done)
+                len = size - done;
+            memcpy(data + done, handle->buf + handle->buf_pos, len);
+            handle->buf_pos += len;
+            done += len;
+            continue;
+        }
+
+        // the buffer is only for read-only streams, the others write from it
+        if (size - done >= STREAM_READ_BUF || (handle->flags & FD_WRITE)) {
+            b_read = read(handle->fd, data + done, size - done);
+            stat_read_calls++;
+        }
+        else {
+            if (handle->buf == NULL)
+                handle->buf = malloc(STREAM_READ_BUF);
+            handle->buf_pos = handle->buf_len = 0;
+            b_read = read(handle->fd, handle->buf, STREAM_READ_BUF);
+            stat_read_calls++;
+            if (b_read > 0) {
+                handle->buf_len = b_read;
+                continue;
+            }
+        }
+
+        if (b_read < 0 && errno == EINTR) continue;
+        if (b_read <= 0) break;
+        done += b_read;
+    }
+
+    return done;
+}
+
+size_t fd_read(struct fd_handle *handle, void *data, size_t size) {
+    size_t done = 0;
 
-    fd_fileptrs[3] = stderr;
-    fd_fileptrs[4] = stderr;
-    for (i = 5; i < NUM_FILEPTRS; i++) {
-        fd_fileptrs[i] = NULL;
+    stat_reads++;
+    if (!(handle->flags & FD_READ))
+        return 0;
+    if (!(handle->flags & FD_POSITIONAL))
+        return read_stream(handle, data, size);
+
+    // the file has to have what was written to it, through any handle
+    fd_flush_file(handle);
+
+    if (handle->map != NULL && handle->map_checked != files_gen) {
+        struct stat st;
+
+        stat_seek_calls++;
+        if (fstat(handle->fd, &st) || st.st_size < (off_t) handle->map_len) {
+            PRINT_DBG("> fd: the mapped file got shorter, reading it with pread\n");
+            drop_map(handle);
+        }
+        else
+            handle->map_checked = files_gen;
+    }
+
+    if (handle->map != NULL && handle->pos < (off_t) handle->map_len) {
+        done = handle->map_len - handle->pos;
+        if (done > size)
+            done = size;
+        memcpy(data, handle->map + handle->pos, done);
+        handle->pos += done;
+    }
+
+    // past the mapping if the file grew since
+    while (done < size) {
+        ssize_t b_read = pread(handle->fd, (char *) data + done, size - done, handle->pos);
+
+        stat_read_calls++;
+        if (b_read < 0 && errno == EINTR) continue;
+        if (b_read <= 0) break;
+        done += b_read;
+        handle->pos += b_read;
+    }
+
+    return done;
+}
+
+size_t fd_write(struct fd_handle *handle, const void *data, size_t size) {
+    stat_writes++;
+    if (!(handle->flags & FD_WRITE) || size == 0)
+        return 0;
+    handle->changed = 1;
+
+    if (handle->flags & FD_STD) {
+        struct fd_handle *other = handle->fd == 2 ? &std_handles[1] : handle->fd == 1 ? &std_handles[2] : NULL;
+
+        if (other != NULL)
+            fd_flush(other);
+    }
+
+    // a write that doesn't continue the buffered ones
+    if (handle->buf_len > 0 && (handle->flags & FD_POSITIONAL) && handle->buf_off + (off_t) handle->buf_len != handle->pos)
+        fd_flush(handle);
+
+    if (handle->buf_len + size > (size_t) write_buf_size) {
+        if (fd_flush(handle))
+            return 0;
+        if (size >= (size_t) write_buf_size) {
+            if (write_all(handle, data, size, handle->pos))
+                return 0;
+            handle->pos += size;
+            return size;
+        }
     }
+
+    if (handle->buf == NULL)
+        handle->buf = malloc(write_buf_size);
+    if (handle->buf_len == 0) {
+        handle->buf_off = handle->pos;
+        if (handle->flags & FD_POSITIONAL)
+            pending_handles++;
+    }
+    memcpy(handle->buf + handle->buf_len, data, size);
+    handle->buf_len += size;
+    handle->pos += size;
+
+    if ((handle->flags & FD_TTY) || handle == &std_handles[2])
+        fd_flush(handle);
+    return size;
+}
+
+// called after something that may have truncated files, like a spawned program
+void fd_files_changed(void) {
+    files_gen++;
+}
+
+// returns the new position, or -1
+long fd_seek(struct fd_handle *handle, long offset, int whence) {
+    off_t pos;
+
+    stat_seeks++;
+    if (!(handle->flags & FD_POSITIONAL)) {
+        fd_flush(handle);
+        // what was read ahead is given back
+        if (whence == SEEK_CUR)
+            offset -= (long) (handle->buf_len - handle->buf_pos);
+        handle->buf_pos = handle->buf_len = 0;
+        stat_seek_calls++;
+        return lseek(handle->fd, offset, whence);
+    }
+
+    switch (whence) {
+        case SEEK_SET:
+            pos = offset;
+            break;
+        case SEEK_CUR:
+            pos = handle->pos + offset;
+            break;
+        case SEEK_END:
+            pos = fd_size(handle);
+            if (pos < 0)
+                return -1;
+            pos += offset;
+            break;
+        default:
+            return -1;
+    }
+
+    if (pos < 0)
+        return -1;
+    handle->pos = pos;
+    return pos;
+}
+
+// the size of a file, with what's still in the write buffer
+off_t fd_size(struct fd_handle *handle) {
+    struct stat st;
+    off_t size;
+
+    // not the length of the mapping, the file may have grown since
+    stat_seek_calls++;
+    if (fstat(handle->fd, &st))
+        return -1;
+    size = st.st_size;
+
+    if (handle->buf_len > 0 && handle->buf_off + (off_t) handle->buf_len > size)
+        size = handle->buf_off + handle->buf_len;
+    return size;
+}
+
+void fd_print_stats(void) {
+    PRINT_ERR("  io: %u reads (%u syscalls), %u writes (%u syscalls), %u seeks (%u syscalls), %d handles at most\n",
+        stat_reads, stat_read_calls, stat_writes, stat_write_calls, stat_seeks, stat_seek_calls, stat_max_handles);
 }
@@ -1,13 +1,53 @@
 #ifndef EXE32_FD_H
 #define EXE32_FD_H
 
-#include <stdio.h>
+#include <stddef.h>
+#include <sys/types.h>
 
-#define NUM_FILEPTRS 20
+#define NUM_FILEPTRS 20      /* handles the table starts with */
+#define DEFAULT_MAX_FILES 1024
 
-extern FILE *fd_fileptrs[NUM_FILEPTRS];
+#define FD_READ       (1 << 0)
+#define FD_WRITE      (1 << 1)
+#define FD_STD        (1 << 2) /* one of the host's stdin/stdout/stderr */
+#define FD_POSITIONAL (1 << 3) /* a regular file, with its position kept here */
+#define FD_TTY        (1 << 4)
 
-void init_fd_fptrs(void);
-int append_fd(FILE *);
+struct fd_handle {
+    int fd;
+    int flags;
+    off_t pos;
+    dev_t dev;      /* the file of a regular file, to find the other handles on it */
+    ino_t ino;
+    char *map;      /* the whole file, for read-only files */
+    size_t map_len;
+    uint map_checked; /* when its length was last checked, see fd_files_changed */
+    char *buf;      /* write buffer, or read buffer of a stream */
+    size_t buf_len, buf_pos;
+    off_t buf_off;  /* file position of the write buffer */
+    int refs;       /* guest handles that share it through dup/dup2 */
+    int changed;    /* written since the stat cache last forgot the file */
+};
+
+extern struct fd_handle **fd_handles;
+extern int fd_table_size;
+
+void init_fd_handles(void);
+int fd_open(int, int);
+int fd_dup(int);
+int fd_dup2(int, int);
+int fd_release(int);
+void close_fd_handles(void);
+void fd_forget_parent(void);
+
+size_t fd_read(struct fd_handle *, void *, size_t);
+size_t fd_write(struct fd_handle *, const void *, size_t);
+long fd_seek(struct fd_handle *, long, int);
+off_t fd_size(struct fd_handle *);
+int fd_flush(struct fd_handle *);
+int fd_flush_file(struct fd_handle *);
+int fd_flush_all(void);
+void fd_files_changed(void);
+void fd_print_stats(void);
 
 #endif // EXE32_FD_H
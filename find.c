@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "common.h"
+#include "find.h"
+
+/*  File searches (list_file and list_file_next)
+ *
+ *  A search is a directory and a DOS pattern like "*.c" or "foo?.*", matched without case.
+ *  The directory is read with getdents64 into a buffer, so only the names that match are
+ *  looked at further: their type comes from the directory entry when the filesystem has it,
+ *  and they're stat'ed relative to the directory, not to wherever the program is now.
+ *  Directories are only found if the program asks for them with the attribute mask.
+ *
+ *  Each DTA the program uses has its own search, so a search started while another one is
+ *  going on doesn't end it.
+ */
+
+#define DIRENT_BUF_SIZE (32 * 1024)
+#define MAX_SEARCHES 16
+
+#define ATTR_DIRECTORY 0x10
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct find_search {
+    struct find_search *next;
+    const void *key;
+    int dir_fd;
+    char *pattern;
+    uint attr_mask;
+    char *buf;
+    long buf_len, buf_pos;
+};
+
+static struct find_search *searches = NULL;
+
+static uint stat_searches = 0, stat_entries = 0, stat_reads = 0, stat_stats = 0;
+
+static void free_search(struct find_search *search) {
+    if (search->dir_fd != -1)
+        close(search->dir_fd);
+    free(search->pattern);
+    free(search->buf);
+    free(search);
+}
+
+// ends the search of a DTA, if it has one
+void find_close(const void *key) {
+    struct find_search **psearch;
+
+    for (psearch = &searches; *psearch != NULL; psearch = &(*psearch)->next) {
+        if ((*psearch)->key == key) {
+            struct find_search *search = *psearch;
+
+            *psearch = search->next;
+            free_search(search);
+            return;
+        }
+    }
+}
+
+void find_close_all(void) {
+    while (searches != NULL) {
+        struct find_search *search = searches;
+
+        searches = search->next;
+        free_search(search);
+    }
+}
+
+int find_is_pattern(const char *name) {
+    return strpbrk(name, "*?") != NULL;
+}
+
+static int match(const char *pattern, const char *name) {
+    for (; *pattern != '\0'; pattern++, name++) {
+        if (*pattern == '*') {
+            // "*" takes as much as it needs, the shortest first
+            do {
+                if (match(pattern + 1, name))
+                    return 1;
+            } while (*name++ != '\0');
+            return 0;
+        }
+        if (*name == '\0')
+            break;
+        if (*pattern != '?' && tolower((unsigned char) *pattern) != tolower((unsigned char) *name))
+            return 0;
+    }
+
+    // like DOS, "foo.*" and "foo?" also find "foo"
+    while (*pattern == '?' || *pattern == '*' || (*pattern == '.' && (pattern[1] == '*' || pattern[1] == '\0')))
+        pattern++;
+    return *pattern == '\0' && *name == '\0';
+}
+
+int find_match(const char *pattern, const char *name) {
+    // DOS's "*.*" is every name, with or without a dot
+    if (!strcmp(pattern, "*.*"))
+        return 1;
+    return match(pattern, name);
+}
+
+static struct linux_dirent64 *read_entry(struct find_search *search) {
+    struct linux_dirent64 *dent;
+
+    if (search->buf_pos >= search->buf_len) {
+        search->buf_len = syscall(SYS_getdents64, search->dir_fd, search->buf, DIRENT_BUF_SIZE);
+        search->buf_pos = 0;
+        stat_reads++;
+        if (search->buf_len <= 0)
+            return NULL;
+    }
+
+    dent = (struct linux_dirent64 *) (search->buf + search->buf_pos);
+    search->buf_pos += dent->d_reclen;
+    stat_entries++;
+    return dent;
+}
+
+// the next name of the search that matches, with its stat, returns 1 at the end
+static int next_match(struct find_search *search, const char **name, struct stat *st) {
+    struct linux_dirent64 *dent;
+
+    while ((dent = read_entry(search)) != NULL) {
+        int is_dir;
+
+        if (!find_match(search->pattern, dent->d_name))
+            continue;
+
+        is_dir = dent->d_type == DT_DIR;
+        if (is_dir && !(search->attr_mask & ATTR_DIRECTORY))
+            continue;
+
+        stat_stats++;
+        if (fstatat(search->dir_fd, dent->d_name, st, 0))
+            continue;
+        // the type of a symlink or of a filesystem that doesn't say is only known now
+        if (S_ISDIR(st->st_mode) && !(search->attr_mask & ATTR_DIRECTORY))
+            continue;
+
+        *name = dent->d_name;
+        return 0;
+    }
+    return 1;
+}
+
+/*  starts a search for the DTA key, in dir for the names that match pattern. returns 0
+ *  with the first name found and its stat, or 1 if there are none.
+ */
+int find_first(const void *key, const char *dir, const char *pattern, uint attr_mask, const char **name, struct stat *st) {
+    struct find_search *search;
+    int i = 0;
+
+    find_close(key);
+    stat_searches++;
+
+    search = calloc(1, sizeof(*search));
+    search->key = key;
+    search->pattern = strdup(pattern);
+    search->attr_mask = attr_mask;
+    if ((search->dir_fd = open(dir[0] ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        PRINT_DBG("> find_first: cannot open \"%s\"\n", dir);
+        free_search(search);
+        return 1;
+    }
+    search->buf = malloc(DIRENT_BUF_SIZE);
+
+    // programs that don't finish their searches don't keep directories open forever
+    search->next = searches;
+    searches = search;
+    for (; search->next != NULL; search = search->next) {
+        if (++i == MAX_SEARCHES) {
+            free_search(search->next);
+            search->next = NULL;
+            break;
+        }
+    }
+
+    return find_next(key, name, st);
+}
+
+int find_next(const void *key, const char **name, struct stat *st) {
+    struct find_search *search;
+
+    for (search = searches; search != NULL; search = search->next) {
+        if (search->key == key)
+            return next_match(search, name, st);
+    }
+    return 1;
+}
+
+void find_print_stats(void) {
+    PRINT_ERR("  find: %u searches, %u entries read in %u reads, %u stats\n", stat_searches, stat_entries, stat_reads, stat_stats);
+}
@@ -0,0 +1,15 @@
+#ifndef EXE32_FIND_H
+#define EXE32_FIND_H
+
+#include <sys/stat.h>
+#include "common.h"
+
+int find_is_pattern(const char *);
+int find_match(const char *, const char *);
+int find_first(const void *, const char *, const char *, uint, const char **, struct stat *);
+int find_next(const void *, const char **, struct stat *);
+void find_close(const void *);
+void find_close_all(void);
+void find_print_stats(void);
+
+#endif // EXE32_FIND_H
@@ -0,0 +1,403 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "common.h"
+#include "main.h"
+#include "paths.h"
+#include "batch.h"
+#include "jobs.h"
+#include "tmpns.h"
+
+/*  exe32-linux --jobs <N> [jobs file|- [status file]]
+ *
+ *  runs the jobs of a batch jobs file (see batch.c), or of stdin, on N worker processes.
+ *  Whenever a worker is done with a job it takes the next one from a queue shared by all
+ *  workers, and keeps the programs it loaded in its image cache for its later jobs.
+ *
+ *  The queue starts with the jobs that took the longest in earlier runs, jobs that were
+ *  never timed go first. Durations are kept in ~/.cache/exe32-linux/jobtimes by a hash of
+ *  the directory the jobs were started in and the job line:
+ *
+ *    exe32-jobtimes 1
+ *    <hash> <milliseconds>    (one per job)
+ *
+ *  EXE32_JOBTIMES=<file> overrides its location, EXE32_JOBTIMES=0 disables it.
+ *
+ *  Under a GNU make jobserver (--jobserver-auth in MAKEFLAGS), the first worker runs on
+ *  the slot make gave us, every other worker takes a token from the jobserver for each job.
+ */
+
+#define JOBTIMES_HEADER "exe32-jobtimes 1"
+#define MAX_JOBTIMES 65536
+
+struct job {
+    char *line;
+    int lineno;
+    uint key;
+    uint last_ms; // 0 if it was never timed
+};
+
+struct job_result {
+    int done;
+    int status;
+    uint ms;
+};
+
+// shared between the workers
+struct job_queue {
+    int next;
+    struct job_result results[];
+};
+
+static struct job *jobs = NULL;
+static int njobs = 0;
+static struct job_queue *queue;
+static int *by_key; // job indexes sorted by key
+static int *order;  // job indexes in the order they are started
+
+static int js_read_fd = -1, js_write_fd = -1;
+
+static char *jobtimes_path(void) {
+    char *env_times = getenv("EXE32_JOBTIMES"), *dir, *path;
+
+    if (env_times != NULL)
+        return strcmp(env_times, "0") ? strdup(env_times) : NULL;
+
+    if ((dir = get_cache_dir()) == NULL)
+        return NULL;
+    path = malloc(strlen(dir) + sizeof("/jobtimes"));
+    strcpy(path, dir);
+    strcat(path, "/jobtimes");
+    free(dir);
+    return path;
+}
+
+static int key_cmp(const void *a, const void *b) {
+    uint ka = jobs[*(const int *) a].key, kb = jobs[*(const int *) b].key;
+    return ka < kb ? -1 : ka > kb;
+}
+
+// index of the first job with the key, or -1
+static int find_key(uint key) {
+    int lo = 0, hi = njobs;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (jobs[by_key[mid]].key < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < njobs && jobs[by_key[lo]].key == key ? lo : -1;
+}
+
+static int jobtimes_read(FILE *f, uint *key, uint *ms) {
+    return fscanf(f, "%x %u\n", key, ms) == 2;
+}
+
+static FILE *jobtimes_open(const char *path) {
+    FILE *f;
+    char header[sizeof(JOBTIMES_HEADER) + 1];
+
+    if (path == NULL || (f = fopen(path, "r")) == NULL)
+        return NULL;
+    if (fgets(header, sizeof(header), f) == NULL || strcmp(header, JOBTIMES_HEADER "\n")) {
+        PRINT_DBG("> jobs: \"%s\" is not a job times file\n", path);
+        fclose(f);
+        return NULL;
+    }
+    return f;
+}
+
+static void load_jobtimes(const char *path) {
+    FILE *f = jobtimes_open(path);
+    uint key, ms;
+    int i;
+
+    if (f == NULL) return;
+    while (jobtimes_read(f, &key, &ms)) {
+        // the same line can be there more than once
+        for (i = find_key(key); i != -1 && i < njobs && jobs[by_key[i]].key == key; i++)
+            jobs[by_key[i]].last_ms = ms;
+    }
+    fclose(f);
+}
+
+// writes the times of this run first, then the other jobs of the old file
+static void save_jobtimes(const char *path) {
+    FILE *fold = jobtimes_open(path), *fnew;
+    char *tmp_path;
+    uint key, ms;
+    int i, count = 0;
+
+    tmp_path = malloc(strlen(path) + sizeof(".tmp"));
+    strcpy(tmp_path, path);
+    strcat(tmp_path, ".tmp");
+    if ((fnew = fopen(tmp_path, "w")) == NULL) {
+        PRINT_DBG("> jobs: cannot write \"%s\" (%s)\n", tmp_path, strerror(errno));
+        free(tmp_path);
+        if (fold != NULL) fclose(fold);
+        return;
+    }
+
+    fprintf(fnew, JOBTIMES_HEADER "\n");
+    for (i = 0; i < njobs; i++) {
+        if (queue->results[i].done) {
+            fprintf(fnew, "%08x %u\n", jobs[i].key, queue->results[i].ms);
+            count++;
+        }
+    }
+    while (fold != NULL && count < MAX_JOBTIMES && jobtimes_read(fold, &key, &ms)) {
+        if (find_key(key) == -1) {
+            fprintf(fnew, "%08x %u\n", key, ms);
+            count++;
+        }
+    }
+    if (fold != NULL) fclose(fold);
+
+    if (ferror(fnew) | fclose(fnew) || rename(tmp_path, path)) {
+        PRINT_DBG("> jobs: cannot write \"%s\" (%s)\n", path, strerror(errno));
+        remove(tmp_path);
+    }
+    free(tmp_path);
+}
+
+// never timed first, then longest first, then in the order of the file
+static int order_cmp(const void *a, const void *b) {
+    const struct job *ja = &jobs[*(const int *) a], *jb = &jobs[*(const int *) b];
+
+    if (ja->last_ms != jb->last_ms) {
+        if (ja->last_ms == 0) return -1;
+        if (jb->last_ms == 0) return 1;
+        return ja->last_ms > jb->last_ms ? -1 : 1;
+    }
+    return ja->lineno - jb->lineno;
+}
+
+static int valid_fd(int fd) {
+    return fd >= 0 && fcntl(fd, F_GETFD) != -1;
+}
+
+// --jobserver-auth=R,W or --jobserver-auth=fifo:PATH (--jobserver-fds=R,W before make 4.2)
+static void jobserver_init(void) {
+    char *makeflags = getenv("MAKEFLAGS"), *auth = NULL, *p;
+
+    if (makeflags == NULL) return;
+
+    for (p = makeflags; (p = strstr(p, "--jobserver-")) != NULL; p++) {
+        if (!strncmp(p, "--jobserver-auth=", 17))
+            auth = p + 17;
+        else if (!strncmp(p, "--jobserver-fds=", 16))
+            auth = p + 16;
+    }
+    if (auth == NULL) return;
+
+    if (!strncmp(auth, "fifo:", 5)) {
+        size_t len = strcspn(auth + 5, " ");
+        char *fifo_path = strndup(auth + 5, len);
+
+        js_read_fd = js_write_fd = open(fifo_path, O_RDWR | O_CLOEXEC);
+        if (js_read_fd == -1) {
+            PRINT_DBG("> jobs: cannot open jobserver fifo \"%s\" (%s)\n", fifo_path, strerror(errno));
+        }
+        free(fifo_path);
+    }
+    else if (sscanf(auth, "%d,%d", &js_read_fd, &js_write_fd) != 2 || !valid_fd(js_read_fd) || !valid_fd(js_write_fd)) {
+        // make only passes the fds to commands it knows are recursive (+ or $(MAKE))
+        PRINT_DBG("> jobs: jobserver fds in MAKEFLAGS are not open, not using the jobserver\n");
+        js_read_fd = js_write_fd = -1;
+    }
+
+    if (js_read_fd != -1) {
+        PRINT_DBG("> jobs: using the jobserver (%d, %d)\n", js_read_fd, js_write_fd);
+    }
+}
+
+// returns 0 if there's no jobserver to take a token from
+static int jobserver_acquire(char *token) {
+    while (js_read_fd != -1) {
+        ssize_t bread = read(js_read_fd, token, 1);
+
+        if (bread == 1)
+            return 1;
+        if (bread == -1 && errno == EAGAIN) {
+            struct pollfd pfd = { js_read_fd, POLLIN, 0 };
+            poll(&pfd, 1, -1);
+        }
+        else if (bread != -1 || errno != EINTR) {
+            PRINT_DBG("> jobs: cannot read from the jobserver, not using it anymore\n");
+            js_read_fd = js_write_fd = -1;
+        }
+    }
+    return 0;
+}
+
+static void jobserver_release(char token) {
+    while (write(js_write_fd, &token, 1) == -1 && errno == EINTR)
+        ;
+}
+
+static void worker(int id, const char *jobs_path, char *env) {
+    int i, lock = exe32_lock;
+
+    // workers run their jobs at the same time, each needs its own private temp directory
+    if (getenv("EXE32_TMPNS_DIR") != NULL) {
+        unsetenv("EXE32_TMPNS_DIR");
+        tmpns_init();
+        env = rebuild_flat_environ();
+    }
+
+    for (;;) {
+        struct job_result *result;
+        struct timespec start, end;
+        char token;
+        // take the token before the job, so a job isn't held up by a worker that waits for one
+        int has_token = id > 0 && jobserver_acquire(&token);
+
+        if ((i = __sync_fetch_and_add(&queue->next, 1)) >= njobs) {
+            if (has_token)
+                jobserver_release(token);
+            break;
+        }
+        result = &queue->results[order[i]];
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        result->status = batch_job(jobs[order[i]].line, jobs_path, jobs[order[i]].lineno, env);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if (has_token)
+            jobserver_release(token);
+        unlock_wait();
+        exe32_lock = lock;
+
+        // 0 means never timed
+        result->ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000 + 1;
+        result->done = 1;
+    }
+
+    exit(0);
+}
+
+static int read_jobs(FILE *fjobs, const char *jobs_path) {
+    char line[BATCH_MAX_LINE], *cwd = getcwd(NULL, 0);
+    int lineno = 0, read_ret, max_jobs = 0;
+    uint dir_hash = fnv1a_str(FNV1A_INIT, cwd != NULL ? cwd : "");
+
+    free(cwd);
+
+    while ((read_ret = batch_read_job(fjobs, line, sizeof(line), jobs_path, &lineno)) > 0) {
+        if (njobs == max_jobs) {
+            max_jobs = max_jobs ? max_jobs * 2 : 64;
+            jobs = realloc(jobs, max_jobs * sizeof(struct job));
+        }
+        jobs[njobs].line = strdup(line);
+        jobs[njobs].lineno = lineno;
+        jobs[njobs].key = fnv1a_str(fnv1a(dir_hash, "\n", 1), line);
+        jobs[njobs].last_ms = 0;
+        njobs++;
+    }
+
+    return read_ret;
+}
+
+// returns 0 if every job succeeded, otherwise the exit status of the first job in the file that failed
+int run_jobs(int nworkers, const char *jobs_path, const char *status_path, char *env) {
+    FILE *fjobs, *fstatus = NULL;
+    char *times_path = jobtimes_path();
+    int i, ret = 0;
+    pid_t *workers;
+
+    if (jobs_path == NULL || !strcmp(jobs_path, "-")) {
+        jobs_path = "<stdin>";
+        fjobs = stdin;
+    }
+    else if ((fjobs = fopen(jobs_path, "r")) == NULL) {
+        PRINT_ERR("Cannot open jobs file \"%s\": %s\n", jobs_path, strerror(errno));
+        return 2;
+    }
+    if (status_path != NULL && (fstatus = fopen(status_path, "w")) == NULL) {
+        PRINT_ERR("Cannot open status file \"%s\": %s\n", status_path, strerror(errno));
+        return 2;
+    }
+
+    if (read_jobs(fjobs, jobs_path) < 0)
+        return 2;
+    if (fjobs != stdin)
+        fclose(fjobs);
+    if (njobs == 0)
+        return 0;
+
+    by_key = malloc(njobs * sizeof(int));
+    order = malloc(njobs * sizeof(int));
+    for (i = 0; i < njobs; i++)
+        by_key[i] = order[i] = i;
+    qsort(by_key, njobs, sizeof(int), key_cmp);
+    load_jobtimes(times_path);
+    qsort(order, njobs, sizeof(int), order_cmp);
+
+    queue = mmap(NULL, sizeof(struct job_queue) + njobs * sizeof(struct job_result),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (queue == MAP_FAILED) {
+        PRINT_ERR("Cannot allocate the job queue: %s\n", strerror(errno));
+        return 2;
+    }
+    if (batch_start())
+        return 2;
+    jobserver_init();
+
+    if (nworkers > njobs)
+        nworkers = njobs;
+    workers = calloc(nworkers, sizeof(pid_t));
+    fflush(NULL);
+    for (i = 0; i < nworkers; i++) {
+        if ((workers[i] = fork()) == 0)
+            worker(i, jobs_path, env);
+        if (workers[i] == -1) {
+            PRINT_ERR("Cannot start worker %d: %s\n", i, strerror(errno));
+            if (i == 0) return 2;
+            break;
+        }
+    }
+
+    for (i = 0; i < nworkers; i++) {
+        int status;
+
+        if (workers[i] <= 0) continue;
+        while (waitpid(workers[i], &status, 0) == -1 && errno == EINTR)
+            ;
+        if (WIFSIGNALED(status))
+            PRINT_ERR("Worker %d aborted with signal %s\n", workers[i], strsignal(WTERMSIG(status)));
+    }
+    free(workers);
+    batch_finish();
+
+    for (i = 0; i < njobs; i++) {
+        struct job_result *result = &queue->results[i];
+        int lineno = jobs[i].lineno, status = result->done ? result->status : 255;
+
+        if (fstatus != NULL)
+            fprintf(fstatus, "%d %d\n", lineno, status);
+        if (!result->done)
+            PRINT_ERR("%s:%d: did not finish\n", jobs_path, lineno);
+        else if (status != 0)
+            PRINT_ERR("%s:%d: exited with status %d\n", jobs_path, lineno, status);
+        if (status != 0 && ret == 0)
+            ret = status;
+    }
+
+    if (times_path != NULL) {
+        save_jobtimes(times_path);
+        free(times_path);
+    }
+    if (fstatus != NULL) fclose(fstatus);
+    munmap(queue, sizeof(struct job_queue) + njobs * sizeof(struct job_result));
+    return ret;
+}
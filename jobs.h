@@ -0,0 +1,6 @@
+#ifndef EXE32_JOBS_H
+#define EXE32_JOBS_H
+
+int run_jobs(int, const char *, const char *, char *);
+
+#endif // EXE32_JOBS_H
@@ -2,20 +2,34 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "common.h"
 #include "main.h"
 #include "load.h"
 #include "coff.h"
+#include "prelink.h"
 #include "wrappers.h"
 #include "fd.h"
 #include "paths.h"
 #include "memmap.h"
+#include "toolidx.h"
+#include "cache.h"
+#include "profile.h"
+#include "trace.h"
+#include "sample.h"
 
 // lets set up a fake program path to fool that we are in win32 environment
 // needed by ld.out
 #define DEFAULT_DRIVE "C:\\"
 char *full_win32_path = NULL;
+static char *prog_host_path = NULL;
 
 static void set_full_path(const char *prog_path) {
     if (full_win32_path != NULL) free(full_win32_path);
@@ -23,6 +37,21 @@ static void set_full_path(const char *prog_path) {
     strcpy(full_win32_path, DEFAULT_DRIVE);
     strcat(full_win32_path, prog_path);
     strrep_forwslashes(full_win32_path);
+
+    free(prog_host_path);
+    prog_host_path = strdup(prog_path);
+}
+
+// number of fopen() calls it took to find the program, for the tool index
+static int load_probes = 0;
+
+static FILE *probe_program(const char *prog_path) {
+    FILE *f_ret;
+
+    load_probes++;
+    f_ret = fopen(prog_path, "rb");
+    if (f_ret) set_full_path(prog_path);
+    return f_ret;
 }
 
 static FILE *load_program_relative(const char *progname) {
@@ -32,8 +61,7 @@ static FILE *load_program_relative(const char *progname) {
     fullpath = malloc(strlen(exe32_dirpath) + strlen(progname) + 1);
     strcpy(fullpath, exe32_dirpath);
     strcat(fullpath, progname);
-    f_ret = fopen(fullpath, "rb");
-    if (f_ret) set_full_path(fullpath);
+    f_ret = probe_program(fullpath);
     free(fullpath);
     return f_ret;
 }
@@ -74,8 +102,7 @@ static FILE *load_program_from_paths(const char *progname) {
         new_progname[path_len] = '/';
         strcpy(new_progname + path_len + 1, progname);
 
-        f_ret = fopen(new_progname, "rb");
-        if (f_ret) set_full_path(new_progname);
+        f_ret = probe_program(new_progname);
 
         PRINT_DBG("> from_paths: %s\n", new_progname);
         if (f_ret) {
@@ -112,18 +139,14 @@ static FILE *load_program(const char *progname) {
             return load_program_basename(progname);
         }
         else {
-            f_ret = fopen(progname, "rb"); // load program relative to current dir
-            if (f_ret)
-                set_full_path(progname);
-            else
+            f_ret = probe_program(progname); // load program relative to current dir
+            if (f_ret == NULL)
                 return load_program_relative(progname);
             return f_ret;
         }
     }
     else { // load_program_absolute
-        f_ret = fopen(progname, "rb");
-        if (f_ret) set_full_path(progname);
-        return f_ret;
+        return probe_program(progname);
     }
 }
 
@@ -131,10 +154,32 @@ static struct wrapprog_exec_s wp_exec_info;
 
 void *main_stack_ptr;
 
+// in batch mode, exiting returns to the batch loop instead (see batch.c)
+static jmp_buf *exit_jmp = NULL;
+
+void load_set_exit_jmp(jmp_buf *env) {
+    exit_jmp = env;
+}
+
+__attribute__((noreturn)) static void load_exit(int status) {
+    // a program whose output didn't make it to the disk didn't succeed
+    if (fd_flush_all() && status == 0) {
+        PRINT_ERR("Error: cannot write out the files of the program\n");
+        status = 1;
+    }
+    sample_finish();
+    profile_finish(status);
+    trace_finish(status);
+    cache_finish(status);
+    if (exit_jmp != NULL)
+        longjmp(*exit_jmp, LOAD_EXITED | (status & 0xff));
+    exit(status);
+}
+
 // restore stack pointer before exit
 static int _exit_status;
 static void _xexit(void) {
-    exit(_exit_status);
+    load_exit(_exit_status);
 }
 void xexit(int status) {
     _exit_status = status;
@@ -153,12 +198,271 @@ int get_stack_size(void) {
     return rl.rlim_cur;
 }
 
-void load_and_exec_prog(char *progname, char *args, char *env) {
-    FILE *fprg;
-    init_first_t init_first_addr = NULL;
+/*  Programs are cached by name once they are found and their headers are read,
+ *  so a program that is loaded over and over in forked copies of this process
+ *  (see spawnve_wrapper) is only searched for and parsed once.
+ */
+struct prog_image {
+    char *name;
+    int is_exe32;
+    char *host_path;
+    char *search_path; // PATH a bare name was searched in
+    int fd;
+    int prelinked;
+    int nsecs;
+    void *secs; // struct CoffSecHdr_s[] or struct PrelinkSeg_s[]
+    init_first_t entry;
+    int cached;
+    struct prog_image *next;
+};
+
+static struct prog_image *image_cache = NULL;
+
+// errors are not printed while priming the cache, the program that gets loaded prints them
+static int load_quiet = 0;
+#define LOAD_ERR(...) do { if (!load_quiet) PRINT_ERR(__VA_ARGS__); } while (0)
+
+static int read_section_part(int fd, long offset, uintptr_t addr, size_t len) {
+    if (pread(fd, (void *) addr, len, offset) != (ssize_t) len) {
+        PRINT_ERR("EOF while reading at %#lx", offset);
+        return 1;
+    }
+    return 0;
+}
+
+// the EXE32_MEMADVICE region of a section
+static int sec_region(uint32_t flags) {
+    if (flags & STYP_BSS)
+        return MEM_BSS;
+    return flags & STYP_TEXT ? MEM_TEXT : MEM_DATA;
+}
+
+/*  Maps the page-aligned middle of a section directly from the program file
+ *  (MAP_PRIVATE, so the pages are faulted in lazily from the page cache),
+ *  and only reads the unaligned head and tail pages that it shares with its
+ *  neighbouring sections. Returns 1 if the section cannot be mapped this way.
+ */
+static int map_section_from_file(struct CoffSecHdr_s *sec, int fd) {
+    int region = sec_region(sec->s_flags);
+    uintptr_t pagesize = sysconf(_SC_PAGE_SIZE);
+    uintptr_t start = (uintptr_t) sec->s_vaddr, end = start + sec->s_size;
+    uintptr_t map_start = ROUNDOFF(start, pagesize), map_end = ROUNDDOWN(end, pagesize);
+
+    if (((start - sec->s_scnptr) & (pagesize - 1)) != 0 || map_end <= map_start)
+        return 1;
+
+    if (mem_map_file((void *) map_start, map_end - map_start, PROT_READ | PROT_WRITE | PROT_EXEC, fd, sec->s_scnptr + (map_start - start), region))
+        return 1;
+
+    if (start < map_start) {
+        if (mem_map((void *) (map_start - pagesize), pagesize, region)) {
+            PRINT_ERR("Error: Cannot allocate virtual address at %p\n", (void *) (map_start - pagesize));
+            load_exit(20);
+        }
+        if (read_section_part(fd, sec->s_scnptr, start, map_start - start))
+            load_exit(11);
+    }
+
+    if (end > map_end) {
+        if (mem_map((void *) map_end, pagesize, region)) {
+            PRINT_ERR("Error: Cannot allocate virtual address at %p\n", (void *) map_end);
+            load_exit(20);
+        }
+        if (read_section_part(fd, sec->s_scnptr + (map_end - start), map_end, end - map_end))
+            load_exit(11);
+    }
+
+    PRINT_DBG("> map_section_from_file: %.8s mapped from file at %#"PRIxPTR"-%#"PRIxPTR"\n", sec->s_name, map_start, map_end);
+    return 0;
+}
+
+static int parse_coff(struct prog_image *img, FILE *fprg) {
+    int i;
+    struct CoffHdr_s prg_hdr;
+    struct CoffSecHdr_s *prg_secs;
+
+    fread(&prg_hdr, sizeof(struct CoffHdr_s), 1, fprg);
+    if (feof(fprg) && prg_hdr.f_magic != 0x014c) {
+        LOAD_ERR("\"%s\" is not a COFF Program!\n", img->name);
+        return 10;
+    }
+    if (prg_hdr.f_nscns < 1) {
+        LOAD_ERR("\"%s\" has no sections!\n", img->name);
+        return 10;
+    }
+    if (prg_hdr.f_opthdr != 0x1c) {
+        LOAD_ERR("Optional header size not 0x1c\n");
+        return 11;
+    }
+    fseek(fprg, 0x1c, SEEK_CUR);
+
+    prg_secs = malloc(sizeof(struct CoffSecHdr_s) * prg_hdr.f_nscns);
+    fread(prg_secs, prg_hdr.f_nscns, sizeof(struct CoffSecHdr_s), fprg);
+    if (feof(fprg)) {
+        LOAD_ERR("EOF while reading section headers\n");
+        free(prg_secs);
+        return 11;
+    }
+
+    img->entry = NULL;
+    for (i = 0; i < prg_hdr.f_nscns; i++) {
+        if (prg_secs[i].s_flags & STYP_TEXT && img->entry == NULL) {
+            img->entry = (init_first_t) prg_secs[i].s_vaddr;
+        }
+    }
+
+    img->nsecs = prg_hdr.f_nscns;
+    img->secs = prg_secs;
+    return 0;
+}
+
+static void map_coff(struct prog_image *img) {
+    struct CoffSecHdr_s *prg_secs = img->secs;
+    int i;
+
+    for (i = 0; i < img->nsecs; i++) {
+        struct CoffSecHdr_s sec = prg_secs[i];
+
+        if (!(sec.s_flags & STYP_BSS) && !map_section_from_file(&sec, img->fd))
+            continue;
+
+        if (mem_map(sec.s_vaddr, sec.s_size, sec_region(sec.s_flags))) {
+            PRINT_ERR("Error: Cannot allocate virtual address at %p\n", sec.s_vaddr);
+            load_exit(20);
+        }
+
+        if (!(sec.s_flags & STYP_BSS)) {
+            if (read_section_part(img->fd, sec.s_scnptr, (uintptr_t) sec.s_vaddr, sec.s_size))
+                load_exit(11);
+        }
+    }
+}
+
+// images written by exe32-prelink, every segment is mapped as is from the file
+static int parse_prelinked(struct prog_image *img, FILE *fprg) {
+    int i;
+    struct PrelinkHdr_s prg_hdr;
+    struct PrelinkSeg_s *prg_segs;
+    struct stat st;
+
+    if (sysconf(_SC_PAGE_SIZE) != PRELINK_PAGE_SIZE) {
+        LOAD_ERR("\"%s\" is prelinked for a page size of %#x\n", img->name, PRELINK_PAGE_SIZE);
+        return 11;
+    }
+
+    fread(&prg_hdr, sizeof(struct PrelinkHdr_s), 1, fprg);
+    if (prg_hdr.ph_version != PRELINK_VERSION || prg_hdr.ph_nsegs < 1) {
+        LOAD_ERR("\"%s\" has an unsupported prelink version!\n", img->name);
+        return 10;
+    }
+
+    prg_segs = malloc(sizeof(struct PrelinkSeg_s) * prg_hdr.ph_nsegs);
+    if (fread(prg_segs, sizeof(struct PrelinkSeg_s), prg_hdr.ph_nsegs, fprg) != prg_hdr.ph_nsegs
+            || fstat(fileno(fprg), &st)) {
+        LOAD_ERR("EOF while reading segment headers\n");
+        free(prg_segs);
+        return 11;
+    }
+
+    for (i = 0; i < prg_hdr.ph_nsegs; i++) {
+        struct PrelinkSeg_s seg = prg_segs[i];
+
+        if ((seg.ps_vaddr | seg.ps_memsz | seg.ps_filesz | seg.ps_fileoff) & (PRELINK_PAGE_SIZE - 1)
+                || seg.ps_filesz > seg.ps_memsz || seg.ps_fileoff + seg.ps_filesz > (uint32_t) st.st_size) {
+            LOAD_ERR("\"%s\" has a bad segment at %#x\n", img->name, seg.ps_vaddr);
+            free(prg_segs);
+            return 11;
+        }
+    }
+
+    img->entry = (init_first_t) prg_hdr.ph_entry;
+    img->nsecs = prg_hdr.ph_nsegs;
+    img->secs = prg_segs;
+    return 0;
+}
+
+static void map_prelinked(struct prog_image *img) {
+    struct PrelinkSeg_s *prg_segs = img->secs;
+    int i;
+
+    for (i = 0; i < img->nsecs; i++) {
+        struct PrelinkSeg_s seg = prg_segs[i];
+        // unlike the COFF path, pure text pages aren't writable: the programs never write
+        // to their own code (see page_flags in exe32-prelink)
+        int prot = (seg.ps_flags & PSEG_READ ? PROT_READ : 0)
+            | (seg.ps_flags & PSEG_WRITE ? PROT_WRITE : 0)
+            | (seg.ps_flags & PSEG_EXEC ? PROT_EXEC : 0);
+
+        if (seg.ps_filesz && mem_map_file((void *) seg.ps_vaddr, seg.ps_filesz, prot, img->fd, seg.ps_fileoff,
+                prot & PROT_EXEC ? MEM_TEXT : MEM_DATA)) {
+            PRINT_ERR("Error: Cannot allocate virtual address at %#x\n", seg.ps_vaddr);
+            load_exit(20);
+        }
+        if (seg.ps_memsz > seg.ps_filesz && mem_map_file((void *) (seg.ps_vaddr + seg.ps_filesz), seg.ps_memsz - seg.ps_filesz, prot, -1, 0, MEM_BSS)) {
+            PRINT_ERR("Error: Cannot allocate virtual address at %#x\n", seg.ps_vaddr + seg.ps_filesz);
+            load_exit(20);
+        }
+    }
+}
+
+// uses the image exe32-prelink made of the program if it's still up to date,
+// the program itself stays in place for gcc.out, which loads some of them itself
+static FILE *open_prelinked(FILE *fprg) {
+    const char *name = strrchr(prog_host_path, '/');
+    size_t dirlen = name ? (size_t) (++name - prog_host_path) : 0;
+    struct PrelinkHdr_s prg_hdr;
+    struct stat st;
+    char *path;
+    FILE *fpre;
+
+    if (name == NULL) name = prog_host_path;
+    path = malloc(dirlen + sizeof(PRELINK_DIR) + strlen(name));
+    memcpy(path, prog_host_path, dirlen);
+    strcpy(path + dirlen, PRELINK_DIR);
+    strcat(path, name);
+    fpre = fopen(path, "rb");
+    free(path);
+    if (fpre == NULL)
+        return fprg;
+
+    if (fread(&prg_hdr, sizeof(prg_hdr), 1, fpre) == 1 && prg_hdr.ph_magic == PRELINK_MAGIC
+            && prg_hdr.ph_version == PRELINK_VERSION && !fstat(fileno(fprg), &st)
+            && prg_hdr.ph_src_size == (uint32_t) st.st_size && prg_hdr.ph_src_mtime == (uint32_t) st.st_mtime) {
+        PRINT_DBG("> using the prelinked image of %s\n", prog_host_path);
+        fclose(fprg);
+        rewind(fpre);
+        return fpre;
+    }
+
+    PRINT_DBG("> prelinked image of %s is out of date\n", prog_host_path);
+    fclose(fpre);
+    return fprg;
+}
+
+static FILE *find_program(char *progname, int exe32_mode) {
+    FILE *fprg = NULL;
+    char *idx_name = NULL;
+
+    load_probes = 0;
+
+    // programs searched by their basename can be looked up in the tool index first
+    if (!exe32_mode || strchr(progname, '/') == NULL) {
+        char *idx_path;
+
+        idx_name = basename(progname);
+        if ((idx_path = toolidx_find(idx_name)) != NULL) {
+            PRINT_DBG("> toolidx: %s -> %s\n", idx_name, idx_path);
+            fprg = fopen(idx_path, "rb");
+            if (fprg) set_full_path(idx_path);
+            free(idx_path);
+        }
+    }
 
     // find the program file
-    fprg = is_exe32 ? load_program(progname) : load_program_basename(basename(progname));
+    if (fprg == NULL)
+        fprg = exe32_mode ? load_program(progname) : load_program_basename(basename(progname));
+    else
+        idx_name = NULL;
 
     if (fprg == NULL) {
         char *caseprgname = strdup(progname), *caseprgdup = caseprgname;
@@ -173,75 +477,142 @@ void load_and_exec_prog(char *progname, char *args, char *env) {
         }
         PRINT_DBG("Cannot access %s, trying upper cased (%s)\n", progname, caseprgdup);
 
-        fprg = is_exe32 ? load_program(caseprgdup) : load_program_basename(basename(caseprgdup));
+        fprg = exe32_mode ? load_program(caseprgdup) : load_program_basename(basename(caseprgdup));
         free(caseprgdup);
 
         if (fprg == NULL) {
+            if (load_quiet) return NULL;
             PRINT_ERR("Cannot load \"%s\": ", progname);
             perror(NULL);
-            exit(10);
+            load_exit(10);
         }
     }
 
-    // load the program file into memory
-    {
-        int i;
-        struct CoffHdr_s prg_hdr;
-        struct CoffSecHdr_s *prg_secs;
-
-        fread(&prg_hdr, sizeof(struct CoffHdr_s), 1, fprg);
-        if (feof(fprg) && prg_hdr.f_magic != 0x014c) {
-            PRINT_ERR("\"%s\" is not a COFF Program!\n", progname);
-            exit(10);
-        }
-        if (prg_hdr.f_nscns < 1) {
-            PRINT_ERR("\"%s\" has no sections!\n", progname);
-            exit(10);
-        }
-        if (prg_hdr.f_opthdr != 0x1c) {
-            PRINT_ERR("Optional header size not 0x1c\n");
-            exit(11);
-        }
-        fseek(fprg, 0x1c, SEEK_CUR);
+    if (idx_name != NULL)
+        toolidx_add(idx_name, prog_host_path, load_probes);
 
-        prg_secs = malloc(sizeof(struct CoffSecHdr_s) * prg_hdr.f_nscns);
-        fread(prg_secs, prg_hdr.f_nscns, sizeof(struct CoffSecHdr_s), fprg);
-        if (feof(fprg)) {
-            PRINT_ERR("EOF while reading section headers\n");
-            exit(11);
-        }
+    return fprg;
+}
 
-        for (i = 0; i < prg_hdr.f_nscns; i++) {
-            struct CoffSecHdr_s sec = prg_secs[i];
-            if (sec.s_flags & STYP_TEXT && init_first_addr == NULL) {
-                init_first_addr = (init_first_t) sec.s_vaddr;
-            }
+static void free_image(struct prog_image *img) {
+    close(img->fd);
+    free(img->name);
+    free(img->host_path);
+    free(img->search_path);
+    free(img->secs);
+    free(img);
+}
 
-            if (mem_map(sec.s_vaddr, sec.s_size)) {
-                PRINT_ERR("Error: Cannot allocate virtual address at %p\n", sec.s_vaddr);
-                exit(20);
-            }
+// finds and parses a program, or takes it from the cache
+static struct prog_image *get_image(char *progname, int exe32_mode) {
+    struct prog_image *img;
+    FILE *fprg;
+    uint32_t magic = 0;
+    int ret;
+    char *env_path = getenv("PATH");
 
-            if (!(sec.s_flags & STYP_BSS)) {
-                fseek(fprg, sec.s_scnptr, SEEK_SET);
-                fread(sec.s_vaddr, sec.s_size, 1, fprg);
-                if (feof(fprg)) {
-                    PRINT_ERR("EOF while reading at %#x", sec.s_scnptr);
-                    exit(11);
-                }
-            }
+    if (env_path == NULL || strchr(progname, '/') != NULL)
+        env_path = "";
+
+    for (img = image_cache; img != NULL; img = img->next) {
+        if (img->is_exe32 == exe32_mode && !strcmp(img->name, progname) && !strcmp(img->search_path, env_path)) {
+            PRINT_DBG("> get_image: %s is cached (%s)\n", progname, img->host_path);
+            return img;
         }
+    }
 
-        free(prg_secs);
+    if ((fprg = find_program(progname, exe32_mode)) == NULL)
+        return NULL;
+    fprg = open_prelinked(fprg);
+
+    img = calloc(1, sizeof(struct prog_image));
+    img->name = strdup(progname);
+    img->is_exe32 = exe32_mode;
+    img->host_path = strdup(prog_host_path);
+    img->search_path = strdup(env_path);
+
+    fread(&magic, sizeof(magic), 1, fprg);
+    rewind(fprg);
+    img->prelinked = magic == PRELINK_MAGIC;
+    ret = img->prelinked ? parse_prelinked(img, fprg) : parse_coff(img, fprg);
+    if (ret) {
         fclose(fprg);
+        free(img->name);
+        free(img->host_path);
+        free(img->search_path);
+        free(img);
+        if (load_quiet) return NULL;
+        load_exit(ret);
     }
 
-    lock_wait();
-    init_fd_fptrs();
-    wp_exec_info.wp_heap_start = get_heap_addr(); // this might be unused
-    wp_exec_info.wp_name = full_win32_path;
-    wp_exec_info.wp_args = args;
-    wp_exec_info.wp_environ = env;
+    img->fd = dup(fileno(fprg));
+    fcntl(img->fd, F_SETFD, FD_CLOEXEC);
+    fclose(fprg);
+
+    // relative paths depend on the current directory, so only names and absolute paths are kept
+    if (strchr(progname, '/') == NULL || progname[0] == '/') {
+        img->cached = 1;
+        img->next = image_cache;
+        image_cache = img;
+    }
+
+    return img;
+}
+
+// reads a program into the cache, so forked copies of this process can load it without searching
+void load_cache_prime(char *progname, int exe32_mode) {
+    struct prog_image *img;
+
+    load_quiet = 1;
+    img = get_image(progname, exe32_mode);
+    load_quiet = 0;
+
+    if (img != NULL && !img->cached)
+        free_image(img);
+}
+
+// the host path a program would be loaded from, or NULL if it isn't found
+char *load_find_path(char *progname, int exe32_mode) {
+    char *path = NULL;
+    FILE *fprg;
+
+    load_quiet = 1;
+    if ((fprg = find_program(progname, exe32_mode)) != NULL) {
+        path = strdup(prog_host_path);
+        fclose(fprg);
+    }
+    load_quiet = 0;
+    return path;
+}
+
+void load_cache_clear(void) {
+    while (image_cache != NULL) {
+        struct prog_image *next = image_cache->next;
+        free_image(image_cache);
+        image_cache = next;
+    }
+}
+
+// host path of the last loaded program
+const char *get_prog_path(void) {
+    return prog_host_path;
+}
+
+// finds the program and maps it along with its stack, returns its entry point
+init_first_t load_prog(char *progname) {
+    struct prog_image *img = get_image(progname, is_exe32);
+    init_first_t init_first_addr = img->entry;
+
+    set_full_path(img->host_path);
+
+    // load the program file into memory
+    if (img->prelinked)
+        map_prelinked(img);
+    else
+        map_coff(img);
+
+    if (!img->cached)
+        free_image(img);
 
     // loaded program sets the stack ptr to 0x01080000 before calling any of the wrappers
     {
@@ -251,11 +622,44 @@ void load_and_exec_prog(char *progname, char *args, char *env) {
             stack_size = 0x00010000;
         }
 
-        if (mem_map((void*) 0x01080000 - stack_size, stack_size)) {
+        if (mem_map((void*) 0x01080000 - stack_size, stack_size, MEM_STACK)) {
             PRINT_ERR("Error: Cannot allocate stack address at 0x01070000\n");
-            exit(20);
+            load_exit(20);
         }
     }
 
+    return init_first_addr;
+}
+
+// runs a program mapped by load_prog
+void exec_prog(init_first_t init_first_addr, char *args, char *env) {
+    int status;
+
+    // a cached run restores what the program did instead
+    if (cache_begin(prog_host_path, args, env, &status))
+        load_exit(status);
+
+    lock_wait();
+    init_fd_handles();
+    wp_exec_info.wp_heap_start = get_heap_addr(); // this might be unused
+    wp_exec_info.wp_name = full_win32_path;
+    wp_exec_info.wp_args = args;
+    wp_exec_info.wp_environ = env;
+
+    profile_begin(prog_host_path);
+    trace_begin(prog_host_path);
+    sample_begin(prog_host_path);
     exec_init_first(init_first_addr, &wp_exec_info);
+    if (fd_flush_all()) {
+        PRINT_ERR("Error: cannot write out the files of the program\n");
+        load_exit(1);
+    }
+    sample_finish();
+    profile_finish(0);
+    trace_finish(0);
+    cache_finish(0);
+}
+
+void load_and_exec_prog(char *progname, char *args, char *env) {
+    exec_prog(load_prog(progname), args, env);
 }
@@ -1,8 +1,21 @@
 #ifndef EXE32_LOAD_H
 #define EXE32_LOAD_H
 
+#include <setjmp.h>
+#include "wrappers.h"
+
+// or'ed with the exit status in longjmp, so an exit status of 0 can be told from setjmp's
+#define LOAD_EXITED 0x100
+
+init_first_t load_prog(char *);
+void exec_prog(init_first_t, char *, char *);
 void load_and_exec_prog(char *, char *, char *);
+const char *get_prog_path(void);
+void load_cache_prime(char *, int);
+char *load_find_path(char *, int);
+void load_cache_clear(void);
 void xexit(int);
+void load_set_exit_jmp(jmp_buf *);
 
 extern void *main_stack_ptr;
 #define save_stack_ptr() __asm__("mov %%esp, %0" : "=r" (main_stack_ptr))
@@ -2,8 +2,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/file.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -11,10 +14,22 @@
 #include "load.h"
 #include "paths.h"
 #include "memmap.h"
+#include "fd.h"
+#include "toolidx.h"
+#include "dircache.h"
+#include "statcache.h"
+#include "find.h"
+#include "profile.h"
+#include "trace.h"
+#include "sample.h"
+#include "server.h"
+#include "batch.h"
+#include "jobs.h"
+#include "cache.h"
+#include "depfile.h"
+#include "memtmp.h"
+#include "tmpns.h"
 
-#ifndef EXEPROGNAME
-#define EXEPROGNAME "exe32-linux"
-#endif
 #ifndef EXEPROGVER
 #define EXEPROGVER "unknown"
 #endif
@@ -22,97 +37,215 @@
 char *exe32_dirpath = NULL;
 int is_exe32 = 0;
 int exe32_lock = 0;
+int exe32_stats = 0;
 
 static char *wp_progname;
 static char *wp_args;
 static char *wp_environ;
+static char **server_tools = NULL;
+static char *batch_path = NULL, *batch_status_path = NULL;
+static int batch_jobs = 0; // number of workers for --jobs, 0 for --batch
+
+/*  EXE32_LOCK=1 is a FIFO ticket lock on $TMPDIR/.exe32-lock (or $TEMP, or .).
+ *
+ *  A process takes the next ticket from the counter at the start of the file under flock,
+ *  and before letting go of the flock it puts an fcntl lock on the byte of its ticket. It
+ *  then waits for an fcntl lock on the byte of the ticket before it, which the previous
+ *  process holds until it unlocks. fcntl locks go away when their process dies, so a crashed
+ *  owner doesn't keep the others waiting, and the kernel does the waiting instead of a loop.
+ *  A waiter that dies lets the next one go early though, so the file also records the ticket
+ *  of the owner: a process that got its turn first checks under flock that the recorded owner
+ *  doesn't still hold its byte, and waits for that one if it does.
+ *  The file also keeps how often the lock was taken and how long processes waited for it.
+ */
 
 #define LOCKNAME ".exe32-lock"
-#define MAX_READ_RETRIES 100000000
+#define LOCK_MAGIC 0x4b434c45 /* "ELCK" */
+#define LOCK_TICKETS_START 64
+#define LOCK_NUM_TICKETS (1u << 30)
+
+struct lock_state_s {
+    uint32_t magic;
+    uint32_t next_ticket;
+    uint32_t acquired;
+    uint32_t contended;
+    uint64_t wait_usecs;
+    uint32_t owner; // ticket + 1 of the last process that got the lock, 0 if none did
+};
+
+struct lock_claim_s {
+    uint32_t ticket;
+    uint32_t busy; // the owner's ticket if it still holds the lock, or -1
+};
 
 static char *lock_path;
+static int lock_fd = -1;
+static struct lock_state_s lock_totals;
+static uint64_t lock_wait_usecs = 0;
+static int lock_waited = 0; // whether the last lock_wait had to wait
+
+static int lock_byte(int fd, int cmd, short type, uint32_t ticket) {
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = LOCK_TICKETS_START + ticket % LOCK_NUM_TICKETS;
+    fl.l_len = 1;
+
+    while (fcntl(fd, cmd, &fl) == -1) {
+        if (errno != EINTR) return 1;
+    }
+    return 0;
+}
+
+// reads the counters and hands them to update, which may change them, under flock
+static int lock_state(int fd, void (*update)(struct lock_state_s *, uint64_t), uint64_t arg) {
+    struct lock_state_s state;
+    int ret = 0;
+
+    if (flock(fd, LOCK_EX))
+        return 1;
+    if (pread(fd, &state, sizeof(state), 0) != sizeof(state) || state.magic != LOCK_MAGIC) {
+        memset(&state, 0, sizeof(state));
+        state.magic = LOCK_MAGIC;
+    }
+    update(&state, arg);
+    if (pwrite(fd, &state, sizeof(state), 0) != sizeof(state))
+        ret = 1;
+    lock_totals = state;
+    flock(fd, LOCK_UN);
+    return ret;
+}
+
+static void take_ticket(struct lock_state_s *state, uint64_t arg) {
+    uint32_t *ticket = (uint32_t *) (uintptr_t) arg;
+
+    *ticket = state->next_ticket++ % LOCK_NUM_TICKETS;
+    // taken while the counter is locked, so whoever gets the next ticket waits for this byte
+    if (lock_byte(lock_fd, F_SETLK, F_WRLCK, *ticket))
+        state->next_ticket--;
+}
+
+static void claim_owner(struct lock_state_s *state, uint64_t arg) {
+    struct lock_claim_s *claim = (struct lock_claim_s *) (uintptr_t) arg;
+    uint32_t owner = state->owner - 1;
+
+    claim->busy = (uint32_t) -1;
+    if (state->owner != 0 && owner != claim->ticket) {
+        if (lock_byte(lock_fd, F_SETLK, F_RDLCK, owner)) {
+            claim->busy = owner;
+            return;
+        }
+        lock_byte(lock_fd, F_SETLK, F_UNLCK, owner);
+    }
+    state->owner = claim->ticket + 1;
+}
+
+static void count_wait(struct lock_state_s *state, uint64_t wait_usecs) {
+    state->acquired++;
+    if (lock_waited) {
+        state->contended++;
+        state->wait_usecs += wait_usecs;
+    }
+}
+
+static uint64_t now_usecs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
 void lock_wait(void) {
-    int lock_fd;
-    char *tmpdir, pidstr[11];
+    char *tmpdir;
+    uint32_t ticket, prev_ticket;
+    uint64_t start, waited = 0;
+    struct lock_claim_s claim;
 
-    if (!exe32_lock) return;
+    if (!exe32_lock || lock_fd != -1) return;
 
     if ((tmpdir = getenv("TMPDIR")) == NULL)
         if ((tmpdir = getenv("TEMP")) == NULL)
             tmpdir = ".";
 
+    free(lock_path);
     lock_path = malloc(strlen(tmpdir) + sizeof(LOCKNAME) + 1);
     strcpy(lock_path, tmpdir);
     strcat(lock_path, "/");
     strcat(lock_path, LOCKNAME);
 
-    do {
-        lock_fd = open(lock_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
-        if (lock_fd == -1) {
-            if (errno == EEXIST) {
-                lock_fd = open(lock_path, O_RDONLY);
-                if (lock_fd == -1) {
-                    if (errno != ENOENT) {
-                        PRINT_DBG("> lock_wait: Error creating lock file \"%s\", (%s). Disabled cross-process locking.\n", lock_path, strerror(errno));
-                        exe32_lock = 0;
-                        return;
-                    }
-                }
-                else {
-                    ssize_t bread; // :like:
-                    unsigned long pidnum, read_retries = 0;
-                    memset(pidstr, 0, 11);
-
-                    do {
-                        bread = read(lock_fd, pidstr, 10);
-                    } while (read_retries++ < MAX_READ_RETRIES && (bread == 0 || pidstr[0] == '\0'));
-                    if (read_retries >= MAX_READ_RETRIES) { // failsafe if process didn't give us pid
-                        PRINT_DBG("> lock_wait: read retries exceeded to max. Disabled cross-process locking.\n");
-                        close(lock_fd);
-                        exe32_lock = 0;
-                        return;
-                    }
-
-                    pidnum = strtoul(pidstr, NULL, 10);
-                    if (kill(pidnum, 0) == 0) {
-                        PRINT_DBG("> lock_wait: waiting for pid %ld to exit.\n", pidnum);
-                        while (kill(pidnum, 0) == 0) {
-                            ;
-                        }
-                        close(lock_fd);
-                    }
-                    else {
-                        PRINT_DBG("> lock_wait: pid %ld does not exist at this time.\n", pidnum);
-                        close(lock_fd);
-                        remove(lock_path);
-                    }
-
-                    lock_fd = -1;
-                }
-            }
-            else if (errno != ENOENT) {
-                PRINT_DBG("> lock_wait: Error creating lock file \"%s\", (%s). Disabled cross-process locking.\n", lock_path, strerror(errno));
-                exe32_lock = 0;
-                return;
+    ticket = (uint32_t) -1;
+    if ((lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0666)) == -1
+            || lock_state(lock_fd, take_ticket, (uintptr_t) &ticket) || ticket == (uint32_t) -1) {
+        PRINT_DBG("> lock_wait: Error using lock file \"%s\", (%s). Disabled cross-process locking.\n", lock_path, strerror(errno));
+        if (lock_fd != -1) close(lock_fd);
+        lock_fd = -1;
+        exe32_lock = 0;
+        return;
+    }
+
+    // a shared lock is enough to see that the previous ticket is gone
+    prev_ticket = (ticket + LOCK_NUM_TICKETS - 1) % LOCK_NUM_TICKETS;
+    claim.ticket = ticket;
+    lock_waited = 0;
+    start = now_usecs();
+    for (;;) {
+        if (lock_byte(lock_fd, F_SETLK, F_RDLCK, prev_ticket)) {
+            PRINT_DBG("> lock_wait: waiting for ticket %u to unlock.\n", prev_ticket);
+            if (lock_byte(lock_fd, F_SETLKW, F_RDLCK, prev_ticket)) {
+                PRINT_DBG("> lock_wait: cannot wait for the lock (%s), going ahead.\n", strerror(errno));
             }
+            lock_waited = 1;
         }
-    } while (lock_fd == -1);
+        lock_byte(lock_fd, F_SETLK, F_UNLCK, prev_ticket);
 
-    snprintf(pidstr, 10, "%d", getpid());
-    write(lock_fd, pidstr, strlen(pidstr));
-    close(lock_fd);
+        // the previous ticket may have been a waiter that died, not the owner
+        if (lock_state(lock_fd, claim_owner, (uintptr_t) &claim) || claim.busy == (uint32_t) -1)
+            break;
+        PRINT_DBG("> lock_wait: ticket %u still has the lock.\n", claim.busy);
+        prev_ticket = claim.busy;
+    }
+    if (lock_waited) {
+        waited = now_usecs() - start;
+        lock_wait_usecs += waited;
+    }
+
+    lock_state(lock_fd, count_wait, waited);
 }
 
+// closing the file drops the lock on our ticket, and the next process goes
 void unlock_wait(void) {
-    if (exe32_lock && lock_path) {
-        remove(lock_path);
+    if (lock_fd != -1) {
+        close(lock_fd);
+        lock_fd = -1;
+    }
+    if (exe32_lock) {
         free(lock_path);
         lock_path = NULL;
         exe32_lock = 0;
     }
 }
 
+// a forked child doesn't hold the fcntl locks of its parent, it only lets go of the file
+static void lock_forget(void) {
+    if (lock_fd != -1)
+        close(lock_fd);
+    lock_fd = -1;
+    exe32_lock = 0;
+    free(lock_path);
+    lock_path = NULL;
+}
+
+static void lock_print_stats(void) {
+    if (lock_totals.magic != LOCK_MAGIC)
+        PRINT_ERR("  lock: not used\n");
+    else
+        PRINT_ERR("  lock: waited %llu ms; all processes: %u locks, %u waited, %llu ms in total\n",
+            (unsigned long long) lock_wait_usecs / 1000, lock_totals.acquired, lock_totals.contended,
+            (unsigned long long) lock_totals.wait_usecs / 1000);
+}
+
 extern char **environ;
 
 #ifdef DEFAULT_BASE_PATH
@@ -180,6 +313,13 @@ void build_flat_environ(void) {
     *wpenv_ptr = '\0';
 }
 
+// the environment of the programs again, after the loader changed its own
+char *rebuild_flat_environ(void) {
+    free(wp_environ);
+    build_flat_environ();
+    return wp_environ;
+}
+
 static void parse_args(int argc, char **argv) {
     char *exe32_dirpath_slash;
 
@@ -196,7 +336,33 @@ static void parse_args(int argc, char **argv) {
 
     if (!strcmp(basename(argv[0]), EXEPROGNAME)
             || !strcmp(basename(argv[0]), "exew32.exe")) { // compatibility
-        if (argc > 1) {
+        if (argc > 1 && !strcmp(argv[1], "--server")) {
+            server_tools = argv + 2;
+            is_exe32 = 1;
+        }
+        else if (argc > 1 && !strcmp(argv[1], "--cache-stats")) {
+            exit(cache_show_stats());
+        }
+        else if (argc > 2 && !strcmp(argv[1], "--batch")) {
+            batch_path = argv[2];
+            batch_status_path = argc > 3 ? argv[3] : NULL;
+            wp_progname = strdup(batch_path);
+            wp_args = NULL;
+            is_exe32 = 1;
+        }
+        else if (argc > 2 && !strcmp(argv[1], "--jobs") && strspn(argv[2], "0123456789") == strlen(argv[2])) {
+            // 0 runs a worker per CPU
+            if ((batch_jobs = atoi(argv[2])) == 0)
+                batch_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+            if (batch_jobs < 1)
+                batch_jobs = 1;
+            batch_path = argc > 3 ? argv[3] : "-";
+            batch_status_path = argc > 4 ? argv[4] : NULL;
+            wp_progname = strdup(batch_path);
+            wp_args = NULL;
+            is_exe32 = 1;
+        }
+        else if (argc > 1) {
             if (argc > 2) {
                 wp_args = malloc(512);
                 join_args(wp_args, argc - 2, argv + 2);
@@ -213,6 +379,14 @@ static void parse_args(int argc, char **argv) {
                 "Usage: ./"EXEPROGNAME" <[path/]progname[.out]> [parameters ...]\n"
                 "  or, if progname is symlinked to "EXEPROGNAME":\n"
                 "  ./<progname> [parameters ...]\n"
+                "  or, to keep programs preloaded for later launches:\n"
+                "  ./"EXEPROGNAME" --server [progname ...]\n"
+                "  or, to run the programs listed in a jobs file one after another:\n"
+                "  ./"EXEPROGNAME" --batch <jobs file> [status file]\n"
+                "  or, to run them on N processes at once (0 for one per CPU):\n"
+                "  ./"EXEPROGNAME" --jobs <N> [jobs file|- [status file]]\n"
+                "  or, to show the statistics of the EXE32_CACHE result cache:\n"
+                "  ./"EXEPROGNAME" --cache-stats\n"
 #ifdef DEFAULT_BASE_PATH
                 "\n"
                 "Default Load Path: \"" DEFAULT_BASE_PATH "\"\n"
@@ -261,7 +435,22 @@ static void init_log(void) {
 }
 #endif
 
+// EXE32_STATS=1 prints what the loader's caches and shortcuts did at exit
+static void print_stats(void) {
+    PRINT_ERR(EXEPROGNAME" [%d] stats for %s:\n", getpid(), wp_progname);
+    toolidx_print_stats();
+    cache_print_stats();
+    lock_print_stats();
+    fd_print_stats();
+    dircache_print_stats();
+    statcache_print_stats();
+    find_print_stats();
+    mem_print_stats();
+}
+
 void free_all(void) {
+    if (exe32_stats)
+        print_stats();
     unlock_wait();
 #ifndef NDEBUG
     if (log_file != NULL) 
@@ -276,18 +465,104 @@ void free_all(void) {
         free(full_win32_path);
 }
 
-int main(int argc, char *argv[]) {
+static void parse_env(void) {
     char *_exe32_lock = getenv("EXE32_LOCK");
     if (_exe32_lock) {
         if (_exe32_lock[0] == '1' && _exe32_lock[1] == '\0')
             exe32_lock = 1;
         unsetenv("EXE32_LOCK");
     }
+    exe32_stats = getenv("EXE32_STATS") != NULL && !strcmp(getenv("EXE32_STATS"), "1");
+    mem_advice_init();
+    profile_init();
+    trace_init();
+    sample_init();
+    depfile_init();
+    memtmp_init();
+    tmpns_init();
+}
+
+/*  name of the program a loader command line would run and whether it runs in exe32 mode,
+ *  or NULL if it would not run a program (usage or one of the -- modes).
+ */
+char *nested_progname(char **argv, int *exe32_mode) {
+    if (!strcmp(basename(argv[0]), EXEPROGNAME)
+            || !strcmp(basename(argv[0]), "exew32.exe")) {
+        if (argv[1] == NULL || !strncmp(argv[1], "--", 2))
+            return NULL;
+        *exe32_mode = 1;
+        return fix_progname(argv[1]);
+    }
+
+    *exe32_mode = 0;
+    return fix_progname(argv[0]);
+}
+
+/*  runs a loader command line in a forked copy of this process, as if it was exec'd
+ *  with argv and env. must be called on the host stack, the old program is unmapped.
+ */
+void exec_nested(char **argv, char **env) {
+    int argc = 0;
+
+    while (argv[argc] != NULL)
+        argc++;
+
+    server_detach();
+    cache_abandon();
+    load_set_exit_jmp(NULL);
+    mem_unmap_all();
+
+    // the lock, if any, belongs to the parent
+    lock_forget();
+    // and so do the files it had open
+    fd_forget_parent();
+
+    free(wp_progname);
+    free(wp_args);
+    free(wp_environ);
+    free(exe32_dirpath);
+    exe32_dirpath = NULL;
+
+    environ = env;
+    parse_env();
+    parse_args(argc, argv);
+    build_flat_environ();
+
+    load_and_exec_prog(wp_progname, wp_args, wp_environ);
+}
+
+int main(int argc, char *argv[]) {
+    parse_env();
 
 #ifndef NDEBUG
     init_log();
 #endif
     parse_args(argc, argv);
+
+    if (server_tools != NULL) {
+        // only returns in the forked children, already set up with the client's environment
+        init_first_t init_first = server_main(server_tools, &wp_progname, &wp_args);
+
+        parse_env();
+        build_flat_environ();
+        atexit(free_all);
+        exec_prog(init_first, wp_args, wp_environ);
+        return 0;
+    }
+
+    if (batch_path != NULL) {
+        build_flat_environ();
+        atexit(free_all);
+        if (batch_jobs > 0)
+            return run_jobs(batch_jobs, batch_path, batch_status_path, wp_environ);
+        return run_batch(batch_path, batch_status_path, wp_environ);
+    }
+
+    // hand over to a preloaded program of the server if there's one, or load it here.
+    // the server's programs can't see the in-memory temp files
+    if ((!is_exe32 || strchr(wp_progname, '/') == NULL) && !memtmp_active())
+        server_exec(wp_progname, wp_args);
+
     build_flat_environ();
 
     atexit(free_all);
@@ -4,8 +4,12 @@
 extern char *exe32_dirpath;
 extern int is_exe32;
 extern int exe32_lock;
+extern int exe32_stats;
 
 void lock_wait(void);
 void unlock_wait(void);
+char *nested_progname(char **, int *);
+void exec_nested(char **, char **);
+char *rebuild_flat_environ(void);
 
 #endif // EXE32_MAIN_H
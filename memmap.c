@@ -1,217 +1,385 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #include "common.h"
+#include "memmap.h"
 
-#define ROUNDOFF(val, mul) (((val) + ((mul) - 1)) & ~((mul) - 1))
-
+/*  The mapped ranges, sorted by address and not overlapping. Neighbouring ranges of the
+ *  same kind are merged, so a heap that grows page by page is still one entry, and looking
+ *  up an address is a binary search.
+ */
 struct mapentry {
     uintptr_t addr;
     size_t len;
-    struct mapentry *next;
+    int kind;   /* MEM_TEXT...MEM_STACK, MEM_HEAP is the heap's reservation */
 };
 
-static struct mapentry *mentry_head = NULL, *mentry_tail;
-
-static void mentry_add_node(struct mapentry *mentry) {
-    mentry->next = NULL;
-
-    if (mentry_head == NULL) {
+#define PROT_ALL (PROT_READ | PROT_WRITE | PROT_EXEC)
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+#define ADVICE_POPULATE  (1 << 0)
+#define ADVICE_HUGEPAGE  (1 << 1)
+#define ADVICE_MERGEABLE (1 << 2)
+
+#define HEAP_START ((void *) 0x01000000)
+#define HEAP_RESERVE_STEP (64 << 20)
+#define HEAP_MIN_COMMIT (256 << 10)
+
+static struct mapentry *mentries = NULL;
+static int num_mentries = 0, mentries_size = 0;
+static void *heap_addr = HEAP_START;
+
+/*  the heap is mapped inaccessible up to heap_reserved, and usable up to heap_committed,
+ *  which is past where the program asked the heap to end (heap_end).
+ */
+static uintptr_t heap_end = (uintptr_t) HEAP_START;
+static uintptr_t heap_committed = (uintptr_t) HEAP_START, heap_reserved = (uintptr_t) HEAP_START;
+
+static uint stat_heap_grows = 0, stat_heap_commits = 0, stat_heap_shrinks = 0, stat_heap_releases = 0;
+
+/*  Memory advice (EXE32_MEMADVICE=<region>:<advice>[+<advice>...],...)
+ *
+ *  The regions are text, data, bss, heap, stack or all, and the advice is populate (fault
+ *  the pages in when they're mapped, or when the heap grows over them), hugepage (back them
+ *  with transparent huge pages) or mergeable (let KSM share identical pages with other
+ *  processes). "heap:hugepage+populate,all:mergeable" for example. Nothing is advised by
+ *  default.
+ */
+static const char *region_names[MEM_NUM_REGIONS] = { "text", "data", "bss", "heap", "stack" };
+static int mem_advice[MEM_NUM_REGIONS];
+
+void mem_advice_init(void) {
+    char *env_advice = getenv("EXE32_MEMADVICE"), *list, *item, *saveptr;
+
+    memset(mem_advice, 0, sizeof(mem_advice));
+    if (env_advice == NULL)
+        return;
+
+    list = strdup(env_advice);
+    for (item = strtok_r(list, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+        char *advice = strchr(item, ':'), *name, *saveptr2;
+        int region, flags = 0, found = 0;
+
+        if (advice == NULL) {
+            PRINT_ERR("EXE32_MEMADVICE: \"%s\" is not <region>:<advice>\n", item);
+            continue;
+        }
+        *advice++ = '\0';
+
+        for (name = strtok_r(advice, "+", &saveptr2); name != NULL; name = strtok_r(NULL, "+", &saveptr2)) {
+            if (!strcmp(name, "populate"))
+                flags |= ADVICE_POPULATE;
+            else if (!strcmp(name, "hugepage"))
+                flags |= ADVICE_HUGEPAGE;
+            else if (!strcmp(name, "mergeable"))
+                flags |= ADVICE_MERGEABLE;
+            else
+                PRINT_ERR("EXE32_MEMADVICE: unknown advice \"%s\"\n", name);
+        }
 
-        mentry_head = mentry;
-        mentry_tail = mentry;
-    }
-    else {
-        mentry_tail->next = mentry;
-        mentry_tail = mentry;
+        for (region = 0; region < MEM_NUM_REGIONS; region++) {
+            if (!strcmp(item, "all") || !strcmp(item, region_names[region])) {
+                mem_advice[region] |= flags;
+                found = 1;
+            }
+        }
+        if (!found)
+            PRINT_ERR("EXE32_MEMADVICE: unknown region \"%s\"\n", item);
     }
+    free(list);
 }
 
-UNUSED static struct mapentry *mentry_indexof_addr(uintptr_t addr) {
-    struct mapentry *mentry;
-
-    for (mentry = mentry_head; mentry != NULL; mentry = mentry->next) {
-        if (addr == mentry->addr)
-            return mentry;
-    }
-
-    return NULL;
+// madvise errors are ignored, the host may not have huge pages or KSM
+static void advise(uintptr_t addr, size_t len, int region) {
+#ifdef MADV_HUGEPAGE
+    if (mem_advice[region] & ADVICE_HUGEPAGE)
+        madvise((void *) addr, len, MADV_HUGEPAGE);
+#endif
+#ifdef MADV_MERGEABLE
+    if (mem_advice[region] & ADVICE_MERGEABLE)
+        madvise((void *) addr, len, MADV_MERGEABLE);
+#endif
 }
 
-static struct mapentry *mentry_find_lowest_addr(uintptr_t loaddr_limit) {
-    struct mapentry *mentry, *retment = NULL;
-    uintptr_t loaddr = 0;
-
-    for (mentry = mentry_head; mentry != NULL; mentry = mentry->next) {
-        if (loaddr_limit <= mentry->addr &&
-                (loaddr == 0 || loaddr >= mentry->addr)) {
-            loaddr = mentry->addr;
-            retment = mentry;
-        }
-    }
-
-    return retment;
-}
+// the index of the first entry that ends after addr, or num_mentries
+static int mentry_find(uintptr_t addr) {
+    int lo = 0, hi = num_mentries;
 
-static struct mapentry *mentry_find_highest_addr(uintptr_t hiaddr_limit) {
-    struct mapentry *mentry, *retment = NULL;
-    uintptr_t hiaddr = 0;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
 
-    for (mentry = mentry_head; mentry != NULL; mentry = mentry->next) {
-        if (hiaddr_limit >= mentry->addr &&
-                (hiaddr == 0 || hiaddr <= mentry->addr)) {
-            hiaddr = mentry->addr;
-            retment = mentry;
-        }
+        if (mentries[mid].addr + mentries[mid].len <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
-
-    return retment;
+    return lo;
 }
 
 static int mentry_is_in_address_range(uintptr_t addr, size_t len) {
-    uintptr_t start_addr = addr, end_addr = (uintptr_t) (addr + len);
-    struct mapentry *mentry;
+    int i = mentry_find(addr);
 
-    for (mentry = mentry_head; mentry != NULL; mentry = mentry->next) {
-        uintptr_t mstart_addr = mentry->addr, mend_addr = (uintptr_t) (mentry->addr + mentry->len);
-
-        //  a ---[+++++++++++]---
-        //  m ------[+++++]------
-        if (start_addr <= mstart_addr && end_addr >= mend_addr)
-            return 1;
+    return i < num_mentries && mentries[i].addr < addr + len;
+}
 
-        //  a ------[+++++]------
-        //  m ---[+++++++++++]---
-        else if (start_addr >= mstart_addr && end_addr <= mend_addr)
-            return 1;
+static void mentry_insert(int i, uintptr_t addr, size_t len, int kind) {
+    if (num_mentries == mentries_size) {
+        mentries_size = mentries_size ? mentries_size * 2 : 64;
+        mentries = realloc(mentries, mentries_size * sizeof(*mentries));
+    }
+    memmove(&mentries[i+1], &mentries[i], (num_mentries - i) * sizeof(*mentries));
+    mentries[i].addr = addr;
+    mentries[i].len = len;
+    mentries[i].kind = kind;
+    num_mentries++;
+}
 
-        //  a ---[++++++]--------
-        //  m -------[+++++++]---
-        else if (start_addr <= mstart_addr && start_addr < mend_addr &&
-                end_addr > mstart_addr && end_addr <= mend_addr)
-            return 1;
+// records a range that was mapped where nothing was, merging it with its neighbours
+static void mentry_add(uintptr_t addr, size_t len, int kind) {
+    int i = mentry_find(addr);
 
-        //  a -------[+++++++]---
-        //  m ---[++++++]--------
-        else if (start_addr >= mstart_addr && start_addr < mend_addr &&
-                end_addr > mstart_addr && end_addr >= mend_addr)
-            return 1;
+    if (i > 0 && mentries[i-1].kind == kind && mentries[i-1].addr + mentries[i-1].len == addr) {
+        mentries[i-1].len += len;
+        if (i < num_mentries && mentries[i].kind == kind && mentries[i].addr == addr + len) {
+            mentries[i-1].len += mentries[i].len;
+            memmove(&mentries[i], &mentries[i+1], (num_mentries - i - 1) * sizeof(*mentries));
+            num_mentries--;
+        }
+        return;
+    }
+    if (i < num_mentries && mentries[i].kind == kind && mentries[i].addr == addr + len) {
+        mentries[i].addr = addr;
+        mentries[i].len += len;
+        return;
     }
 
-    return 0;
+    mentry_insert(i, addr, len, kind);
 }
 
-static int _mem_map(uintptr_t addr, size_t len) {
-    struct mapentry *mentry;
-
-    if (mmap((void *) addr, len, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, -1, 0) == NULL) {
+static int _mem_map(uintptr_t addr, size_t len, int kind) {
+    // the heap's reservation doesn't replace what's there, and takes no memory until it's committed
+    int prot = kind == MEM_HEAP ? PROT_NONE : PROT_ALL;
+    int flags = kind == MEM_HEAP ? MAP_FIXED_NOREPLACE | MAP_NORESERVE
+        : MAP_FIXED | (mem_advice[kind] & ADVICE_POPULATE ? MAP_POPULATE : 0);
+    void *map = mmap((void *) addr, len, prot, MAP_ANONYMOUS | MAP_PRIVATE | flags, -1, 0);
+
+    if (map != (void *) addr) {
+        // kernels before 4.17 take MAP_FIXED_NOREPLACE as a hint
+        if (map != MAP_FAILED)
+            munmap(map, len);
         PRINT_DBG("> mem_map: Cannot allocate virtual memory address at 0x%"PRIxPTR" with size 0x%x\n", addr, len);
         return 1;
     }
 
-    mentry = malloc(sizeof(struct mapentry));
-    mentry->addr = addr;
-    mentry->len = len;
-
-    mentry_add_node(mentry);
+    advise(addr, len, kind);
+    mentry_add(addr, len, kind);
     return 0;
 }
 
-static int split_cut_map(uintptr_t addr, size_t len) {
-    struct mapentry *lo_mentry, *hi_mentry;
-
-    while (1) {
-        hi_mentry = mentry_find_highest_addr(addr + len);
-        lo_mentry = mentry_find_lowest_addr(addr);
+/*  maps the holes of a page-aligned range. what's already mapped there is kept, but
+ *  parts of the heap's reservation that aren't committed are made usable.
+ */
+static int map_holes(uintptr_t addr, uintptr_t end, int kind) {
+    int i = mentry_find(addr);
 
-        // if addr is inside hi_mentry's range
-        if (hi_mentry != NULL && addr > hi_mentry->addr && addr < hi_mentry->addr + hi_mentry->len) {
-            len -= hi_mentry->addr + hi_mentry->len - addr;
-            addr = hi_mentry->addr + hi_mentry->len;
+    while (addr < end) {
+        uintptr_t hole_end = end;
 
-            if (len <= 0) return 0;
-        }
+        if (i < num_mentries && mentries[i].addr <= addr) {
+            uintptr_t mend = mentries[i].addr + mentries[i].len;
 
-        if (lo_mentry == NULL)
-            return _mem_map(addr, len);
+            if (kind != MEM_HEAP && mentries[i].kind == MEM_HEAP && mend > heap_committed) {
+                uintptr_t from = addr > heap_committed ? addr : heap_committed;
+                uintptr_t to = mend < end ? mend : end;
 
-        // if it's already in the list
-        else if (lo_mentry->addr == addr) {
-            // if the found entry's size is smaller than this size
-            if (lo_mentry->len >= len)
-                return 0;
-
-            // or if is bigger than the entry's
-            else if (lo_mentry->len < len) {
-                addr += lo_mentry->len;
-                len -= lo_mentry->len;
+                if (from < to && mprotect((void *) from, to - from, PROT_ALL))
+                    return 1;
             }
+            addr = mend;
+            i++;
+            continue;
         }
+        if (i < num_mentries && mentries[i].addr < end)
+            hole_end = mentries[i].addr;
 
-        // if entry's addr is way ahead
-        else if (lo_mentry->addr > addr) {
-            if (_mem_map(addr, lo_mentry->addr - addr))
-                return 1;
-
-            len -= lo_mentry->addr - addr;
-            addr = lo_mentry->addr;
-        }
+        if (_mem_map(addr, hole_end - addr, kind))
+            return 1;
+        // the new entry may have been merged into its neighbours
+        addr = hole_end;
+        i = mentry_find(addr);
     }
+    return 0;
+}
 
-    return 1; // just in case the compiler doesn't want no return after the loop
+// calls mprotect or madvise on the heap's parts of a page-aligned range, and not what's mapped inside it
+static int heap_parts(uintptr_t addr, uintptr_t end, int (*func)(void *, size_t, int), int arg) {
+    int i;
+
+    for (i = mentry_find(addr); i < num_mentries && mentries[i].addr < end; i++) {
+        uintptr_t from = mentries[i].addr > addr ? mentries[i].addr : addr;
+        uintptr_t to = mentries[i].addr + mentries[i].len < end ? mentries[i].addr + mentries[i].len : end;
+
+        if (mentries[i].kind == MEM_HEAP && func((void *) from, to - from, arg))
+            return 1;
+    }
+    return 0;
 }
 
-int mem_map(void *addr, size_t len) {
+int mem_map(void *addr, size_t len, int region) {
     uintptr_t _addr = ROUNDOFF((uintptr_t)addr, (int) sysconf(_SC_PAGE_SIZE));
     size_t _len = ROUNDOFF(len, (int) sysconf(_SC_PAGE_SIZE));
 
-    if (mentry_is_in_address_range(_addr, _len)) {
-        return split_cut_map(_addr, _len);
+    return map_holes(_addr, _addr + _len, region);
+}
+
+/*  map a page-aligned range of a file privately with the given protection, so clean
+ *  pages stay shared with the page cache. fd -1 maps zero-filled memory instead.
+ */
+int mem_map_file(void *addr, size_t len, int prot, int fd, off_t offset, int region) {
+    int flags = MAP_PRIVATE | MAP_FIXED | (fd == -1 ? MAP_ANONYMOUS : 0) | (mem_advice[region] & ADVICE_POPULATE ? MAP_POPULATE : 0);
+
+    if (mentry_is_in_address_range((uintptr_t) addr, len)) {
+        PRINT_DBG("> mem_map_file: Address %p with size 0x%x is already mapped\n", addr, len);
+        return 1;
+    }
+
+    if (mmap(addr, len, prot, flags, fd, offset) == MAP_FAILED) {
+        PRINT_DBG("> mem_map_file: Cannot map file offset %#lx at %p with size 0x%x\n", (long) offset, addr, len);
+        return 1;
     }
-    else
-        return _mem_map(_addr, _len);
+
+    advise((uintptr_t) addr, len, region);
+    mentry_add((uintptr_t) addr, len, region);
+    return 0;
 }
 
 void mem_unmap_all(void) {
-    while (mentry_head != NULL) {
-        struct mapentry *tmp_mentry = mentry_head->next;
+    int i;
 
-        munmap((void *) mentry_head->addr, mentry_head->len);
-        free(mentry_head);
-        mentry_head = tmp_mentry;
-    }
+    for (i = 0; i < num_mentries; i++)
+        munmap((void *) mentries[i].addr, mentries[i].len);
+    num_mentries = 0;
+    heap_addr = HEAP_START;
+    heap_end = heap_committed = heap_reserved = (uintptr_t) HEAP_START;
 }
 
 void print_map_entries(void) {
-    struct mapentry *mentry;
+    int i;
 
     PRINT_ERR("> Memory Map Entries:\n");
-    PRINT_ERR("    Address      Size\n");
-    for (mentry = mentry_head; mentry != NULL; mentry = mentry->next) {
-        PRINT_ERR("    0x%"PRIxPTR"    0x%x\n", mentry->addr, mentry->len);
+    PRINT_ERR("    Address      Size    Region\n");
+    for (i = 0; i < num_mentries; i++) {
+        PRINT_ERR("    0x%"PRIxPTR"    0x%x    %s\n", mentries[i].addr, mentries[i].len, region_names[mentries[i].kind]);
     }
 }
 
-static void *heap_addr = (void *) 0x01000000;
+// the lowest and the highest address of a region, 0 and 0 if nothing of it is mapped
+void mem_region_range(int region, uintptr_t *start, uintptr_t *end) {
+    int i;
+
+    *start = *end = 0;
+    for (i = 0; i < num_mentries; i++) {
+        if (mentries[i].kind != region)
+            continue;
+        if (*end == 0)
+            *start = mentries[i].addr;
+        *end = mentries[i].addr + mentries[i].len;
+    }
+}
 
 void *get_heap_addr(void) {
     return heap_addr;
 }
 
+/*  The heap
+ *
+ *  Programs move the end of their heap with realloc_segment, often by a few pages at a
+ *  time. The heap's address range is reserved inaccessible in steps of 64M, and made usable
+ *  in chunks that double with the size of the heap, so most moves are only remembering the
+ *  new end. The pages past the end of a heap that shrinks are given back to the host, and
+ *  read as zeros if it grows again, like freshly mapped pages would.
+ */
+static int heap_reserve(uintptr_t end) {
+    uintptr_t want = heap_reserved + HEAP_RESERVE_STEP;
+
+    if (want < end)
+        want = end;
+    // something of the host's may be in the way of a whole step
+    if (map_holes(heap_reserved, want, MEM_HEAP)) {
+        if (map_holes(heap_reserved, end, MEM_HEAP)) {
+            PRINT_DBG("> heap_alloc: Cannot reserve the heap up to %#"PRIxPTR"\n", end);
+            return 1;
+        }
+        want = end;
+    }
+
+    heap_reserved = want;
+    return 0;
+}
+
 int heap_alloc(void *end_addr) {
-    int ret;
-    size_t heapsize;
+    uintptr_t pagesize = sysconf(_SC_PAGE_SIZE), end = ROUNDOFF((uintptr_t) end_addr, pagesize);
 
     if (end_addr < heap_addr) {
         PRINT_DBG("> heap_alloc: Address %p < %p\n", end_addr, heap_addr);
         return 1;
     }
-    heapsize = end_addr - heap_addr;
 
-    ret = mem_map(heap_addr, heapsize);
-    if (ret) heap_addr = end_addr;
-    return ret;
+    if (end > heap_committed) {
+        uintptr_t commit = heap_committed + (heap_committed - (uintptr_t) heap_addr);
+
+        if (commit < heap_committed + HEAP_MIN_COMMIT)
+            commit = heap_committed + HEAP_MIN_COMMIT;
+        if (commit < end)
+            commit = end;
+
+        // a reservation that can't take the whole chunk commits what was asked for
+        if (commit > heap_reserved && heap_reserve(commit)) {
+            commit = end;
+            if (end > heap_reserved && heap_reserve(end))
+                return 1;
+        }
+        if (heap_parts(heap_committed, commit, mprotect, PROT_ALL)) {
+            PRINT_DBG("> heap_alloc: Cannot commit the heap up to %#"PRIxPTR"\n", commit);
+            return 1;
+        }
+        heap_committed = commit;
+        stat_heap_commits++;
+    }
+
+    if (end > heap_end) {
+        if (mem_advice[MEM_HEAP] & ADVICE_POPULATE)
+            heap_parts(heap_end, end, madvise, MADV_POPULATE_WRITE);
+        stat_heap_grows++;
+    }
+    else if (end < heap_end) {
+        heap_parts(end, heap_end, madvise, MADV_DONTNEED);
+        stat_heap_shrinks++;
+        stat_heap_releases += (heap_end - end) / pagesize;
+    }
+
+    heap_end = end;
+    return 0;
+}
+
+void mem_print_stats(void) {
+    struct rusage ru;
+
+    PRINT_ERR("  heap: %u grows (%u commits), %u shrinks (%u pages released), %lu K used, %lu K committed, %lu K reserved\n",
+        stat_heap_grows, stat_heap_commits, stat_heap_shrinks, stat_heap_releases,
+        (ulong) (heap_end - (uintptr_t) heap_addr) >> 10, (ulong) (heap_committed - (uintptr_t) heap_addr) >> 10,
+        (ulong) (heap_reserved - (uintptr_t) heap_addr) >> 10);
+    if (!getrusage(RUSAGE_SELF, &ru))
+        PRINT_ERR("  memory: %ld page faults, %ld of them read from disk\n", ru.ru_minflt + ru.ru_majflt, ru.ru_majflt);
 }
@@ -1,11 +1,26 @@
 #ifndef EXE32_MEMMAP_H
 #define EXE32_MEMMAP_H
 
-int mem_map(void *, size_t);
+#include <stdint.h>
+#include <sys/types.h>
+
+/* kinds of mapped memory, for EXE32_MEMADVICE */
+#define MEM_TEXT  0
+#define MEM_DATA  1
+#define MEM_BSS   2
+#define MEM_HEAP  3
+#define MEM_STACK 4
+#define MEM_NUM_REGIONS 5
+
+void mem_advice_init(void);
+int mem_map(void *, size_t, int);
+int mem_map_file(void *, size_t, int, int, off_t, int);
 void mem_unmap_all(void);
 void print_map_entries(void);
+void mem_region_range(int, uintptr_t *, uintptr_t *);
 
 void *get_heap_addr(void);
 int heap_alloc(void *);
+void mem_print_stats(void);
 
 #endif // EXE32_MEMMAP_H
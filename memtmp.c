@@ -0,0 +1,464 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+#include "common.h"
+#include "memtmp.h"
+
+/*  In-memory temp files (EXE32_MEMTMP=<dir>, or EXE32_MEMTMP=1 for $TMPDIR or /tmp)
+ *
+ *  Files created under <dir> are memfds instead of files on disk. They live in a namespace
+ *  held by a small holder process that the first loader forks: creating a file sends the
+ *  memfd to the holder with its name, opening it gets the memfd back and reopens it through
+ *  /proc/self/fd so it has its own file offset. Requests go over a SOCK_SEQPACKET socket
+ *  whose fd is passed down in EXE32_MEMTMP_SOCK, so the programs spawned from there on see
+ *  the same files. Each request carries one end of a new socketpair for the reply, so that
+ *  replies to processes sharing the socket don't get mixed up. The holder exits, and the
+ *  files are gone, when the last process with the socket exits.
+ *
+ *  Files that are not in the namespace are looked up on disk as usual.
+ */
+
+#define MEMTMP_MAX_MSG (2 * PATH_MAX + 2)
+
+static char *memtmp_dir = NULL;
+static size_t memtmp_dir_len;
+static int ns_sock = -1;
+
+struct ns_entry {
+    char *name;
+    int fd;
+};
+
+static int send_msg(int sock, const void *buf, size_t len, const int *fds, int nfds) {
+    char cbuf[CMSG_SPACE(sizeof(int) * 2)];
+    struct iovec iov = {(void *) buf, len};
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (nfds > 0) {
+        msg.msg_control = cbuf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+
+    while (sendmsg(sock, &msg, 0) != (ssize_t) len) {
+        if (errno != EINTR) return 1;
+    }
+    return 0;
+}
+
+// receives a message with up to two fds, returns its length (0 when the other end is closed)
+static ssize_t recv_msg(int sock, void *buf, size_t len, int *fds, int *nfds) {
+    char cbuf[CMSG_SPACE(sizeof(int) * 2)];
+    struct iovec iov = {buf, len};
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    while ((ret = recvmsg(sock, &msg, 0)) < 0 && errno == EINTR);
+
+    *nfds = 0;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (ret >= 0 && cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        *nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * *nfds);
+    }
+    return ret;
+}
+
+/* -- holder -- */
+
+static int find_entry(struct ns_entry *entries, int nentries, const char *name) {
+    int i;
+
+    for (i = 0; i < nentries; i++) {
+        if (!strcmp(entries[i].name, name))
+            return i;
+    }
+    return -1;
+}
+
+static void remove_entry(struct ns_entry *entries, int *nentries, int i) {
+    free(entries[i].name);
+    close(entries[i].fd);
+    entries[i] = entries[--*nentries];
+}
+
+__attribute__((noreturn)) static void holder_loop(int sock) {
+    struct ns_entry *entries = NULL;
+    int nentries = 0, max_entries = 0;
+    char buf[MEMTMP_MAX_MSG + 1];
+    ssize_t len;
+    int fds[2], nfds;
+
+    while ((len = recv_msg(sock, buf, MEMTMP_MAX_MSG, fds, &nfds)) > 0) {
+        char *name = buf + 1, *new_name;
+        int32_t result = 0;
+        int i, j, reply_fd = -1;
+
+        buf[len] = '\0';
+        new_name = name + strlen(name) + 1;
+        if (nfds < 1) continue;
+        if (nfds < 2) fds[1] = -1;
+
+        i = find_entry(entries, nentries, name);
+        switch (buf[0]) {
+            case 'C':
+                if (fds[1] == -1) {
+                    result = EINVAL;
+                    break;
+                }
+                if (i != -1)
+                    remove_entry(entries, &nentries, i);
+                if (nentries == max_entries) {
+                    max_entries = max_entries ? max_entries * 2 : 16;
+                    entries = realloc(entries, max_entries * sizeof(*entries));
+                }
+                entries[nentries].name = strdup(name);
+                entries[nentries++].fd = fds[1];
+                fds[1] = -1;
+                break;
+            case 'O':
+                if (i == -1)
+                    result = ENOENT;
+                else
+                    reply_fd = entries[i].fd;
+                break;
+            case 'D':
+                if (i == -1)
+                    result = ENOENT;
+                else
+                    remove_entry(entries, &nentries, i);
+                break;
+            case 'R':
+                if (i == -1 || new_name >= buf + len) {
+                    result = ENOENT;
+                    break;
+                }
+                if ((j = find_entry(entries, nentries, new_name)) != -1 && j != i) {
+                    remove_entry(entries, &nentries, j);
+                    if (i == nentries) i = j; // the last entry moved to the removed one
+                }
+                free(entries[i].name);
+                entries[i].name = strdup(new_name);
+                break;
+            default:
+                result = EINVAL;
+        }
+
+        send_msg(fds[0], &result, sizeof(result), &reply_fd, reply_fd != -1);
+        close(fds[0]);
+        if (fds[1] != -1)
+            close(fds[1]);
+    }
+
+    _exit(0);
+}
+
+// forks the holder, detached from the loader so that its exit is never waited for
+static int start_holder(void) {
+    int socks[2], null_fd, fd, max_fd;
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, socks))
+        return 1;
+
+    fflush(NULL);
+    if ((pid = fork()) == -1) {
+        close(socks[0]);
+        close(socks[1]);
+        return 1;
+    }
+    if (pid == 0) {
+        if (fork() != 0)
+            _exit(0);
+
+        // keep nothing of the loader's open, pipes and locks included, except stderr
+        if ((null_fd = open("/dev/null", O_RDWR)) != -1) {
+            dup2(null_fd, 0);
+            dup2(null_fd, 1);
+        }
+        max_fd = sysconf(_SC_OPEN_MAX);
+        if (max_fd < 0 || max_fd > 65536) max_fd = 65536;
+        for (fd = 3; fd < max_fd; fd++) {
+            if (fd != socks[0])
+                close(fd);
+        }
+        chdir("/");
+        holder_loop(socks[0]);
+    }
+
+    waitpid(pid, NULL, 0);
+    close(socks[0]);
+    ns_sock = socks[1];
+    return 0;
+}
+
+/* -- loader side -- */
+
+void memtmp_init(void) {
+    char *env_dir = getenv("EXE32_MEMTMP"), *env_sock = getenv("EXE32_MEMTMP_SOCK");
+    char sockstr[16];
+
+    free(memtmp_dir);
+    memtmp_dir = NULL;
+    ns_sock = -1;
+
+    if (env_dir == NULL || env_dir[0] == '\0' || !strcmp(env_dir, "0"))
+        return;
+    if (!strcmp(env_dir, "1") && (env_dir = getenv("TMPDIR")) == NULL)
+        env_dir = "/tmp";
+    if (env_dir[0] != '/') {
+        PRINT_ERR("EXE32_MEMTMP: \"%s\" is not an absolute path\n", env_dir);
+        return;
+    }
+
+    if (env_sock != NULL) {
+        int type;
+        socklen_t type_len = sizeof(type);
+
+        // started by a loader with a namespace, unless the socket didn't make it here
+        ns_sock = atoi(env_sock);
+        if (getsockopt(ns_sock, SOL_SOCKET, SO_TYPE, &type, &type_len) || type != SOCK_SEQPACKET) {
+            PRINT_DBG("> memtmp: namespace socket %d is gone\n", ns_sock);
+            ns_sock = -1;
+            return;
+        }
+    }
+    else {
+        if (start_holder()) {
+            PRINT_ERR("EXE32_MEMTMP: cannot start the namespace holder: %s\n", strerror(errno));
+            return;
+        }
+        snprintf(sockstr, sizeof(sockstr), "%d", ns_sock);
+        setenv("EXE32_MEMTMP_SOCK", sockstr, 1);
+    }
+
+    memtmp_dir = strdup(env_dir);
+    memtmp_dir_len = strlen(memtmp_dir);
+    while (memtmp_dir_len > 1 && memtmp_dir[memtmp_dir_len - 1] == '/')
+        memtmp_dir[--memtmp_dir_len] = '\0';
+    PRINT_DBG("> memtmp: files under %s are kept in memory\n", memtmp_dir);
+}
+
+int memtmp_active(void) {
+    return memtmp_dir != NULL;
+}
+
+// the namespace name of a path, or NULL if it isn't under the temp dir
+static char *ns_name(const char *path) {
+    char *cwd, *name;
+
+    if (memtmp_dir == NULL)
+        return NULL;
+
+    if (path[0] == '/') {
+        name = strdup(path);
+    }
+    else {
+        if ((cwd = getcwd(NULL, 0)) == NULL)
+            return NULL;
+        name = malloc(strlen(cwd) + strlen(path) + 2);
+        sprintf(name, "%s/%s", cwd, path[0] == '.' && path[1] == '/' ? path + 2 : path);
+        free(cwd);
+    }
+
+    if (strncmp(name, memtmp_dir, memtmp_dir_len) || name[memtmp_dir_len] != '/' || strlen(name) > PATH_MAX) {
+        free(name);
+        return NULL;
+    }
+    return name;
+}
+
+// sends a request to the holder, returns 0 or an errno value
+static int ns_request(char op, const char *name, const char *new_name, int send_fd, int *recv_fd) {
+    char buf[MEMTMP_MAX_MSG];
+    int socks[2], fds[2], nfds = 0;
+    size_t len = 1;
+    int32_t result = EIO;
+
+    buf[0] = op;
+    len += sprintf(buf + len, "%s", name) + 1;
+    if (new_name != NULL)
+        len += sprintf(buf + len, "%s", new_name) + 1;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, socks))
+        return errno;
+    fds[0] = socks[1];
+    fds[1] = send_fd;
+    if (!send_msg(ns_sock, buf, len, fds, send_fd != -1 ? 2 : 1)) {
+        close(socks[1]);
+        socks[1] = -1;
+        if (recv_msg(socks[0], &result, sizeof(result), fds, &nfds) != sizeof(result))
+            result = EIO;
+    }
+
+    if (nfds > 0) {
+        if (recv_fd != NULL && result == 0)
+            *recv_fd = fds[0];
+        else
+            close(fds[0]);
+    }
+    close(socks[0]);
+    if (socks[1] != -1)
+        close(socks[1]);
+    return result;
+}
+
+int memtmp_match(const char *path) {
+    char *name = ns_name(path);
+
+    free(name);
+    return name != NULL;
+}
+
+int memtmp_create(const char *path) {
+    char *name = ns_name(path);
+    int fd, ret;
+
+    if (name == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if ((fd = syscall(SYS_memfd_create, basename(name), MFD_CLOEXEC)) == -1) {
+        free(name);
+        return -1;
+    }
+    if ((ret = ns_request('C', name, NULL, fd, NULL))) {
+        PRINT_DBG("> memtmp: cannot add \"%s\" (%s)\n", name, strerror(ret));
+        close(fd);
+        free(name);
+        errno = ret;
+        return -1;
+    }
+    PRINT_DBG("> memtmp: created \"%s\"\n", name);
+
+    free(name);
+    return fd;
+}
+
+// an fd of the file with its own offset, or -1 with errno set
+int memtmp_open(const char *path, int flags) {
+    char *name = ns_name(path), proc_path[32];
+    int fd = -1, ns_fd, ret;
+
+    if (name == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if ((ret = ns_request('O', name, NULL, -1, &ns_fd)) == 0) {
+        snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", ns_fd);
+        if ((fd = open(proc_path, flags | O_CLOEXEC)) != -1)
+            ret = 0;
+        else
+            ret = errno;
+        close(ns_fd);
+    }
+
+    free(name);
+    errno = ret;
+    return fd;
+}
+
+int memtmp_stat(const char *path, struct stat *st) {
+    int fd = memtmp_open(path, O_RDONLY), ret;
+
+    if (fd == -1)
+        return -1;
+    ret = fstat(fd, st);
+    close(fd);
+    return ret;
+}
+
+int memtmp_remove(const char *path) {
+    char *name = ns_name(path);
+    int ret;
+
+    if (name == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    ret = ns_request('D', name, NULL, -1, NULL);
+    free(name);
+
+    errno = ret;
+    return ret ? -1 : 0;
+}
+
+// copies a file out of the namespace, for renames to outside of the temp dir
+static int copy_out(const char *path, const char *new_path) {
+    char buf[65536];
+    ssize_t len;
+    int fd = memtmp_open(path, O_RDONLY), new_fd, ret = 0;
+
+    if (fd == -1)
+        return -1;
+    if ((new_fd = open(new_path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        if (write(new_fd, buf, len) != len) {
+            ret = -1;
+            break;
+        }
+    }
+    if (len < 0)
+        ret = -1;
+
+    close(fd);
+    if (close(new_fd))
+        ret = -1;
+    return ret;
+}
+
+int memtmp_rename(const char *oldpath, const char *newpath) {
+    char *old_name = ns_name(oldpath), *new_name;
+    int ret;
+
+    if (old_name == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if ((new_name = ns_name(newpath)) != NULL) {
+        ret = ns_request('R', old_name, new_name, -1, NULL);
+        free(new_name);
+    }
+    else if (copy_out(oldpath, newpath)) {
+        ret = errno;
+    }
+    else {
+        ret = ns_request('D', old_name, NULL, -1, NULL);
+    }
+    free(old_name);
+
+    errno = ret;
+    return ret ? -1 : 0;
+}
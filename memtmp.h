@@ -0,0 +1,16 @@
+#ifndef EXE32_MEMTMP_H
+#define EXE32_MEMTMP_H
+
+#include <sys/stat.h>
+
+void memtmp_init(void);
+int memtmp_active(void);
+int memtmp_match(const char *);
+
+int memtmp_create(const char *);
+int memtmp_open(const char *, int);
+int memtmp_stat(const char *, struct stat *);
+int memtmp_remove(const char *);
+int memtmp_rename(const char *, const char *);
+
+#endif // EXE32_MEMTMP_H
@@ -4,15 +4,17 @@
 #include <dirent.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/stat.h>
 #include "common.h"
+#include "dircache.h"
 
-/* replace case insensitive path */
+/*  replace case insensitive path
+ *  the names are looked up in the directory cache, see dircache.c
+ */
 void replace_case_path(char *path) {
-    int pl = 0;
-    size_t cul, pathlen = strlen(path);
-    char *curstr = path, *pret = path, *pbuf;
-    DIR *d;
-    struct dirent *dent = NULL;
+    size_t cul, pl = 0, pathlen = strlen(path);
+    char *curstr, *pret = path, *pbuf;
+    const char *real_name;
 
     if (!access(path, R_OK)) {
         // exit if the path is already correct
@@ -21,67 +23,30 @@ void replace_case_path(char *path) {
 
     PRINT_DBG("> replace_case_path: Original = %s\n", path);
     pbuf = malloc(pathlen + 1);
+    pbuf[0] = '\0';
     if (path[0] == '/') {
-        d = opendir("/");
-        pbuf[0] = '/';
-        pbuf[1] = '\0';
+        strcpy(pbuf, "/");
         pl = 1;
         path++;
     }
-    else {
-        d = opendir(".");
-        pbuf[0] = '\0';
-    }
 
-    while ((curstr = strchr(path, '/'))) {
-        cul = curstr - path;
-
-        if (d != NULL) {
-            while ((dent = readdir(d))) {
-                if (strlen(dent->d_name) == cul &&
-                        !strncasecmp(path, dent->d_name, cul)) {
-                    strncpy(pbuf + pl, dent->d_name, cul + 1);
-                    pbuf[pl+cul] = '/';
-                    pbuf[pl+cul+1] = '\0';
-                    closedir(d);
-                    d = opendir(pbuf);
-                    break;
-                }
-            }
-        }
-        if (d == NULL || dent == NULL) {
-            strncpy(pbuf + pl, path, cul + 1);
-            d = opendir(pbuf);
-            if (errno == ENOENT) {
-                strcpy(pbuf + pl, path);
-                path += strlen(path);
-                break;
-            }
-        }
+    while (*path != '\0') {
+        cul = (curstr = strchr(path, '/')) != NULL ? (size_t) (curstr - path) : strlen(path);
 
-        path += cul + 1;
-        pl += cul + 1;
-    }
+        // names that aren't there, or are in a directory that can't be read, are kept
+        if ((real_name = dircache_lookup(pbuf, path, cul)) == NULL)
+            real_name = path;
 
-    if (*path != '\0') {
-        cul = strlen(path);
-        if (d != NULL) {
-            while ((dent = readdir(d))) {
-                if (strlen(dent->d_name) == cul &&
-                        !strncasecmp(path, dent->d_name, cul)) {
-                    strncpy(pbuf + pl, dent->d_name, cul);
-                    break;
-                }
-            }
-        }
-        if (dent == NULL) {
-            // strncpy(pbuf + pl, path, cul);
-            memcpy(pbuf + pl, path, cul); /* that stupid stringop-trunctation warning is annoying to me! */
-            pbuf[pl+cul] = '\0';
+        memcpy(pbuf + pl, real_name, cul);
+        pl += cul;
+        path += cul;
+        if (*path == '/') {
+            pbuf[pl++] = '/';
+            path++;
         }
+        pbuf[pl] = '\0';
     }
 
-    if (d) closedir(d);
     strncpy(pret, pbuf, pathlen);
     PRINT_DBG ("> replace_case_path: Replaced = %s\n", pret);
     free(pbuf);
@@ -136,3 +101,29 @@ char *fix_progname(const char *progname) {
     return new_progname;
 }
 
+
+// ~/.cache/exe32-linux (or $XDG_CACHE_HOME/exe32-linux), created if needed
+char *get_cache_dir(void) {
+    char *cache_dir, *dir;
+
+    if ((cache_dir = getenv("XDG_CACHE_HOME")) != NULL && cache_dir[0] == '/') {
+        dir = malloc(strlen(cache_dir) + sizeof("/exe32-linux"));
+        strcpy(dir, cache_dir);
+    }
+    else if ((cache_dir = getenv("HOME")) != NULL && cache_dir[0] == '/') {
+        dir = malloc(strlen(cache_dir) + sizeof("/.cache/exe32-linux"));
+        strcpy(dir, cache_dir);
+        strcat(dir, "/.cache");
+        mkdir(dir, 0755);
+    }
+    else return NULL;
+
+    strcat(dir, "/exe32-linux");
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        PRINT_DBG("> get_cache_dir: cannot create \"%s\" (%s)\n", dir, strerror(errno));
+        free(dir);
+        return NULL;
+    }
+
+    return dir;
+}
@@ -5,5 +5,6 @@ char *fix_win_path(char *path);
 void replace_case_path(char *path);
 void join_args(char *jpaths, int argc, char **argv);
 char *fix_progname(const char *progname);
+char *get_cache_dir(void);
 
 #endif // EXE32_PATHS_H
@@ -0,0 +1,53 @@
+#ifndef EXE32_PRELINK_H
+#define EXE32_PRELINK_H
+
+#include <stdint.h>
+
+/*  Prelinked image, as written by exe32-prelink:
+ *
+ *    +--------------------------+ 0x0
+ *    | struct PrelinkHdr_s      |
+ *    | struct PrelinkSeg_s[...] |
+ *    +--------------------------+ PRELINK_PAGE_SIZE
+ *    | segment contents, each   |
+ *    | one page aligned         |
+ *    +--------------------------+
+ *
+ *  Every segment covers whole pages, so the loader can mmap each of them
+ *  straight from the file with its own protection. Pages shared by two COFF
+ *  sections (like the last page of .text and the first one of .data) get a
+ *  segment of their own with the protections of both.
+ *
+ *  Images go to PRELINK_DIR next to the program they come from, which stays
+ *  as it is: gcc.out loads some of the other programs with its own COFF
+ *  loader. The loader only uses an image whose source size and modification
+ *  time still match the program's.
+ */
+#define PRELINK_MAGIC     0x50323345 /* "E32P" */
+#define PRELINK_VERSION   2
+#define PRELINK_PAGE_SIZE 0x1000
+#define PRELINK_DIR       "prelinked/"
+
+#define PSEG_READ  (1 << 0)
+#define PSEG_WRITE (1 << 1)
+#define PSEG_EXEC  (1 << 2)
+
+struct PrelinkHdr_s {
+    uint32_t ph_magic;
+    uint16_t ph_version;
+    uint16_t ph_nsegs;
+    uint32_t ph_entry;    /* address of the first STYP_TEXT section */
+    uint32_t ph_checksum; /* FNV-1a of all segment contents in file order, checked by exe32-prelink -c */
+    uint32_t ph_src_size; /* size of the COFF program it was made from */
+    uint32_t ph_src_mtime;/* and its modification time */
+};
+
+struct PrelinkSeg_s {
+    uint32_t ps_vaddr;    /* page aligned */
+    uint32_t ps_memsz;    /* multiple of PRELINK_PAGE_SIZE */
+    uint32_t ps_filesz;   /* multiple of PRELINK_PAGE_SIZE, zero-filled beyond it */
+    uint32_t ps_fileoff;  /* page aligned */
+    uint32_t ps_flags;    /* PSEG_* */
+};
+
+#endif // EXE32_PRELINK_H
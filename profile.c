@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdint.h>
+#include "common.h"
+#include "wrappers.h"
+#include "profile.h"
+#include "trace.h"
+#include "sample.h"
+
+/*  Wrapper profiler (EXE32_PROFILE=<file>)
+ *
+ *  The program is given a table of thunks instead of the wrappers themselves. Each thunk
+ *  counts the call, times the wrapper it calls with CLOCK_MONOTONIC and puts the time in a
+ *  histogram of powers of two nanoseconds. Reads and writes also count the bytes they
+ *  returned. When the program exits one line of JSON is appended to <file>, so spawned
+ *  programs add their own lines: the time the program ran, how much of it was spent in
+ *  the wrappers (including waiting for spawned programs) and in the program itself, and
+ *  the numbers of each wrapper that was called.
+ *
+ *  The thunks take as many arguments as the wrapper with the most and pass them all on.
+ *  The program pushes and pops its arguments itself (cdecl), so a wrapper that takes fewer
+ *  only doesn't look at the rest.
+ *
+ *  The same thunks write the calls to the trace when there's one (EXE32_TRACE, trace.c),
+ *  and tell the sampler (EXE32_SAMPLE, sample.c) which wrapper the program is in and where
+ *  it called it from.
+ */
+
+#define HIST_BUCKETS 32
+#define WRAPPER_READ 4
+#define WRAPPER_WRITE 3
+#define WRAPPER_EXIT 28
+
+struct wrapper_prof {
+    uint64_t calls;
+    uint64_t total_ns, max_ns;
+    uint64_t bytes;
+    uint64_t hist[HIST_BUCKETS];   /* hist[i] counts calls that took < 2^i ns */
+};
+
+static char *profile_path = NULL;
+static char *prog_name = NULL;
+static int profiling = 0;
+static uint64_t start_ns, host_ns;
+static struct wrapper_prof profs[NUM_WRAPPERS];
+
+typedef int (*wrapper_t)(int, int, int, int);
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void profile_init(void) {
+    char *env_profile = getenv("EXE32_PROFILE");
+
+    free(profile_path);
+    profile_path = env_profile != NULL && env_profile[0] != '\0' ? strdup(env_profile) : NULL;
+}
+
+static void count_call(int idx, uint64_t ns, int ret) {
+    struct wrapper_prof *prof = &profs[idx];
+    int bucket = 0;
+
+    prof->calls++;
+    prof->total_ns += ns;
+    if (ns > prof->max_ns)
+        prof->max_ns = ns;
+    while (bucket < HIST_BUCKETS - 1 && ns >= ((uint64_t) 1 << bucket))
+        bucket++;
+    prof->hist[bucket]++;
+    if ((idx == WRAPPER_READ || idx == WRAPPER_WRITE) && ret > 0)
+        prof->bytes += ret;
+    host_ns += ns;
+}
+
+static int call_wrapper(int idx, int a, int b, int c, int d, void *guest_ret, void *guest_fp) {
+    uint32_t args[3] = { a, b, c };
+    uint64_t begin, ns;
+    int ret;
+
+    sample_enter(idx, guest_ret, guest_fp);
+
+    // exit doesn't come back, it's counted before
+    if (idx == WRAPPER_EXIT) {
+        if (profiling)
+            count_call(idx, 0, 0);
+        trace_call(idx, args, 0, now_ns(), 0);
+    }
+
+    begin = now_ns();
+    ret = ((wrapper_t) io_wrappers[idx])(a, b, c, d);
+    ns = now_ns() - begin;
+    sample_leave();
+    if (profiling)
+        count_call(idx, ns, ret);
+    trace_call(idx, args, ret, begin, ns);
+    return ret;
+}
+
+// the frame of a thunk starts with the program's frame pointer
+#define THUNK(idx) \
+    CDECL static int thunk_##idx(int a, int b, int c, int d) { \
+        return call_wrapper(idx, a, b, c, d, __builtin_return_address(0), *(void **) __builtin_frame_address(0)); }
+
+THUNK(0)  THUNK(1)  THUNK(2)  THUNK(3)  THUNK(4)  THUNK(5)  THUNK(6)  THUNK(7)
+THUNK(8)  THUNK(9)  THUNK(10) THUNK(11) THUNK(12) THUNK(13) THUNK(14) THUNK(15)
+THUNK(16) THUNK(17) THUNK(18) THUNK(19) THUNK(20) THUNK(21) THUNK(22) THUNK(23)
+THUNK(24) THUNK(25) THUNK(26) THUNK(27) THUNK(28) THUNK(29) THUNK(30)
+
+static func_wrapper thunks[NUM_WRAPPERS + 1] = {
+    (func_wrapper) thunk_0,  (func_wrapper) thunk_1,  (func_wrapper) thunk_2,  (func_wrapper) thunk_3,
+    (func_wrapper) thunk_4,  (func_wrapper) thunk_5,  (func_wrapper) thunk_6,  (func_wrapper) thunk_7,
+    (func_wrapper) thunk_8,  (func_wrapper) thunk_9,  (func_wrapper) thunk_10, (func_wrapper) thunk_11,
+    (func_wrapper) thunk_12, (func_wrapper) thunk_13, (func_wrapper) thunk_14, (func_wrapper) thunk_15,
+    (func_wrapper) thunk_16, (func_wrapper) thunk_17, (func_wrapper) thunk_18, (func_wrapper) thunk_19,
+    (func_wrapper) thunk_20, (func_wrapper) thunk_21, (func_wrapper) thunk_22, (func_wrapper) thunk_23,
+    (func_wrapper) thunk_24, (func_wrapper) thunk_25, (func_wrapper) thunk_26, (func_wrapper) thunk_27,
+    (func_wrapper) thunk_28, (func_wrapper) thunk_29, (func_wrapper) thunk_30,
+    (func_wrapper) NULL
+};
+
+// the wrapper table to give the program
+func_wrapper *profile_wrappers(func_wrapper *wrappers) {
+    return profiling || trace_active() || sample_active() ? thunks : wrappers;
+}
+
+void profile_begin(const char *name) {
+    if (profile_path == NULL)
+        return;
+
+    free(prog_name);
+    prog_name = strdup(name);
+    memset(profs, 0, sizeof(profs));
+    host_ns = 0;
+    profiling = 1;
+    start_ns = now_ns();
+}
+
+// appends a JSON string, with what JSON can't have escaped
+static char *json_string(char *out, const char *str) {
+    *out++ = '"';
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            *out++ = '\\';
+        if ((unsigned char) *str < 0x20) {
+            out += sprintf(out, "\\u%04x", *str);
+            continue;
+        }
+        *out++ = *str;
+    }
+    *out++ = '"';
+    return out;
+}
+
+void profile_finish(int status) {
+    uint64_t total_ns;
+    char *line, *out;
+    int i, j, fd;
+
+    if (!profiling)
+        return;
+    profiling = 0;
+    total_ns = now_ns() - start_ns;
+
+    // one write, so the lines of programs that exit at once don't mix
+    line = malloc(strlen(prog_name) * 6 + 256 + NUM_WRAPPERS * (128 + HIST_BUCKETS * 22));
+    out = line;
+    out += sprintf(out, "{\"pid\":%d,\"program\":", (int) getpid());
+    out = json_string(out, prog_name);
+    out += sprintf(out, ",\"status\":%d,\"total_ns\":%llu,\"host_ns\":%llu,\"guest_ns\":%llu,\"wrappers\":{",
+        status, (unsigned long long) total_ns, (unsigned long long) host_ns,
+        (unsigned long long) (total_ns > host_ns ? total_ns - host_ns : 0));
+
+    for (i = 0, j = 0; i < NUM_WRAPPERS; i++) {
+        struct wrapper_prof *prof = &profs[i];
+        int last = HIST_BUCKETS - 1, k;
+
+        if (prof->calls == 0)
+            continue;
+        while (last > 0 && prof->hist[last] == 0)
+            last--;
+
+        out += sprintf(out, "%s\"%s\":{\"calls\":%llu,\"total_ns\":%llu,\"max_ns\":%llu", j++ ? "," : "",
+            wrapper_names[i], (unsigned long long) prof->calls, (unsigned long long) prof->total_ns,
+            (unsigned long long) prof->max_ns);
+        if (i == WRAPPER_READ || i == WRAPPER_WRITE)
+            out += sprintf(out, ",\"bytes\":%llu", (unsigned long long) prof->bytes);
+        // calls that took less than 1, 2, 4... ns
+        out += sprintf(out, ",\"hist_log2_ns\":[");
+        for (k = 0; k <= last; k++)
+            out += sprintf(out, "%s%llu", k ? "," : "", (unsigned long long) prof->hist[k]);
+        out += sprintf(out, "]}");
+    }
+    out += sprintf(out, "}}\n");
+
+    if ((fd = open(profile_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666)) == -1) {
+        PRINT_ERR("Cannot write profile \"%s\"\n", profile_path);
+    }
+    else {
+        if (write(fd, line, out - line) != out - line)
+            PRINT_ERR("Cannot write profile \"%s\"\n", profile_path);
+        close(fd);
+    }
+    free(line);
+}
@@ -0,0 +1,11 @@
+#ifndef EXE32_PROFILE_H
+#define EXE32_PROFILE_H
+
+#include "wrappers.h"
+
+void profile_init(void);
+func_wrapper *profile_wrappers(func_wrapper *);
+void profile_begin(const char *);
+void profile_finish(int);
+
+#endif // EXE32_PROFILE_H
@@ -0,0 +1,458 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "memmap.h"
+#include "trace.h"
+#include "sample.h"
+
+/*  Sampling profiler (EXE32_SAMPLE=<dir>)
+ *
+ *  While a program runs, SIGPROF interrupts it EXE32_SAMPLE_HZ times a second of CPU time
+ *  (997 by default) and the handler looks at where it was: in the program's text, in the
+ *  loader (a wrapper the program called) or anywhere else, which is libc and the kernel's
+ *  vdso. For the program it follows the saved frame pointers up its stack, as far as they
+ *  lead into its text, so the sample becomes a stack. For the loader and libc it takes the
+ *  wrapper the program was in, from the thunks (see profile.c), and the program's stack
+ *  where it called it. The handler only counts into tables set up beforehand.
+ *
+ *  When the program exits the stacks are written to <dir>/<program>-<pid>.folded, in the
+ *  "folded" format that flamegraph.pl reads, and the number of samples at each address of
+ *  the program to <dir>/<program>-<pid>.hist. The .out programs have no symbols: with
+ *  EXE32_SAMPLE_SYMS=<map>, addresses are shown as the functions in the map, lines of
+ *  "<hex address> [<type>] <name>" like nm prints. The map is either a file or a directory
+ *  with one for each program, like cc1.map for cc1.out.
+ */
+
+#define SAMPLE_DEFAULT_HZ 997
+#define MAX_DEPTH   30
+#define STACK_SLOTS 4096        /* powers of two */
+#define ADDR_SLOTS  8192
+#define ALT_STACK_SIZE (64 * 1024)
+
+/* indices into gregs, which <sys/ucontext.h> only names with _GNU_SOURCE */
+#if defined(__i386__)
+#define GREG_PC 14  /* REG_EIP */
+#define GREG_FP 6   /* REG_EBP */
+#else
+#define GREG_PC 16  /* REG_RIP */
+#endif
+
+#define KIND_GUEST 0
+#define KIND_HOST  1
+#define KIND_LIBC  2
+
+struct stack_slot {
+    uint32_t count;
+    uint16_t depth;
+    uint8_t kind;
+    uint8_t wrapper;           /* +1, 0 if the program wasn't in one */
+    uint32_t frames[MAX_DEPTH];  /* the innermost first */
+};
+
+struct addr_slot {
+    uint32_t addr;
+    uint32_t count;
+};
+
+struct symbol {
+    uint32_t addr;
+    char *name;
+};
+
+extern char __executable_start[], etext[];
+
+static char *sample_dir = NULL, *sample_syms = NULL, *prog_name = NULL;
+static int sample_hz = SAMPLE_DEFAULT_HZ;
+static volatile int sampling = 0;
+static uintptr_t text_start, text_end, stack_start, stack_end;
+
+static struct stack_slot *stacks = NULL;
+static struct addr_slot *addrs = NULL;
+static void *alt_stack = NULL;
+static uint32_t kind_samples[3], lost_samples, wrapper_samples[NUM_WRAPPERS];
+
+// where the program called the wrapper it's in, set by the thunks
+static volatile int cur_wrapper = -1;
+static volatile uint32_t cur_ret, cur_fp;
+
+static struct symbol *syms = NULL;
+static int num_syms = 0;
+
+void sample_init(void) {
+    char *env_dir = getenv("EXE32_SAMPLE"), *env_hz = getenv("EXE32_SAMPLE_HZ"), *env_syms = getenv("EXE32_SAMPLE_SYMS");
+
+    free(sample_dir);
+    free(sample_syms);
+    sample_dir = env_dir != NULL && env_dir[0] != '\0' ? strdup(env_dir) : NULL;
+    sample_syms = env_syms != NULL && env_syms[0] != '\0' ? strdup(env_syms) : NULL;
+    sample_hz = env_hz != NULL && atoi(env_hz) > 0 ? atoi(env_hz) : SAMPLE_DEFAULT_HZ;
+}
+
+int sample_active(void) {
+    return sample_dir != NULL;
+}
+
+void sample_enter(int wrapper, void *ret, void *fp) {
+    cur_ret = (uint32_t) (uintptr_t) ret;
+    cur_fp = (uint32_t) (uintptr_t) fp;
+    cur_wrapper = wrapper;
+}
+
+void sample_leave(void) {
+    cur_wrapper = -1;
+}
+
+static int in_text(uint32_t addr) {
+    return addr >= text_start && addr < text_end;
+}
+
+// the return addresses of the frames from fp up, as long as they look like the program's
+static int walk_frames(uint32_t fp, uint32_t *frames, int depth) {
+    while (depth < MAX_DEPTH && fp >= stack_start && fp + 8 <= stack_end && !(fp & 3)) {
+        uint32_t *frame = (uint32_t *) (uintptr_t) fp;
+
+        if (!in_text(frame[1]))
+            break;
+        frames[depth++] = frame[1];
+        // frames only go up the stack
+        if (frame[0] <= fp)
+            break;
+        fp = frame[0];
+    }
+    return depth;
+}
+
+static void count_addr(uint32_t addr) {
+    uint32_t i = (addr * 2654435761u) & (ADDR_SLOTS - 1), n;
+
+    for (n = 0; n < ADDR_SLOTS; n++, i = (i + 1) & (ADDR_SLOTS - 1)) {
+        if (addrs[i].count == 0 || addrs[i].addr == addr) {
+            addrs[i].addr = addr;
+            addrs[i].count++;
+            return;
+        }
+    }
+}
+
+static void count_stack(int kind, int wrapper, const uint32_t *frames, int depth) {
+    uint32_t hash = 2166136261u ^ (kind << 8 | wrapper), i, n;
+    int d;
+
+    for (d = 0; d < depth; d++)
+        hash = (hash ^ frames[d]) * 16777619u;
+    i = hash & (STACK_SLOTS - 1);
+
+    for (n = 0; n < STACK_SLOTS; n++, i = (i + 1) & (STACK_SLOTS - 1)) {
+        struct stack_slot *slot = &stacks[i];
+
+        if (slot->count == 0) {
+            slot->depth = depth;
+            slot->kind = kind;
+            slot->wrapper = wrapper;
+            memcpy(slot->frames, frames, depth * sizeof(*frames));
+        }
+        else if (slot->depth != depth || slot->kind != kind || slot->wrapper != wrapper
+                || memcmp(slot->frames, frames, depth * sizeof(*frames)))
+            continue;
+        slot->count++;
+        return;
+    }
+    lost_samples++;
+}
+
+static void sigprof_handler(int sig, siginfo_t *info, void *context) {
+    ucontext_t *uc = context;
+    uint32_t frames[MAX_DEPTH];
+    uintptr_t pc;
+    int kind, depth = 0, wrapper = cur_wrapper;
+    (void) sig;
+    (void) info;
+
+    if (!sampling)
+        return;
+    pc = uc->uc_mcontext.gregs[GREG_PC];
+
+    if (in_text(pc)) {
+        kind = KIND_GUEST;
+        frames[depth++] = pc;
+        count_addr(pc);
+#if defined(GREG_FP)
+        depth = walk_frames(uc->uc_mcontext.gregs[GREG_FP], frames, depth);
+#endif
+        // the program was back from the wrapper before the thunk said so
+        wrapper = -1;
+    }
+    else {
+        kind = pc >= (uintptr_t) __executable_start && pc < (uintptr_t) etext ? KIND_HOST : KIND_LIBC;
+        if (wrapper >= 0) {
+            wrapper_samples[wrapper]++;
+            if (in_text(cur_ret)) {
+                frames[depth++] = cur_ret;
+                depth = walk_frames(cur_fp, frames, depth);
+            }
+        }
+    }
+    kind_samples[kind]++;
+    count_stack(kind, wrapper + 1, frames, depth);
+}
+
+static void set_timer(int hz) {
+    struct itimerval it;
+
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = hz ? 1000000 / hz : 0;
+    it.it_value = it.it_interval;
+    setitimer(ITIMER_PROF, &it, NULL);
+}
+
+void sample_begin(const char *name) {
+    struct sigaction sa;
+    stack_t ss;
+
+    if (sample_dir == NULL)
+        return;
+
+    free(prog_name);
+    prog_name = strdup(basename((char *) name));
+    mem_region_range(MEM_TEXT, &text_start, &text_end);
+    mem_region_range(MEM_STACK, &stack_start, &stack_end);
+
+    // a forked loader has the tables of its parent
+    if (stacks == NULL) {
+        stacks = malloc(STACK_SLOTS * sizeof(*stacks));
+        addrs = malloc(ADDR_SLOTS * sizeof(*addrs));
+    }
+    memset(stacks, 0, STACK_SLOTS * sizeof(*stacks));
+    memset(addrs, 0, ADDR_SLOTS * sizeof(*addrs));
+    memset(kind_samples, 0, sizeof(kind_samples));
+    memset(wrapper_samples, 0, sizeof(wrapper_samples));
+    lost_samples = 0;
+    cur_wrapper = -1;
+
+    // the guest's stack may be small or nearly used up when the timer fires
+    if (alt_stack == NULL)
+        alt_stack = malloc(ALT_STACK_SIZE);
+    ss.ss_sp = alt_stack;
+    ss.ss_size = ALT_STACK_SIZE;
+    ss.ss_flags = 0;
+    if (sigaltstack(&ss, NULL)) {
+        PRINT_DBG("> sample: no alternate signal stack\n");
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = sigprof_handler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+
+    sampling = 1;
+    set_timer(sample_hz);
+}
+
+static int compare_syms(const void *a, const void *b) {
+    const struct symbol *sa = a, *sb = b;
+
+    return sa->addr < sb->addr ? -1 : sa->addr > sb->addr;
+}
+
+static void load_syms(void) {
+    char line[512], name[256], type[256], *path = sample_syms;
+    struct stat st;
+    unsigned int addr;
+    FILE *f;
+
+    num_syms = 0;
+    if (sample_syms == NULL)
+        return;
+    if (!stat(sample_syms, &st) && S_ISDIR(st.st_mode)) {
+        char *ext;
+
+        path = malloc(strlen(sample_syms) + strlen(prog_name) + 6);
+        sprintf(path, "%s/%s", sample_syms, prog_name);
+        if ((ext = strrchr(path + strlen(sample_syms) + 1, '.')) != NULL)
+            *ext = '\0';
+        strcat(path, ".map");
+    }
+
+    if ((f = fopen(path, "r")) != NULL) {
+        int size = 0;
+
+        while (fgets(line, sizeof(line), f) != NULL) {
+            int n = sscanf(line, "%x %255s %255s", &addr, type, name);
+
+            if (n < 2)
+                continue;
+            if (num_syms == size) {
+                size = size ? size * 2 : 1024;
+                syms = realloc(syms, size * sizeof(*syms));
+            }
+            syms[num_syms].addr = addr;
+            syms[num_syms++].name = strdup(n == 3 ? name : type);
+        }
+        fclose(f);
+        qsort(syms, num_syms, sizeof(*syms), compare_syms);
+    }
+    else if (path != sample_syms) {
+        PRINT_DBG("> sample: no symbol map \"%s\"\n", path);
+    }
+
+    if (path != sample_syms)
+        free(path);
+}
+
+static void free_syms(void) {
+    int i;
+
+    for (i = 0; i < num_syms; i++)
+        free(syms[i].name);
+    num_syms = 0;
+}
+
+// the symbol addr is in, or -1
+static int find_sym(uint32_t addr) {
+    int lo = 0, hi = num_syms - 1, found = -1;
+
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (syms[mid].addr <= addr) {
+            found = mid;
+            lo = mid + 1;
+        }
+        else
+            hi = mid - 1;
+    }
+    return found;
+}
+
+static void print_frame(FILE *f, uint32_t addr) {
+    int sym = find_sym(addr);
+
+    if (sym >= 0)
+        fprintf(f, "%s", syms[sym].name);
+    else
+        fprintf(f, "0x%08x", addr);
+}
+
+static void write_folded(FILE *f) {
+    int i, d;
+
+    for (i = 0; i < STACK_SLOTS; i++) {
+        struct stack_slot *slot = &stacks[i];
+
+        if (slot->count == 0)
+            continue;
+        fprintf(f, "%s", prog_name);
+        for (d = slot->depth - 1; d >= 0; d--) {
+            fputc(';', f);
+            // return addresses are past the call, which can be the start of the next function
+            print_frame(f, d > 0 || slot->kind != KIND_GUEST ? slot->frames[d] - 1 : slot->frames[d]);
+        }
+        if (slot->wrapper)
+            fprintf(f, ";[%s]", wrapper_names[slot->wrapper - 1]);
+        if (slot->kind == KIND_HOST)
+            fprintf(f, ";[exe32-linux]");
+        else if (slot->kind == KIND_LIBC)
+            fprintf(f, ";[libc]");
+        fprintf(f, " %u\n", slot->count);
+    }
+}
+
+static int compare_addrs(const void *a, const void *b) {
+    const struct addr_slot *sa = a, *sb = b;
+
+    if (sa->count != sb->count)
+        return sa->count > sb->count ? -1 : 1;
+    return sa->addr < sb->addr ? -1 : sa->addr > sb->addr;
+}
+
+// the counted ones first
+static int compare_addrs_by_addr(const void *a, const void *b) {
+    const struct addr_slot *sa = a, *sb = b;
+
+    if (!sa->count != !sb->count)
+        return sa->count ? -1 : 1;
+    return sa->addr < sb->addr ? -1 : sa->addr > sb->addr;
+}
+
+static void write_hist(FILE *f) {
+    uint32_t total = kind_samples[KIND_GUEST] + kind_samples[KIND_HOST] + kind_samples[KIND_LIBC];
+    double pct = total ? 100.0 / total : 0;
+    int i, n;
+
+    fprintf(f, "# %s: %u samples at %d Hz, program %u (%.1f%%), exe32-linux %u (%.1f%%), libc %u (%.1f%%), %u not kept\n",
+        prog_name, total, sample_hz, kind_samples[KIND_GUEST], kind_samples[KIND_GUEST] * pct,
+        kind_samples[KIND_HOST], kind_samples[KIND_HOST] * pct, kind_samples[KIND_LIBC], kind_samples[KIND_LIBC] * pct,
+        lost_samples);
+
+    // with a map the addresses are added up by function
+    if (num_syms) {
+        for (i = 0; i < ADDR_SLOTS; i++) {
+            int sym;
+
+            if (addrs[i].count && (sym = find_sym(addrs[i].addr)) >= 0)
+                addrs[i].addr = syms[sym].addr;
+        }
+        qsort(addrs, ADDR_SLOTS, sizeof(*addrs), compare_addrs_by_addr);
+        for (i = 0, n = -1; i < ADDR_SLOTS && addrs[i].count; i++) {
+            if (n >= 0 && addrs[n].addr == addrs[i].addr)
+                addrs[n].count += addrs[i].count;
+            else
+                addrs[++n] = addrs[i];
+        }
+        memset(&addrs[n + 1], 0, (ADDR_SLOTS - n - 1) * sizeof(*addrs));
+    }
+    qsort(addrs, ADDR_SLOTS, sizeof(*addrs), compare_addrs);
+
+    fprintf(f, "\n# samples      %%  address     %s\n", num_syms ? "function" : "");
+    for (i = 0; i < ADDR_SLOTS && addrs[i].count; i++) {
+        int sym = find_sym(addrs[i].addr);
+
+        fprintf(f, "%9u %6.2f  0x%08x  %s\n", addrs[i].count, addrs[i].count * pct, addrs[i].addr,
+            sym >= 0 ? syms[sym].name : "");
+    }
+
+    fprintf(f, "\n# samples      %%  wrapper\n");
+    for (i = 0; i < NUM_WRAPPERS; i++) {
+        if (wrapper_samples[i])
+            fprintf(f, "%9u %6.2f  %s\n", wrapper_samples[i], wrapper_samples[i] * pct, wrapper_names[i]);
+    }
+}
+
+static FILE *open_output(const char *ext) {
+    char *path = malloc(strlen(sample_dir) + strlen(prog_name) + 32);
+    FILE *f;
+
+    sprintf(path, "%s/%s-%d.%s", sample_dir, prog_name, (int) getpid(), ext);
+    if ((f = fopen(path, "w")) == NULL)
+        PRINT_ERR("EXE32_SAMPLE: cannot write \"%s\"\n", path);
+    free(path);
+    return f;
+}
+
+void sample_finish(void) {
+    FILE *f;
+
+    if (!sampling)
+        return;
+    set_timer(0);
+    sampling = 0;
+
+    load_syms();
+    if ((f = open_output("folded")) != NULL) {
+        write_folded(f);
+        fclose(f);
+    }
+    if ((f = open_output("hist")) != NULL) {
+        write_hist(f);
+        fclose(f);
+    }
+    free_syms();
+}
@@ -0,0 +1,11 @@
+#ifndef EXE32_SAMPLE_H
+#define EXE32_SAMPLE_H
+
+void sample_init(void);
+int sample_active(void);
+void sample_begin(const char *);
+void sample_enter(int, void *, void *);
+void sample_leave(void);
+void sample_finish(void);
+
+#endif // EXE32_SAMPLE_H
@@ -0,0 +1,566 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "common.h"
+#include "main.h"
+#include "load.h"
+#include "paths.h"
+#include "memmap.h"
+#include "server.h"
+
+/*  Resident zygote server (exe32-linux --server [progname ...])
+ *
+ *  The server forks one zygote per hot program. Each zygote loads and maps its
+ *  program once, then listens on <server dir>/<progname>.sock. A client (any
+ *  exe32-linux launch of that program) connects and sends its flags, umask, resource
+ *  limits, cwd, args and environment, with its stdin/stdout/stderr attached as
+ *  SCM_RIGHTS. The
+ *  zygote forks, and the child jumps straight to the already mapped program.
+ *  The child sends its pid first and its exit status last over the same
+ *  connection, the client forwards signals to it in the meantime.
+ *
+ *  The server dir is $EXE32_SERVER, or $XDG_RUNTIME_DIR/exe32-server. Without either
+ *  there is no server, and EXE32_SERVER=0 keeps clients from connecting at all. The
+ *  dir must be the user's own and closed to others (0700), and both ends check that
+ *  the other one runs as the same user, so nobody else gets the client's stdio and
+ *  environment or answers for the server.
+ *
+ *  A client sends the path it would load the program from, and a zygote only takes
+ *  requests for the file it has mapped: a client whose PATH or exe32-linux finds
+ *  another cc1.out loads that one itself.
+ */
+
+#define SERVER_MAGIC 0x45333253 /* "S23E" */
+#define SERVER_REQ_LOCK (1 << 0)
+
+#define SERVER_NUM_LIMITS 3
+
+// the limits of the client that change how the programs behave, or what they leave behind
+static const int server_limits[SERVER_NUM_LIMITS] = {RLIMIT_STACK, RLIMIT_NOFILE, RLIMIT_CORE};
+
+struct server_req_s {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t umask;
+    uint32_t len; /* payload: progpath\0cwd\0args\0env\0env\0...\0 */
+    uint64_t limits[SERVER_NUM_LIMITS][2]; /* soft and hard values of server_limits */
+};
+
+/* what SO_PEERCRED returns, <sys/socket.h> only declares struct ucred with _GNU_SOURCE */
+struct peer_cred_s {
+    pid_t pid;
+    uid_t uid;
+    gid_t gid;
+};
+
+static char *default_tools[] = {"cc1.out", "cpp.out", "as.out", "gcc.out", NULL};
+
+extern char **environ;
+
+static char *server_dir(void) {
+    char *dir, *env_dir = getenv("EXE32_SERVER");
+
+    if (env_dir != NULL)
+        return strcmp(env_dir, "0") && env_dir[0] != '\0' ? strdup(env_dir) : NULL;
+
+    // unlike $TMPDIR, the runtime dir is only the user's
+    if ((env_dir = getenv("XDG_RUNTIME_DIR")) == NULL || env_dir[0] != '/')
+        return NULL;
+    dir = malloc(strlen(env_dir) + sizeof("/exe32-server"));
+    sprintf(dir, "%s/exe32-server", env_dir);
+    return dir;
+}
+
+// the dir must be a real directory of the user, that nobody else can put sockets in
+static int check_dir(const char *dir) {
+    struct stat st;
+
+    if (lstat(dir, &st) || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 0777) != 0700) {
+        PRINT_DBG("> server: \"%s\" isn't a directory only the user can use\n", dir);
+        return 1;
+    }
+    return 0;
+}
+
+// whether the other end of the socket runs as the same user
+static int check_peer(int sock) {
+    struct peer_cred_s cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) || len != sizeof(cred) || cred.uid != getuid()) {
+        PRINT_DBG("> server: peer of socket %d is another user\n", sock);
+        return 1;
+    }
+    return 0;
+}
+
+static int socket_addr(struct sockaddr_un *addr, const char *dir, const char *progname) {
+    char *sockname = strdup(basename((char *) progname)), *c;
+
+    for (c = sockname; *c; c++) {
+        *c = tolower((unsigned char) *c);
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%s.sock", dir, sockname) >= (int) sizeof(addr->sun_path)) {
+        PRINT_DBG("> server: socket path for %s is too long\n", sockname);
+        free(sockname);
+        return 1;
+    }
+
+    free(sockname);
+    return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+    while (len > 0) {
+        ssize_t bread = read(fd, buf, len);
+
+        if (bread < 0 && errno == EINTR) continue;
+        if (bread <= 0) return 1;
+        buf = (char *) buf + bread;
+        len -= bread;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+    while (len > 0) {
+        ssize_t bwrite = write(fd, buf, len);
+
+        if (bwrite < 0 && errno == EINTR) continue;
+        if (bwrite <= 0) return 1;
+        buf = (const char *) buf + bwrite;
+        len -= bwrite;
+    }
+    return 0;
+}
+
+/* -- client -- */
+
+static volatile sig_atomic_t forwarded_sig = 0;
+static pid_t remote_pid;
+
+static void forward_signal(int sig) {
+    forwarded_sig = sig;
+    kill(remote_pid, sig);
+}
+
+static char *build_request(size_t *lenp, const char *prog_path, const char *args) {
+    char cwd[MAX_FILEPATH], *payload, *ptr;
+    size_t len;
+    int i;
+
+    if (!getcwd(cwd, sizeof(cwd)))
+        return NULL;
+
+    len = strlen(prog_path) + 1 + strlen(cwd) + 1 + strlen(args) + 1 + 1;
+    for (i = 0; environ[i] != NULL; i++) {
+        len += strlen(environ[i]) + 1;
+    }
+
+    ptr = payload = malloc(len);
+    ptr = stpcpy(ptr, prog_path) + 1;
+    ptr = stpcpy(ptr, cwd) + 1;
+    ptr = stpcpy(ptr, args) + 1;
+    for (i = 0; environ[i] != NULL; i++) {
+        ptr = stpcpy(ptr, environ[i]) + 1;
+    }
+    *ptr = '\0';
+
+    *lenp = len;
+    return payload;
+}
+
+static int send_request(int sock, struct server_req_s *req, const char *payload) {
+    int fds[3] = {0, 1, 2};
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {req, sizeof(*req)};
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(sock, &msg, 0) != sizeof(*req))
+        return 1;
+    return write_full(sock, payload, req->len);
+}
+
+int server_exec(const char *progname, const char *args) {
+    struct sockaddr_un addr;
+    struct server_req_s req;
+    struct sigaction sa;
+    char *dir, *payload, *found, *prog_path;
+    size_t len;
+    int sock, ret, i;
+    int32_t pid, status;
+    mode_t mask;
+
+    if ((dir = server_dir()) == NULL)
+        return -1;
+    ret = check_dir(dir) || socket_addr(&addr, dir, progname);
+    free(dir);
+    if (ret)
+        return -1;
+
+    if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+        return -1;
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) || check_peer(sock)) {
+        close(sock);
+        return -1;
+    }
+
+    // the server checks that it has the same file mapped
+    found = load_find_path((char *) progname, is_exe32);
+    prog_path = found != NULL ? realpath(found, NULL) : NULL;
+    free(found);
+    if (prog_path == NULL) {
+        close(sock);
+        return -1;
+    }
+    payload = build_request(&len, prog_path, args ? args : "");
+    free(prog_path);
+    if (payload == NULL) {
+        close(sock);
+        return -1;
+    }
+    memset(&req, 0, sizeof(req));
+    req.magic = SERVER_MAGIC;
+    req.flags = exe32_lock ? SERVER_REQ_LOCK : 0;
+    mask = umask(0);
+    umask(mask);
+    req.umask = mask;
+    req.len = len;
+    for (i = 0; i < SERVER_NUM_LIMITS; i++) {
+        struct rlimit rl;
+
+        if (getrlimit(server_limits[i], &rl))
+            rl.rlim_cur = rl.rlim_max = RLIM_INFINITY;
+        req.limits[i][0] = rl.rlim_cur;
+        req.limits[i][1] = rl.rlim_max;
+    }
+    ret = send_request(sock, &req, payload);
+    free(payload);
+
+    // nothing has run yet if the server didn't answer with a pid, so it can still be loaded here
+    if (ret || read_full(sock, &pid, sizeof(pid))) {
+        PRINT_DBG("> server_exec: no answer from %s\n", addr.sun_path);
+        close(sock);
+        return -1;
+    }
+    PRINT_DBG("> server_exec: %s runs as pid %d\n", progname, pid);
+
+    remote_pid = pid;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = forward_signal;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGQUIT, &sa, NULL);
+
+    if (read_full(sock, &status, sizeof(status)) == 0)
+        exit(status);
+
+    // the child was killed without reporting its status
+    if (forwarded_sig) {
+        signal(forwarded_sig, SIG_DFL);
+        raise(forwarded_sig);
+    }
+    PRINT_ERR("%s: server child PID %d aborted\n", progname, pid);
+    exit(255);
+}
+
+/* -- server -- */
+
+static volatile sig_atomic_t server_quit = 0;
+static int report_fd = -1;
+
+static void server_sigquit(int sig) {
+    server_quit = sig;
+}
+
+static void reap_children(UNUSED int sig) {
+    int saved_errno = errno;
+    while (waitpid(-1, NULL, WNOHANG) > 0) {
+        ;
+    }
+    errno = saved_errno;
+}
+
+static void report_exit_status(int status, UNUSED void *arg) {
+    int32_t st = status;
+    if (report_fd != -1)
+        write_full(report_fd, &st, sizeof(st));
+}
+
+// forked copies of a server child must not report their status as the child's
+void server_detach(void) {
+    if (report_fd != -1) {
+        close(report_fd);
+        report_fd = -1;
+    }
+}
+
+static int recv_request(int conn, struct server_req_s *req, int fds[3], char **payload) {
+    char cbuf[CMSG_SPACE(sizeof(int) * 3)];
+    struct iovec iov = {req, sizeof(*req)};
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    if (recvmsg(conn, &msg, 0) != sizeof(*req) || req->magic != SERVER_MAGIC)
+        return 1;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 3))
+        return 1;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * 3);
+
+    *payload = malloc(req->len);
+    if (req->len < 4 || read_full(conn, *payload, req->len) || (*payload)[req->len - 1] != '\0') {
+        close(fds[0]);
+        close(fds[1]);
+        close(fds[2]);
+        free(*payload);
+        return 1;
+    }
+    return 0;
+}
+
+// turns the forked zygote into the client's process
+static void setup_child(int conn, int fds[3], struct server_req_s *req, char *payload, char **args) {
+    char *cwd = payload + strlen(payload) + 1, *req_args = cwd + strlen(cwd) + 1, *env = req_args + strlen(req_args) + 1;
+    int32_t pid = getpid();
+    int i;
+
+    signal(SIGCHLD, SIG_DFL);
+    for (i = 0; i < 3; i++) {
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+
+    // files are created and limits hit like in a launch of the client's own
+    umask(req->umask & 0777);
+    for (i = 0; i < SERVER_NUM_LIMITS; i++) {
+        struct rlimit rl;
+
+        rl.rlim_cur = req->limits[i][0];
+        rl.rlim_max = req->limits[i][1];
+        if (setrlimit(server_limits[i], &rl)) {
+            struct rlimit own;
+
+            // a hard limit the server lowered can't be raised again, keep the server's
+            if (!getrlimit(server_limits[i], &own) && rl.rlim_max > own.rlim_max) {
+                rl.rlim_max = own.rlim_max;
+                if (rl.rlim_cur > rl.rlim_max)
+                    rl.rlim_cur = rl.rlim_max;
+            }
+            if (setrlimit(server_limits[i], &rl)) {
+                PRINT_DBG("> server: cannot set resource limit %d (%s)\n", server_limits[i], strerror(errno));
+            }
+        }
+    }
+
+    if (chdir(cwd)) {
+        PRINT_ERR("Cannot change directory to \"%s\": %s\n", cwd, strerror(errno));
+        exit(10);
+    }
+
+    {
+        int envc = 0;
+        char *envptr;
+
+        for (envptr = env; *envptr; envptr += strlen(envptr) + 1) {
+            envc++;
+        }
+        environ = calloc(envc + 1, sizeof(char *));
+        for (envptr = env, i = 0; *envptr; envptr += strlen(envptr) + 1) {
+            environ[i++] = envptr;
+        }
+    }
+
+    exe32_lock = req->flags & SERVER_REQ_LOCK ? 1 : 0;
+    *args = *req_args ? strdup(req_args) : NULL;
+
+    report_fd = conn;
+    on_exit(report_exit_status, NULL);
+    write_full(conn, &pid, sizeof(pid));
+}
+
+static init_first_t zygote_loop(char *progname, int lsock, char **args) {
+    init_first_t init_first = load_prog(progname);
+    struct sigaction sa;
+    struct stat st_prog, st;
+
+    stat(get_prog_path(), &st_prog);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = reap_children;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    while (1) {
+        struct server_req_s req;
+        char *payload;
+        int conn, fds[3];
+        pid_t pid;
+
+        if ((conn = accept(lsock, NULL, NULL)) == -1) {
+            if (errno == EINTR) continue;
+            PRINT_ERR("%s: accept failed (%s)\n", progname, strerror(errno));
+            exit(1);
+        }
+        fcntl(conn, F_SETFD, FD_CLOEXEC); // spawned programs must not keep the client waiting
+        if (check_peer(conn) || recv_request(conn, &req, fds, &payload)) {
+            PRINT_DBG("> server: bad request for %s\n", progname);
+            close(conn);
+            continue;
+        }
+
+        // reload the program if it was replaced since it got mapped
+        if (stat(get_prog_path(), &st) == 0 && (st.st_ino != st_prog.st_ino
+                    || st.st_mtime != st_prog.st_mtime || st.st_size != st_prog.st_size)) {
+            PRINT_DBG("> server: %s changed, reloading\n", progname);
+            mem_unmap_all();
+            load_cache_clear();
+            init_first = load_prog(progname);
+            st_prog = st;
+        }
+
+        // the client would have loaded another file, it loads that itself when it gets no pid
+        if (stat(payload, &st) || st.st_dev != st_prog.st_dev || st.st_ino != st_prog.st_ino) {
+            PRINT_DBG("> server: %s is not the mapped %s\n", payload, get_prog_path());
+            close(conn);
+            close(fds[0]);
+            close(fds[1]);
+            close(fds[2]);
+            free(payload);
+            continue;
+        }
+
+        if ((pid = fork()) == 0) {
+            close(lsock);
+            setup_child(conn, fds, &req, payload, args);
+            return init_first;
+        }
+        if (pid == -1)
+            PRINT_ERR("%s: fork failed (%s)\n", progname, strerror(errno));
+
+        close(conn);
+        close(fds[0]);
+        close(fds[1]);
+        close(fds[2]);
+        free(payload);
+    }
+}
+
+init_first_t server_main(char **tools, char **progname, char **args) {
+    char *dir = server_dir();
+    struct sigaction sa;
+    int ntools, i;
+    pid_t *pids;
+    char **names;
+
+    if (dir == NULL) {
+        PRINT_ERR("No server directory, set EXE32_SERVER=<dir> or XDG_RUNTIME_DIR\n");
+        exit(2);
+    }
+    if (mkdir(dir, 0700) && errno != EEXIST) {
+        PRINT_ERR("Cannot create server directory \"%s\": %s\n", dir, strerror(errno));
+        exit(2);
+    }
+    if (check_dir(dir)) {
+        PRINT_ERR("Server directory \"%s\" must be a directory of yours with mode 0700\n", dir);
+        exit(2);
+    }
+
+    if (*tools == NULL)
+        tools = default_tools;
+    for (ntools = 0; tools[ntools] != NULL; ntools++) {
+        ;
+    }
+    pids = calloc(ntools, sizeof(pid_t));
+    names = calloc(ntools, sizeof(char *));
+
+    is_exe32 = 0; // hot programs are looked up by their basename
+    for (i = 0; i < ntools; i++) {
+        struct sockaddr_un addr;
+        int lsock;
+
+        names[i] = fix_progname(basename(tools[i]));
+        if (socket_addr(&addr, dir, names[i])) {
+            PRINT_ERR("Socket path for \"%s\" is too long\n", names[i]);
+            continue;
+        }
+
+        unlink(addr.sun_path);
+        if ((lsock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1
+                || bind(lsock, (struct sockaddr *) &addr, sizeof(addr))
+                || listen(lsock, 64)) {
+            PRINT_ERR("Cannot listen on \"%s\": %s\n", addr.sun_path, strerror(errno));
+            if (lsock != -1) close(lsock);
+            continue;
+        }
+
+        if ((pids[i] = fork()) == 0) {
+            *progname = strdup(names[i]);
+            return zygote_loop(*progname, lsock, args);
+        }
+        PRINT_ERR(EXEPROGNAME": serving %s (pid %d)\n", addr.sun_path, pids[i]);
+        close(lsock);
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = server_sigquit;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+
+    while (!server_quit) {
+        if (waitpid(-1, NULL, 0) == -1 && errno == ECHILD)
+            break;
+    }
+
+    for (i = 0; i < ntools; i++) {
+        struct sockaddr_un addr;
+
+        if (pids[i] > 0)
+            kill(pids[i], SIGTERM);
+        if (names[i] != NULL && !socket_addr(&addr, dir, names[i]))
+            unlink(addr.sun_path);
+        free(names[i]);
+    }
+    rmdir(dir);
+    free(dir);
+    free(pids);
+    free(names);
+    exit(0);
+}
@@ -0,0 +1,10 @@
+#ifndef EXE32_SERVER_H
+#define EXE32_SERVER_H
+
+#include "wrappers.h"
+
+int server_exec(const char *, const char *);
+init_first_t server_main(char **, char **, char **);
+void server_detach(void);
+
+#endif // EXE32_SERVER_H
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "statcache.h"
+
+/*  File metadata caches
+ *
+ *  stat results of the paths programs ask about (file_attrs and list_file) are kept, and so
+ *  are the paths that don't exist, which is most of them when a program searches its PATH
+ *  or include directories. The wrappers forget a path when the program creates, opens for
+ *  writing, removes or renames it, and a file written through a handle is forgotten when
+ *  the handle is closed. Everything is forgotten when a spawned program returns and when
+ *  the program changes directories, since other programs change files behind our back.
+ *
+ *  The current directory is kept until chdir, and DOS dates and times are converted once
+ *  per minute of file time.
+ */
+
+#define STAT_BUCKETS 1024
+#define DOSTIME_SLOTS 64
+
+struct sc_entry {
+    struct sc_entry *next;
+    uint hash;
+    int err;            /* the errno of a failed stat, or 0 */
+    struct stat st;
+    char path[];
+};
+
+struct dostime_slot {
+    time_t minute;      /* file time / 60, + 1 so 0 is unused */
+    ushort date, time;
+};
+
+static struct sc_entry *entries[STAT_BUCKETS];
+static char *cwd = NULL;
+static struct dostime_slot dostimes[DOSTIME_SLOTS];
+
+static uint stat_lookups = 0, stat_hits = 0, stat_neg_hits = 0;
+static uint stat_cwd_calls = 0, stat_cwd_hits = 0;
+static uint stat_time_calls = 0, stat_time_hits = 0;
+
+static uint hash_path(const char *path) {
+    uint hash = 2166136261u;
+
+    while (*path)
+        hash = (hash ^ (unsigned char) *path++) * 16777619u;
+    return hash;
+}
+
+// stat with the cache, returns 0 or -1 with errno set like stat
+int statcache_stat(const char *path, struct stat *st) {
+    uint hash = hash_path(path);
+    struct sc_entry *entry;
+
+    stat_lookups++;
+    for (entry = entries[hash % STAT_BUCKETS]; entry != NULL; entry = entry->next) {
+        if (entry->hash != hash || strcmp(entry->path, path))
+            continue;
+        if (entry->err) {
+            stat_neg_hits++;
+            errno = entry->err;
+            return -1;
+        }
+        stat_hits++;
+        *st = entry->st;
+        return 0;
+    }
+
+    entry = malloc(sizeof(*entry) + strlen(path) + 1);
+    entry->hash = hash;
+    entry->err = stat(path, &entry->st) ? errno : 0;
+    strcpy(entry->path, path);
+    entry->next = entries[hash % STAT_BUCKETS];
+    entries[hash % STAT_BUCKETS] = entry;
+
+    if (entry->err) {
+        errno = entry->err;
+        return -1;
+    }
+    *st = entry->st;
+    return 0;
+}
+
+void statcache_forget(const char *path) {
+    uint hash = hash_path(path);
+    struct sc_entry **pentry = &entries[hash % STAT_BUCKETS];
+
+    for (; *pentry != NULL; pentry = &(*pentry)->next) {
+        if ((*pentry)->hash == hash && !strcmp((*pentry)->path, path)) {
+            struct sc_entry *entry = *pentry;
+
+            *pentry = entry->next;
+            free(entry);
+            return;
+        }
+    }
+}
+
+// forgets the file a handle was written through, by whatever paths it was looked up
+void statcache_forget_fd(int fd) {
+    struct stat st;
+    uint i;
+
+    if (fstat(fd, &st))
+        return;
+    for (i = 0; i < STAT_BUCKETS; i++) {
+        struct sc_entry **pentry = &entries[i];
+
+        while (*pentry != NULL) {
+            struct sc_entry *entry = *pentry;
+
+            if (!entry->err && entry->st.st_ino == st.st_ino && entry->st.st_dev == st.st_dev) {
+                *pentry = entry->next;
+                free(entry);
+            }
+            else pentry = &entry->next;
+        }
+    }
+}
+
+void statcache_flush(void) {
+    uint i;
+
+    for (i = 0; i < STAT_BUCKETS; i++) {
+        while (entries[i] != NULL) {
+            struct sc_entry *entry = entries[i];
+
+            entries[i] = entry->next;
+            free(entry);
+        }
+    }
+}
+
+// the current directory, or NULL
+const char *statcache_getcwd(void) {
+    stat_cwd_calls++;
+    if (cwd != NULL)
+        stat_cwd_hits++;
+    else
+        cwd = getcwd(NULL, 0);
+    return cwd;
+}
+
+// the program changed directories
+void statcache_chdir(void) {
+    free(cwd);
+    cwd = NULL;
+    statcache_flush();
+}
+
+// converts a file time to the local DOS date and time
+void statcache_dostime(time_t t, ushort *dos_date, ushort *dos_time) {
+    // every time zone is a whole number of minutes from UTC, so the seconds don't matter
+    time_t minute = t / 60 + 1;
+    struct dostime_slot *slot = &dostimes[(ulong) minute % DOSTIME_SLOTS];
+    struct tm *tm;
+
+    stat_time_calls++;
+    if (slot->minute != minute) {
+        time_t start = (minute - 1) * 60;
+
+        tm = localtime(&start);
+        slot->minute = minute;
+        slot->time = (tm->tm_min << 5) | (tm->tm_hour << 11);
+        slot->date = tm->tm_mday | ((tm->tm_mon + 1) << 5) | ((tm->tm_year - 80) << 9);
+    }
+    else stat_time_hits++;
+
+    *dos_date = slot->date;
+    *dos_time = slot->time | ((t % 60) / 2);
+}
+
+void statcache_print_stats(void) {
+    PRINT_ERR("  statcache: %u stats, %u found cached, %u missing cached; cwd %u/%u cached; dos times %u/%u cached\n",
+        stat_lookups, stat_hits, stat_neg_hits, stat_cwd_hits, stat_cwd_calls, stat_time_hits, stat_time_calls);
+}
@@ -0,0 +1,17 @@
+#ifndef EXE32_STATCACHE_H
+#define EXE32_STATCACHE_H
+
+#include <time.h>
+#include <sys/stat.h>
+#include "common.h"
+
+int statcache_stat(const char *, struct stat *);
+void statcache_forget(const char *);
+void statcache_forget_fd(int);
+void statcache_flush(void);
+const char *statcache_getcwd(void);
+void statcache_chdir(void);
+void statcache_dostime(time_t, ushort *, ushort *);
+void statcache_print_stats(void);
+
+#endif // EXE32_STATCACHE_H
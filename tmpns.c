@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "tmpns.h"
+
+/*  Private temp directories (EXE32_TMPNS=1)
+ *
+ *  Files directly in the temp directory ($TMPDIR, $TMP, $TEMP or /tmp, the same ones the
+ *  programs use) are moved into <temp dir>/exe32-XXXXXX/, made by the first loader with
+ *  mkdtemp and passed to the programs it spawns in EXE32_TMPNS_DIR. Each --jobs worker makes
+ *  its own. Two process trees that use the same temp
+ *  file names then don't see each other's files. Files are only created there: a file that
+ *  isn't in the private directory is looked for in the temp directory itself. The first
+ *  loader removes the directory when it exits.
+ *
+ *  Subdirectories of the temp directory and relative paths are left alone, and nothing is
+ *  moved when the temp directory is the directory the loader runs in.
+ */
+
+static char *tmp_dir = NULL, *ns_dir = NULL;
+static size_t tmp_dir_len;
+static pid_t owner_pid = 0;
+static int cleanup_set = 0;
+
+static void tmpns_cleanup(void) {
+    char path[PATH_MAX];
+    struct dirent *dent;
+    DIR *dir;
+
+    if (owner_pid != getpid() || ns_dir == NULL || (dir = opendir(ns_dir)) == NULL)
+        return;
+
+    while ((dent = readdir(dir)) != NULL) {
+        if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", ns_dir, dent->d_name);
+        remove(path);
+    }
+    closedir(dir);
+
+    if (rmdir(ns_dir)) {
+        PRINT_DBG("> tmpns: cannot remove %s (%s)\n", ns_dir, strerror(errno));
+    }
+}
+
+void tmpns_init(void) {
+    char *env_tmpns = getenv("EXE32_TMPNS"), *env_dir = getenv("EXE32_TMPNS_DIR"), *dir;
+    char *cwd, *real_tmp_dir;
+
+    free(tmp_dir);
+    tmp_dir = NULL;
+    if (owner_pid != getpid()) {
+        free(ns_dir);
+        ns_dir = NULL;
+    }
+
+    if (env_tmpns == NULL || strcmp(env_tmpns, "1"))
+        return;
+
+    if ((dir = getenv("TMPDIR")) == NULL && (dir = getenv("TMP")) == NULL && (dir = getenv("TEMP")) == NULL)
+        dir = "/tmp";
+    tmp_dir = strdup(dir);
+    tmp_dir_len = strlen(tmp_dir);
+    while (tmp_dir_len > 1 && tmp_dir[tmp_dir_len - 1] == '/')
+        tmp_dir[--tmp_dir_len] = '\0';
+
+    cwd = getcwd(NULL, 0);
+    real_tmp_dir = realpath(tmp_dir, NULL);
+    if (tmp_dir[0] != '/' || cwd == NULL || real_tmp_dir == NULL || !strcmp(cwd, real_tmp_dir)) {
+        PRINT_DBG("> tmpns: temp directory %s is relative, missing or the current one, disabled\n", tmp_dir);
+        free(tmp_dir);
+        tmp_dir = NULL;
+    }
+    free(cwd);
+    free(real_tmp_dir);
+    if (tmp_dir == NULL)
+        return;
+
+    if (env_dir != NULL) {
+        // spawned by a loader that already made one
+        if (ns_dir == NULL)
+            ns_dir = strdup(env_dir);
+        return;
+    }
+
+    // a name nobody else could have made before us
+    ns_dir = malloc(tmp_dir_len + sizeof("/exe32-XXXXXX"));
+    sprintf(ns_dir, "%s/exe32-XXXXXX", tmp_dir);
+    if (mkdtemp(ns_dir) == NULL) {
+        PRINT_ERR("EXE32_TMPNS: cannot create %s: %s\n", ns_dir, strerror(errno));
+        free(ns_dir);
+        ns_dir = NULL;
+        free(tmp_dir);
+        tmp_dir = NULL;
+        return;
+    }
+
+    owner_pid = getpid();
+    setenv("EXE32_TMPNS_DIR", ns_dir, 1);
+    if (!cleanup_set) {
+        atexit(tmpns_cleanup);
+        cleanup_set = 1;
+    }
+    PRINT_DBG("> tmpns: temp files of %s go to %s\n", tmp_dir, ns_dir);
+}
+
+/*  the private path of a file directly in the temp directory, or NULL for other files.
+ *  unless it's about to be created, the file has to be there already.
+ */
+static char *tmpns_path(const char *path, int create) {
+    char *name, *ns_path;
+    struct stat st;
+
+    // the programs make their temp names from the absolute temp directory
+    if (tmp_dir == NULL || ns_dir == NULL || strncmp(path, tmp_dir, tmp_dir_len) || path[tmp_dir_len] != '/')
+        return NULL;
+    name = (char *) path + tmp_dir_len + 1;
+    if (name[0] == '\0' || strchr(name, '/') != NULL)
+        return NULL;
+
+    ns_path = malloc(strlen(ns_dir) + strlen(name) + 2);
+    sprintf(ns_path, "%s/%s", ns_dir, name);
+    if (!create && stat(ns_path, &st)) {
+        free(ns_path);
+        return NULL;
+    }
+
+    PRINT_DBG("> tmpns: %s -> %s\n", path, ns_path);
+    return ns_path;
+}
+
+void tmpns_fix(char **path_fixed, char **path_fixed_dup, int create) {
+    char *ns_path = tmpns_path(*path_fixed, create);
+
+    if (ns_path != NULL) {
+        free(*path_fixed_dup);
+        *path_fixed = *path_fixed_dup = ns_path;
+    }
+}
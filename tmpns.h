@@ -0,0 +1,7 @@
+#ifndef EXE32_TMPNS_H
+#define EXE32_TMPNS_H
+
+void tmpns_init(void);
+void tmpns_fix(char **, char **, int);
+
+#endif // EXE32_TMPNS_H
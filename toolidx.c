@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "main.h"
+#include "paths.h"
+#include "toolidx.h"
+
+/*  Persistent tool-resolution index
+ *
+ *  Remembers where a program name (case-insensitively) was found by the
+ *  exe32 dir/base path/PATH search, so later launches open it directly.
+ *  The index file is named after a hash of PATH and exe32's directory and
+ *  looks like this:
+ *
+ *    exe32-toolidx 1
+ *    P <PATH>
+ *    B <exe32_dirpath>
+ *    D <mtime sec> <mtime nsec> <searched dir>    (one per searched dir)
+ *    T <probes> <lowercased name> <absolute path> (one per resolved tool)
+ *
+ *  It is valid as long as PATH and the mtime of every searched directory are
+ *  unchanged; otherwise it is rebuilt from scratch on the next resolution.
+ *  EXE32_TOOLINDEX=<file> overrides its location, EXE32_TOOLINDEX=0 disables it.
+ */
+
+#define TOOLIDX_HEADER "exe32-toolidx 1"
+
+static int toolidx_state = 0; // 0 = not loaded, 1 = valid, -1 = disabled
+static char *toolidx_path;
+static char *toolidx_key;     // the P, B and D lines of a valid index
+static char *toolidx_entries; // the T lines
+
+static int stat_hit = 0, stat_probes_saved = 0, stat_probes = 0, stat_rebuilt = 0;
+
+static char *str_append(char *str, const char *app) {
+    size_t len = str ? strlen(str) : 0;
+
+    str = realloc(str, len + strlen(app) + 1);
+    strcpy(str + len, app);
+    return str;
+}
+
+static char *append_dir_line(char *key, const char *dir, size_t dir_len) {
+    char line[64], *dirz = malloc(dir_len + 1);
+    struct stat st;
+
+    memcpy(dirz, dir, dir_len);
+    dirz[dir_len] = '\0';
+    if (stat(dirz, &st))
+        strcpy(line, "D - - ");
+    else
+        snprintf(line, sizeof(line), "D %ld %ld ", (long) st.st_mtim.tv_sec, (long) st.st_mtim.tv_nsec);
+
+    key = str_append(key, line);
+    key = str_append(key, dirz);
+    key = str_append(key, "\n");
+    free(dirz);
+    return key;
+}
+
+// the key contains the same directories load_program_basename searches, in the same order
+static char *build_key(void) {
+    char *key = NULL, *env_path = getenv("PATH");
+
+    key = str_append(key, "P ");
+    key = str_append(key, env_path ? env_path : "");
+    key = str_append(key, "\nB ");
+    key = str_append(key, exe32_dirpath);
+    key = str_append(key, "\n");
+
+    key = append_dir_line(key, exe32_dirpath, strlen(exe32_dirpath));
+#ifdef DEFAULT_BASE_PATH
+    {
+        char *base_path = malloc(strlen(exe32_dirpath) + sizeof(DEFAULT_BASE_PATH));
+        strcpy(base_path, exe32_dirpath);
+        strcat(base_path, DEFAULT_BASE_PATH);
+        key = append_dir_line(key, base_path, strlen(base_path));
+        free(base_path);
+    }
+#endif
+    while (env_path) {
+        char *colon_delim = strchr(env_path, ':');
+        size_t path_len = colon_delim ? (size_t) (colon_delim - env_path) : strlen(env_path);
+
+        key = append_dir_line(key, env_path, path_len);
+        env_path = colon_delim ? colon_delim + 1 : NULL;
+    }
+
+    return key;
+}
+
+static char *default_index_path(void) {
+    char *dir, *path, name[32];
+    char *env_path = getenv("PATH");
+
+    if ((dir = get_cache_dir()) == NULL)
+        return NULL;
+
+    snprintf(name, sizeof(name), "/toolindex-%08x",
+            fnv1a_str(fnv1a_str(FNV1A_INIT, env_path ? env_path : ""), exe32_dirpath));
+    path = malloc(strlen(dir) + strlen(name) + 1);
+    strcpy(path, dir);
+    strcat(path, name);
+    free(dir);
+    return path;
+}
+
+static void toolidx_load(void) {
+    char *env_idx = getenv("EXE32_TOOLINDEX"), *contents = NULL, *key_end;
+    FILE *f;
+    long size;
+
+    toolidx_state = -1;
+    if (env_idx != NULL && (env_idx[0] == '\0' || !strcmp(env_idx, "0")))
+        return;
+    if ((toolidx_path = env_idx ? strdup(env_idx) : default_index_path()) == NULL)
+        return;
+
+    toolidx_state = 1;
+    toolidx_key = build_key();
+
+    if ((f = fopen(toolidx_path, "rb")) == NULL)
+        return;
+    if (!fseek(f, 0, SEEK_END) && (size = ftell(f)) > 0) {
+        contents = malloc(size + 1);
+        rewind(f);
+        contents[fread(contents, 1, size, f)] = '\0';
+    }
+    fclose(f);
+
+    if (contents == NULL)
+        return;
+
+    // the file has to start with the header and the same key we just built
+    key_end = contents + sizeof(TOOLIDX_HEADER "\n") - 1;
+    if (strncmp(contents, TOOLIDX_HEADER "\n", key_end - contents) == 0
+            && strncmp(key_end, toolidx_key, strlen(toolidx_key)) == 0) {
+        toolidx_entries = strdup(key_end + strlen(toolidx_key));
+    }
+    else {
+        PRINT_DBG("> toolidx: \"%s\" is stale, rebuilding\n", toolidx_path);
+        stat_rebuilt = 1;
+    }
+    free(contents);
+}
+
+char *toolidx_find(const char *name) {
+    char *line;
+    size_t name_len = strlen(name);
+
+    if (toolidx_state == 0)
+        toolidx_load();
+    if (toolidx_state != 1 || toolidx_entries == NULL)
+        return NULL;
+
+    for (line = toolidx_entries; line && *line; line = strchr(line, '\n'), line = line ? line + 1 : NULL) {
+        int probes, name_pos = 0;
+        char *path_end;
+
+        if (sscanf(line, "T %d %n", &probes, &name_pos) != 1 || name_pos == 0)
+            continue;
+        if (strncasecmp(line + name_pos, name, name_len) || line[name_pos + name_len] != ' ')
+            continue;
+
+        line += name_pos + name_len + 1;
+        path_end = strchr(line, '\n');
+        stat_hit = 1;
+        stat_probes_saved = probes - 1;
+        return path_end ? strndup(line, path_end - line) : strdup(line);
+    }
+
+    return NULL;
+}
+
+void toolidx_add(const char *name, const char *path, int probes) {
+    char line[32], *lname, *tmppath;
+    FILE *f;
+
+    stat_probes = probes;
+    if (toolidx_state == 0)
+        toolidx_load();
+    if (toolidx_state != 1 || path[0] != '/' || strchr(path, '\n'))
+        return;
+
+    lname = strdup(name);
+    for (tmppath = lname; *tmppath; tmppath++) {
+        *tmppath = tolower((unsigned char) *tmppath);
+    }
+
+    snprintf(line, sizeof(line), "T %d ", probes);
+    toolidx_entries = str_append(toolidx_entries, line);
+    toolidx_entries = str_append(toolidx_entries, lname);
+    toolidx_entries = str_append(toolidx_entries, " ");
+    toolidx_entries = str_append(toolidx_entries, path);
+    toolidx_entries = str_append(toolidx_entries, "\n");
+    free(lname);
+
+    // write a new index and move it over the old one, so readers never see a partial file
+    tmppath = malloc(strlen(toolidx_path) + 16);
+    sprintf(tmppath, "%s.%d", toolidx_path, getpid());
+    if ((f = fopen(tmppath, "wb")) != NULL) {
+        fputs(TOOLIDX_HEADER "\n", f);
+        fputs(toolidx_key, f);
+        fputs(toolidx_entries, f);
+        if (ferror(f) | fclose(f) || rename(tmppath, toolidx_path)) {
+            PRINT_DBG("> toolidx: cannot write \"%s\" (%s)\n", toolidx_path, strerror(errno));
+            remove(tmppath);
+        }
+    }
+    free(tmppath);
+}
+
+void toolidx_print_stats(void) {
+    if (toolidx_state != 1)
+        PRINT_ERR("  toolidx: disabled\n");
+    else if (stat_hit)
+        PRINT_ERR("  toolidx: hit, %d open probes saved\n", stat_probes_saved);
+    else
+        PRINT_ERR("  toolidx: miss%s, %d open probes\n", stat_rebuilt ? " (rebuilt)" : "", stat_probes);
+}
@@ -0,0 +1,8 @@
+#ifndef EXE32_TOOLIDX_H
+#define EXE32_TOOLIDX_H
+
+char *toolidx_find(const char *name);
+void toolidx_add(const char *name, const char *path, int probes);
+void toolidx_print_stats(void);
+
+#endif // EXE32_TOOLIDX_H
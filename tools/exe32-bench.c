@@ -0,0 +1,482 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include "common.h"
+
+/*  exe32-bench - runs the KMC tools through exe32-linux over a corpus and compares the
+ *  results with a baseline.
+ *
+ *  Usage: exe32-bench [-w] [-n runs] [-t percent] <exe32-linux> <bin dir> <steps> <baseline>
+ *    steps lists the programs to run (see bench/bench.txt), in a copy of the corpus
+ *    directory next to it. Each step is run once cold, after the loader and the programs
+ *    in bin dir were dropped from the page cache, then runs times warm, then once more
+ *    under ptrace to count the system calls of all the processes it starts.
+ *    -w writes the results to baseline instead of comparing them with it.
+ *    -t is the regression threshold, 5% by default. A step regresses when its warm time is
+ *       more than that slower than the baseline and a Mann-Whitney U test says the
+ *       difference is significant (p < 0.05), or when its peak RSS or system calls are
+ *       more than that higher. exe32-bench then exits with 1.
+ */
+
+#define MAX_STEPS 64
+#define MAX_ARGS  64
+#define MAX_RUNS  100
+#define P_SIGNIFICANT 0.05
+
+struct step {
+    char *name;
+    char *args[MAX_ARGS + 2];      /* exe32-linux, the program and its arguments */
+    uint64_t input_bytes;
+    uint64_t cold_ns;
+    uint64_t warm_ns[MAX_RUNS];
+    long rss_kb;                   /* the largest of the runs */
+    long syscalls;                 /* or -1 if they couldn't be counted */
+};
+
+static const char *progname = "exe32-bench";
+
+static struct step steps[MAX_STEPS];
+static int num_steps = 0;
+static int runs = 10;
+static double threshold = 5.0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int read_steps(const char *path, const char *exe32) {
+    char line[1024];
+    FILE *f = fopen(path, "r");
+    int lineno = 0;
+
+    if (f == NULL) {
+        PRINT_ERR("%s: cannot open \"%s\": ", progname, path);
+        perror(NULL);
+        return 1;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        struct step *step = &steps[num_steps];
+        char *tok;
+        int n = 0;
+
+        lineno++;
+        if ((tok = strtok(line, " \t\r\n")) == NULL || tok[0] == '#')
+            continue;
+        if (num_steps == MAX_STEPS) {
+            PRINT_ERR("%s: %s:%d: more than %d steps\n", progname, path, lineno, MAX_STEPS);
+            fclose(f);
+            return 1;
+        }
+        step->name = strdup(tok);
+        step->args[n++] = (char *) exe32;
+        while ((tok = strtok(NULL, " \t\r\n")) != NULL && n <= MAX_ARGS)
+            step->args[n++] = strdup(tok);
+        if (n < 2) {
+            PRINT_ERR("%s: %s:%d: step \"%s\" has no program\n", progname, path, lineno, step->name);
+            fclose(f);
+            return 1;
+        }
+        step->args[n] = NULL;
+        num_steps++;
+    }
+
+    fclose(f);
+    return 0;
+}
+
+// copies the files of the corpus into the directory the steps run in
+static int copy_corpus(const char *from, const char *to) {
+    struct dirent *dent;
+    DIR *dir = opendir(from);
+    char buf[65536];
+
+    if (dir == NULL) {
+        PRINT_ERR("%s: cannot open \"%s\": ", progname, from);
+        perror(NULL);
+        return 1;
+    }
+
+    while ((dent = readdir(dir)) != NULL) {
+        char *src, *dst;
+        int in, out;
+        ssize_t len;
+
+        if (dent->d_name[0] == '.')
+            continue;
+        src = malloc(strlen(from) + strlen(dent->d_name) + 2);
+        dst = malloc(strlen(to) + strlen(dent->d_name) + 2);
+        sprintf(src, "%s/%s", from, dent->d_name);
+        sprintf(dst, "%s/%s", to, dent->d_name);
+        in = open(src, O_RDONLY);
+        out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        while (in != -1 && out != -1 && (len = read(in, buf, sizeof(buf))) > 0) {
+            if (write(out, buf, len) != len)
+                break;
+        }
+        if (in != -1)
+            close(in);
+        if (out != -1)
+            close(out);
+        free(src);
+        free(dst);
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+static void drop_cache(const char *path) {
+    int fd = open(path, O_RDONLY);
+
+    if (fd != -1) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+// what can be dropped without root: the pages nothing has mapped
+static void drop_programs(const char *exe32, const char *bin_dir) {
+    struct dirent *dent;
+    DIR *dir;
+
+    drop_cache(exe32);
+    if ((dir = opendir(bin_dir)) == NULL)
+        return;
+    while ((dent = readdir(dir)) != NULL) {
+        char *path = malloc(strlen(bin_dir) + strlen(dent->d_name) + 2);
+
+        sprintf(path, "%s/%s", bin_dir, dent->d_name);
+        drop_cache(path);
+        free(path);
+    }
+    closedir(dir);
+}
+
+static void exec_step(struct step *step) {
+    int fd = open("/dev/null", O_RDWR);
+
+    dup2(fd, 0);
+    dup2(fd, 1);
+    dup2(fd, 2);
+    execv(step->args[0], step->args);
+    _exit(127);
+}
+
+/*  runs the step once, returns its time in ns or 0 if it failed. the peak RSS is the one
+ *  of the process or of the largest one it waited for.
+ */
+static uint64_t run_step(struct step *step) {
+    struct rusage ru;
+    uint64_t begin = now_ns();
+    pid_t pid;
+    int status;
+
+    if ((pid = fork()) == 0)
+        exec_step(step);
+    if (pid == -1 || wait4(pid, &status, 0, &ru) != pid || !WIFEXITED(status) || WEXITSTATUS(status)) {
+        PRINT_ERR("%s: step \"%s\" failed\n", progname, step->name);
+        return 0;
+    }
+    if (ru.ru_maxrss > step->rss_kb)
+        step->rss_kb = ru.ru_maxrss;
+    return now_ns() - begin;
+}
+
+/*  runs the step under ptrace and counts the system calls of it and of everything it
+ *  forks and clones. each call stops twice, going in and coming back.
+ */
+static long count_syscalls(struct step *step) {
+    long stops = 0;
+    pid_t pid, child;
+    int status;
+
+    if ((child = fork()) == 0) {
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL))
+            _exit(126);
+        raise(SIGSTOP);
+        exec_step(step);
+    }
+    // without ptrace, like in some containers, the child exits at once
+    if (child == -1 || waitpid(child, &status, 0) != child || !WIFSTOPPED(status))
+        return -1;
+    ptrace(PTRACE_SETOPTIONS, child, NULL, (void *) (PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEFORK
+        | PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL));
+    ptrace(PTRACE_SYSCALL, child, NULL, NULL);
+
+    while ((pid = waitpid(-1, &status, __WALL)) != -1) {
+        int sig = 0;
+
+        if (!WIFSTOPPED(status))
+            continue;
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80))
+            stops++;
+        // the events, and the stop a new process starts with, aren't the program's signals
+        else if (status >> 16 == 0 && WSTOPSIG(status) != SIGSTOP)
+            sig = WSTOPSIG(status);
+        ptrace(PTRACE_SYSCALL, pid, NULL, (void *) (intptr_t) sig);
+    }
+    return stops / 2;
+}
+
+static uint64_t file_size(const char *path) {
+    struct stat st;
+
+    return !stat(path, &st) && S_ISREG(st.st_mode) ? (uint64_t) st.st_size : 0;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double median(const uint64_t *samples, int n) {
+    uint64_t sorted[MAX_RUNS];
+
+    memcpy(sorted, samples, n * sizeof(*samples));
+    qsort(sorted, n, sizeof(*sorted), compare_u64);
+    return n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2.0;
+}
+
+/*  one-sided Mann-Whitney U test, with the normal approximation: the probability that the
+ *  samples of cur would be as much larger than those of base if they were the same.
+ */
+static double mann_whitney_p(const uint64_t *cur, int n1, const uint64_t *base, int n2) {
+    double u = 0, mean = n1 * n2 / 2.0, sd = sqrt(n1 * n2 * (n1 + n2 + 1) / 12.0);
+    int i, j;
+
+    for (i = 0; i < n1; i++) {
+        for (j = 0; j < n2; j++)
+            u += cur[i] > base[j] ? 1 : cur[i] == base[j] ? 0.5 : 0;
+    }
+    return 0.5 * erfc((u - mean - 0.5) / sd / sqrt(2));
+}
+
+// the steps only make files, next to the ones of the corpus
+static void remove_workdir(const char *path) {
+    struct dirent *dent;
+    DIR *dir = opendir(path);
+
+    while (dir != NULL && (dent = readdir(dir)) != NULL) {
+        char *file = malloc(strlen(path) + strlen(dent->d_name) + 2);
+
+        sprintf(file, "%s/%s", path, dent->d_name);
+        unlink(file);
+        free(file);
+    }
+    if (dir != NULL)
+        closedir(dir);
+    if (rmdir(path))
+        PRINT_ERR("%s: cannot remove \"%s\"\n", progname, path);
+}
+
+static int run_steps(const char *exe32, const char *bin_dir) {
+    int i, r;
+
+    for (i = 0; i < num_steps; i++) {
+        struct step *step = &steps[i];
+
+        for (r = 2; step->args[r] != NULL; r++)
+            step->input_bytes += file_size(step->args[r]);
+
+        drop_programs(exe32, bin_dir);
+        if ((step->cold_ns = run_step(step)) == 0)
+            return 1;
+        for (r = 0; r < runs; r++) {
+            if ((step->warm_ns[r] = run_step(step)) == 0)
+                return 1;
+        }
+        step->syscalls = count_syscalls(step);
+        PRINT_ERR("%s: %s done\n", progname, step->name);
+    }
+    return 0;
+}
+
+static void print_results(void) {
+    int i;
+
+    printf("%-10s %10s %10s %10s %10s %10s\n", "step", "cold ms", "warm ms", "MB/s", "peak RSS K", "syscalls");
+    for (i = 0; i < num_steps; i++) {
+        struct step *step = &steps[i];
+        double warm = median(step->warm_ns, runs);
+
+        printf("%-10s %10.2f %10.2f %10.2f %10ld %10ld\n", step->name, step->cold_ns / 1e6, warm / 1e6,
+            step->input_bytes / (warm / 1e9) / (1024 * 1024), step->rss_kb, step->syscalls);
+    }
+}
+
+static int write_baseline(const char *path) {
+    FILE *f = fopen(path, "w");
+    int i, r;
+
+    if (f == NULL) {
+        PRINT_ERR("%s: cannot write \"%s\": ", progname, path);
+        perror(NULL);
+        return 1;
+    }
+    fprintf(f, "# <step> <cold ns> <peak RSS K> <syscalls> <runs> <warm ns ...>, written by exe32-bench -w\n");
+    for (i = 0; i < num_steps; i++) {
+        struct step *step = &steps[i];
+
+        fprintf(f, "%s %llu %ld %ld %d", step->name, (unsigned long long) step->cold_ns, step->rss_kb, step->syscalls, runs);
+        for (r = 0; r < runs; r++)
+            fprintf(f, " %llu", (unsigned long long) step->warm_ns[r]);
+        fputc('\n', f);
+    }
+    fclose(f);
+    printf("baseline written to %s\n", path);
+    return 0;
+}
+
+static int over(double cur, double base) {
+    return base > 0 && cur > base * (1 + threshold / 100);
+}
+
+static double change(double cur, double base) {
+    return base > 0 ? (cur / base - 1) * 100 : 0;
+}
+
+// returns 1 if a step regressed
+static int compare_baseline(const char *path) {
+    char line[16384];
+    FILE *f = fopen(path, "r");
+    int regressed = 0, i;
+
+    if (f == NULL) {
+        printf("no baseline in %s, make bench-baseline writes one\n", path);
+        return 0;
+    }
+
+    printf("\ncompared with %s (threshold %.1f%%):\n", path, threshold);
+    while (fgets(line, sizeof(line), f) != NULL) {
+        uint64_t base_warm[MAX_RUNS];
+        unsigned long long cold, sample;
+        long rss, syscalls;
+        char name[64], *p = line;
+        int n, nruns, len;
+        struct step *step = NULL;
+        double cur, base, pval;
+
+        if (line[0] == '#' || sscanf(p, "%63s %llu %ld %ld %d%n", name, &cold, &rss, &syscalls, &nruns, &len) != 5)
+            continue;
+        for (i = 0; i < num_steps; i++) {
+            if (!strcmp(steps[i].name, name))
+                step = &steps[i];
+        }
+        if (step == NULL || nruns < 1 || nruns > MAX_RUNS)
+            continue;
+        for (n = 0, p += len; n < nruns && sscanf(p, "%llu%n", &sample, &len) == 1; n++, p += len)
+            base_warm[n] = sample;
+        if (n != nruns)
+            continue;
+
+        cur = median(step->warm_ns, runs);
+        base = median(base_warm, nruns);
+        pval = mann_whitney_p(step->warm_ns, runs, base_warm, nruns);
+        printf("%-10s warm %+6.1f%% (p %.3f), cold %+6.1f%%, peak RSS %+6.1f%%, syscalls %+6.1f%%", name,
+            change(cur, base), pval, change(step->cold_ns, cold), change(step->rss_kb, rss),
+            step->syscalls >= 0 && syscalls >= 0 ? change(step->syscalls, syscalls) : 0);
+
+        // cold runs are single samples and too noisy to fail on
+        if ((over(cur, base) && pval < P_SIGNIFICANT) || over(step->rss_kb, rss)
+                || (step->syscalls >= 0 && over(step->syscalls, syscalls))) {
+            printf("  REGRESSED");
+            regressed = 1;
+        }
+        putchar('\n');
+    }
+
+    fclose(f);
+    return regressed;
+}
+
+int main(int argc, char *argv[]) {
+    char *exe32, *bin_dir, *corpus, *workdir, *slash, tmpl[] = "/tmp/exe32-bench-XXXXXX";
+    const char *tmpdir = getenv("TMPDIR");
+    int write_mode = 0, start_dir, opt, ret;
+
+    while ((opt = getopt(argc, argv, "wn:t:")) != -1) {
+        switch (opt) {
+            case 'w': write_mode = 1; break;
+            case 'n': runs = atoi(optarg); break;
+            case 't': threshold = atof(optarg); break;
+            default: argc = 0; break;
+        }
+    }
+    if (argc - optind != 4 || runs < 1 || runs > MAX_RUNS) {
+        PRINT_ERR("Usage: %s [-w] [-n runs] [-t percent] <exe32-linux> <bin dir> <steps> <baseline>\n", progname);
+        return 2;
+    }
+
+    // the steps run somewhere else, with the paths they're given made absolute
+    if ((exe32 = realpath(argv[optind], NULL)) == NULL || (bin_dir = realpath(argv[optind + 1], NULL)) == NULL) {
+        PRINT_ERR("%s: cannot find \"%s\" or \"%s\"\n", progname, argv[optind], argv[optind + 1]);
+        return 1;
+    }
+    if (read_steps(argv[optind + 2], exe32))
+        return 1;
+    corpus = malloc(strlen(argv[optind + 2]) + sizeof("/corpus"));
+    strcpy(corpus, argv[optind + 2]);
+    if ((slash = strrchr(corpus, '/')) != NULL)
+        strcpy(slash, "/corpus");
+    else
+        strcpy(corpus, "corpus");
+
+    if (tmpdir != NULL && tmpdir[0] != '\0') {
+        workdir = malloc(strlen(tmpdir) + sizeof(tmpl));
+        sprintf(workdir, "%s/%s", tmpdir, tmpl + sizeof("/tmp/") - 1);
+    }
+    else
+        workdir = strdup(tmpl);
+    if (mkdtemp(workdir) == NULL) {
+        PRINT_ERR("%s: cannot create \"%s\"\n", progname, workdir);
+        return 1;
+    }
+    if (copy_corpus(corpus, workdir)) {
+        PRINT_ERR("%s: cannot set up \"%s\"\n", progname, workdir);
+        remove_workdir(workdir);
+        return 1;
+    }
+
+    // the loader's own caches and logs would be measured instead of the programs
+    unsetenv("EXE32_CACHE");
+    unsetenv("EXE32_PROFILE");
+    unsetenv("EXE32_TRACE");
+    unsetenv("EXE32_STATS");
+    unsetenv("EXE32_DEPFILE");
+
+    start_dir = open(".", O_RDONLY | O_DIRECTORY);
+    if (chdir(workdir) || run_steps(exe32, bin_dir)) {
+        PRINT_ERR("%s: the run in \"%s\" failed\n", progname, workdir);
+        ret = 1;
+    }
+    else {
+        print_results();
+        ret = 0;
+    }
+
+    // the baseline path is relative to where exe32-bench was started
+    if (start_dir == -1 || fchdir(start_dir)) {
+        PRINT_ERR("%s: cannot go back to the starting directory\n", progname);
+        ret = 1;
+    }
+    else if (ret == 0)
+        ret = write_mode ? write_baseline(argv[optind + 3]) : compare_baseline(argv[optind + 3]);
+    remove_workdir(workdir);
+    return ret;
+}
@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "coff.h"
+#include "prelink.h"
+
+/*  exe32-prelink - converts KMC COFF programs into page-aligned prelinked
+ *  images that exe32-linux can map without copying.
+ *
+ *  Usage: exe32-prelink [-c] <input.out> [output]
+ *    without output, the image goes to prelinked/ next to the input file,
+ *    where exe32-linux looks for it. The input file is left as it is.
+ *    -c only verifies the checksum of an already prelinked image.
+ */
+
+#define PAGE_SIZE PRELINK_PAGE_SIZE
+#define MAX_SEGS  32
+
+static const char *progname = "exe32-prelink";
+
+static unsigned char *read_file(const char *path, struct stat *stp) {
+    FILE *f = fopen(path, "rb");
+    unsigned char *buf;
+    struct stat st;
+
+    if (f == NULL || fstat(fileno(f), &st)) {
+        PRINT_ERR("%s: cannot open \"%s\": ", progname, path);
+        perror(NULL);
+        if (f) fclose(f);
+        return NULL;
+    }
+
+    buf = malloc(st.st_size ? st.st_size : 1);
+    if (fread(buf, 1, st.st_size, f) != (size_t) st.st_size) {
+        PRINT_ERR("%s: cannot read \"%s\"\n", progname, path);
+        free(buf);
+        fclose(f);
+        return NULL;
+    }
+
+    fclose(f);
+    *stp = st;
+    return buf;
+}
+
+static int verify_prelinked(const char *path, const unsigned char *buf, size_t size) {
+    const struct PrelinkHdr_s *hdr = (const struct PrelinkHdr_s *) buf;
+    const struct PrelinkSeg_s *segs = (const struct PrelinkSeg_s *) (hdr + 1);
+    uint32_t checksum = FNV1A_INIT;
+    int i;
+
+    if (size < PAGE_SIZE || hdr->ph_version != PRELINK_VERSION) {
+        PRINT_ERR("%s: \"%s\" has an unsupported prelink version\n", progname, path);
+        return 1;
+    }
+
+    for (i = 0; i < hdr->ph_nsegs; i++) {
+        if (segs[i].ps_fileoff + segs[i].ps_filesz > size) {
+            PRINT_ERR("%s: \"%s\" segment %d is truncated\n", progname, path, i);
+            return 1;
+        }
+        checksum = fnv1a(checksum, buf + segs[i].ps_fileoff, segs[i].ps_filesz);
+    }
+
+    if (checksum != hdr->ph_checksum) {
+        PRINT_ERR("%s: \"%s\" checksum mismatch (%08x != %08x)\n", progname, path, checksum, hdr->ph_checksum);
+        return 1;
+    }
+
+    printf("%s: OK, %d segments, entry %#x\n", path, hdr->ph_nsegs, hdr->ph_entry);
+    return 0;
+}
+
+// the COFF loader maps everything read/write/exec, but text only has to be
+// executable: the programs are plain gcc output and never patch their own code,
+// and gcc.out loads the programs it runs into memory it allocated itself
+static int page_flags(int s_flags) {
+    if (s_flags & STYP_TEXT)
+        return PSEG_READ | PSEG_EXEC;
+    return PSEG_READ | PSEG_WRITE;
+}
+
+static int prelink(const char *inpath, const char *outpath, const unsigned char *buf, const struct stat *st) {
+    const struct CoffHdr_s *chdr = (const struct CoffHdr_s *) buf;
+    const struct CoffSecHdr_s *secs;
+    struct PrelinkHdr_s hdr;
+    struct PrelinkSeg_s segs[MAX_SEGS];
+    uint32_t lo = UINT32_MAX, hi = 0, entry = 0, npages, i, fileoff;
+    unsigned char *image, *pflags, *pfile;
+    char *tmppath;
+    FILE *fout;
+    size_t size = st->st_size;
+    int nsegs = 0, ret = 1;
+
+    if (size < sizeof(*chdr) || chdr->f_magic != 0x014c || chdr->f_opthdr != 0x1c
+            || size < sizeof(*chdr) + chdr->f_opthdr + chdr->f_nscns * sizeof(*secs)) {
+        PRINT_ERR("%s: \"%s\" is not a COFF Program!\n", progname, inpath);
+        return 1;
+    }
+    secs = (const struct CoffSecHdr_s *) (buf + sizeof(*chdr) + chdr->f_opthdr);
+
+    for (i = 0; i < chdr->f_nscns; i++) {
+        uint32_t vaddr = (uint32_t) (uintptr_t) secs[i].s_vaddr;
+
+        if (secs[i].s_size <= 0) continue;
+        if (!(secs[i].s_flags & STYP_BSS) && secs[i].s_scnptr + (size_t) secs[i].s_size > size) {
+            PRINT_ERR("%s: \"%s\" section %.8s is truncated\n", progname, inpath, secs[i].s_name);
+            return 1;
+        }
+        if (secs[i].s_flags & STYP_TEXT && entry == 0)
+            entry = vaddr;
+        if (ROUNDDOWN(vaddr, PAGE_SIZE) < lo)
+            lo = ROUNDDOWN(vaddr, PAGE_SIZE);
+        if (ROUNDOFF(vaddr + secs[i].s_size, PAGE_SIZE) > hi)
+            hi = ROUNDOFF(vaddr + secs[i].s_size, PAGE_SIZE);
+    }
+    if (entry == 0) {
+        PRINT_ERR("%s: \"%s\" has no text section\n", progname, inpath);
+        return 1;
+    }
+
+    // lay the sections out in memory, and note how each page is used
+    npages = (hi - lo) / PAGE_SIZE;
+    image = calloc(hi - lo, 1);
+    pflags = calloc(npages, 1);
+    pfile = calloc(npages, 1);
+    for (i = 0; i < chdr->f_nscns; i++) {
+        uint32_t vaddr = (uint32_t) (uintptr_t) secs[i].s_vaddr, p;
+
+        if (secs[i].s_size <= 0) continue;
+        if (!(secs[i].s_flags & STYP_BSS))
+            memcpy(image + vaddr - lo, buf + secs[i].s_scnptr, secs[i].s_size);
+        for (p = (vaddr - lo) / PAGE_SIZE; p < (ROUNDOFF(vaddr + secs[i].s_size, PAGE_SIZE) - lo) / PAGE_SIZE; p++) {
+            pflags[p] |= page_flags(secs[i].s_flags);
+            if (!(secs[i].s_flags & STYP_BSS))
+                pfile[p] = 1;
+        }
+    }
+
+    // group runs of pages with the same protection into segments
+    fileoff = PAGE_SIZE;
+    for (i = 0; i < npages; ) {
+        uint32_t start = i;
+
+        if (pflags[i] == 0) {
+            i++;
+            continue;
+        }
+        while (i < npages && pflags[i] == pflags[start] && pfile[i] == pfile[start])
+            i++;
+
+        if (nsegs == MAX_SEGS) {
+            PRINT_ERR("%s: \"%s\" has too many segments\n", progname, inpath);
+            goto prelink_free;
+        }
+        segs[nsegs].ps_vaddr = lo + start * PAGE_SIZE;
+        segs[nsegs].ps_memsz = (i - start) * PAGE_SIZE;
+        segs[nsegs].ps_filesz = pfile[start] ? segs[nsegs].ps_memsz : 0;
+        segs[nsegs].ps_fileoff = pfile[start] ? fileoff : 0;
+        segs[nsegs].ps_flags = pflags[start];
+        fileoff += segs[nsegs].ps_filesz;
+        nsegs++;
+    }
+    if (sizeof(hdr) + nsegs * sizeof(segs[0]) > PAGE_SIZE) {
+        PRINT_ERR("%s: \"%s\" segment table does not fit in a page\n", progname, inpath);
+        goto prelink_free;
+    }
+
+    hdr.ph_magic = PRELINK_MAGIC;
+    hdr.ph_version = PRELINK_VERSION;
+    hdr.ph_nsegs = nsegs;
+    hdr.ph_entry = entry;
+    hdr.ph_src_size = st->st_size;
+    hdr.ph_src_mtime = st->st_mtime;
+    hdr.ph_checksum = FNV1A_INIT;
+    for (i = 0; i < (uint32_t) nsegs; i++) {
+        hdr.ph_checksum = fnv1a(hdr.ph_checksum, image + segs[i].ps_vaddr - lo, segs[i].ps_filesz);
+    }
+
+    tmppath = malloc(strlen(outpath) + sizeof(".tmp"));
+    strcpy(tmppath, outpath);
+    strcat(tmppath, ".tmp");
+    if ((fout = fopen(tmppath, "wb")) == NULL) {
+        PRINT_ERR("%s: cannot write \"%s\": ", progname, tmppath);
+        perror(NULL);
+        free(tmppath);
+        goto prelink_free;
+    }
+
+    {
+        unsigned char hdrpage[PAGE_SIZE];
+
+        memset(hdrpage, 0, PAGE_SIZE);
+        memcpy(hdrpage, &hdr, sizeof(hdr));
+        memcpy(hdrpage + sizeof(hdr), segs, nsegs * sizeof(segs[0]));
+        fwrite(hdrpage, PAGE_SIZE, 1, fout);
+    }
+    for (i = 0; i < (uint32_t) nsegs; i++) {
+        fwrite(image + segs[i].ps_vaddr - lo, 1, segs[i].ps_filesz, fout);
+    }
+
+    if (ferror(fout) | fclose(fout)) {
+        PRINT_ERR("%s: error writing \"%s\"\n", progname, tmppath);
+        remove(tmppath);
+    }
+    else if (rename(tmppath, outpath)) {
+        PRINT_ERR("%s: cannot rename \"%s\" to \"%s\": ", progname, tmppath, outpath);
+        perror(NULL);
+        remove(tmppath);
+    }
+    else {
+        printf("%s: %d segments, entry %#x\n", outpath, nsegs, entry);
+        ret = 0;
+    }
+    free(tmppath);
+
+prelink_free:
+    free(image);
+    free(pflags);
+    free(pfile);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    int check_only = 0, ret;
+    unsigned char *buf;
+    char *outpath;
+    struct stat st;
+
+    if (argc > 1 && !strcmp(argv[1], "-c")) {
+        check_only = 1;
+        argc--;
+        argv++;
+    }
+    if (argc < 2 || argc > 3) {
+        PRINT_ERR("Usage: %s [-c] <input.out> [output]\n", progname);
+        return 2;
+    }
+
+    if ((buf = read_file(argv[1], &st)) == NULL)
+        return 1;
+
+    if ((size_t) st.st_size >= sizeof(uint32_t) && *(uint32_t *) buf == PRELINK_MAGIC) {
+        ret = verify_prelinked(argv[1], buf, st.st_size);
+        if (!ret && argc == 3) {
+            PRINT_ERR("%s: \"%s\" is already prelinked\n", progname, argv[1]);
+            ret = 1;
+        }
+    }
+    else if (check_only) {
+        PRINT_ERR("%s: \"%s\" is not prelinked\n", progname, argv[1]);
+        ret = 1;
+    }
+    else if (argc == 3)
+        ret = prelink(argv[1], argv[2], buf, &st);
+    else {
+        const char *name = strrchr(argv[1], '/');
+        size_t dirlen = name ? (size_t) (++name - argv[1]) : 0;
+
+        if (name == NULL) name = argv[1];
+        outpath = malloc(dirlen + sizeof(PRELINK_DIR) + strlen(name));
+        memcpy(outpath, argv[1], dirlen);
+        strcpy(outpath + dirlen, PRELINK_DIR);
+        if (mkdir(outpath, 0755) && errno != EEXIST) {
+            PRINT_ERR("%s: cannot create \"%s\": ", progname, outpath);
+            perror(NULL);
+            ret = 1;
+        }
+        else {
+            strcat(outpath, name);
+            ret = prelink(argv[1], outpath, buf, &st);
+        }
+        free(outpath);
+    }
+
+    free(buf);
+    return ret;
+}
@@ -0,0 +1,296 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "trace.h"
+
+/*  exe32-tracedump - prints the traces that exe32-linux writes with EXE32_TRACE=<dir>.
+ *
+ *  Usage: exe32-tracedump [-j] <dir>
+ *    the traces of all the processes in dir are merged by time, each process indented
+ *    under the one that spawned it.
+ *    -j prints JSON instead: the processes and the events.
+ */
+
+struct trace_proc {
+    struct TraceHdr_s *hdr;
+    struct TraceRec_s *recs;
+    uint32_t first, count;   /* the records still in the ring, oldest first */
+    int depth;
+};
+
+struct event {
+    struct trace_proc *proc;
+    struct TraceRec_s *rec;
+    uint32_t seq;            /* the order the process wrote it in */
+};
+
+static const char *progname = "exe32-tracedump";
+
+static struct trace_proc *procs = NULL;
+static int num_procs = 0;
+
+static void *read_file(const char *path, size_t *sizep) {
+    FILE *f = fopen(path, "rb");
+    void *buf;
+    struct stat st;
+
+    if (f == NULL || fstat(fileno(f), &st)) {
+        PRINT_ERR("%s: cannot open \"%s\": ", progname, path);
+        perror(NULL);
+        if (f) fclose(f);
+        return NULL;
+    }
+
+    buf = malloc(st.st_size ? st.st_size : 1);
+    if (fread(buf, 1, st.st_size, f) != (size_t) st.st_size) {
+        PRINT_ERR("%s: cannot read \"%s\"\n", progname, path);
+        free(buf);
+        fclose(f);
+        return NULL;
+    }
+
+    fclose(f);
+    *sizep = st.st_size;
+    return buf;
+}
+
+static void add_trace(const char *path) {
+    struct TraceHdr_s *hdr;
+    struct trace_proc *proc;
+    size_t size;
+
+    if ((hdr = read_file(path, &size)) == NULL)
+        return;
+    // a loader that was killed while setting up its trace leaves one without the magic
+    if (size < sizeof(*hdr) || hdr->th_magic != TRACE_MAGIC || hdr->th_version != TRACE_VERSION
+            || size < sizeof(*hdr) + (size_t) hdr->th_nrecs * sizeof(struct TraceRec_s) || hdr->th_nrecs == 0) {
+        PRINT_ERR("%s: \"%s\" is not a trace\n", progname, path);
+        free(hdr);
+        return;
+    }
+    hdr->th_program[sizeof(hdr->th_program) - 1] = '\0';
+
+    procs = realloc(procs, (num_procs + 1) * sizeof(*procs));
+    proc = &procs[num_procs++];
+    proc->hdr = hdr;
+    proc->recs = (struct TraceRec_s *) (hdr + 1);
+    if (hdr->th_next > hdr->th_nrecs) {
+        proc->first = hdr->th_next % hdr->th_nrecs;
+        proc->count = hdr->th_nrecs;
+    }
+    else {
+        proc->first = 0;
+        proc->count = hdr->th_next;
+    }
+}
+
+static struct trace_proc *find_proc(int pid) {
+    int i;
+
+    for (i = 0; i < num_procs; i++) {
+        if (procs[i].hdr->th_pid == pid)
+            return &procs[i];
+    }
+    return NULL;
+}
+
+// how many of the traced processes are above proc, pids can be reused so at most all of them
+static int proc_depth(struct trace_proc *proc) {
+    int depth = 0;
+
+    while ((proc = find_proc(proc->hdr->th_parent)) != NULL && depth < num_procs)
+        depth++;
+    return depth;
+}
+
+static int compare_procs(const void *a, const void *b) {
+    const struct trace_proc *pa = a, *pb = b;
+
+    if (pa->hdr->th_start != pb->hdr->th_start)
+        return pa->hdr->th_start < pb->hdr->th_start ? -1 : 1;
+    return 0;
+}
+
+static int compare_events(const void *a, const void *b) {
+    const struct event *ea = a, *eb = b;
+
+    if (ea->rec->tr_time != eb->rec->tr_time)
+        return ea->rec->tr_time < eb->rec->tr_time ? -1 : 1;
+    if (ea->proc != eb->proc)
+        return ea->proc < eb->proc ? -1 : 1;
+    return ea->seq < eb->seq ? -1 : 1;
+}
+
+static void print_json_string(const char *str, size_t max) {
+    size_t i;
+
+    putchar('"');
+    for (i = 0; i < max && str[i] != '\0'; i++) {
+        if (str[i] == '"' || str[i] == '\\')
+            putchar('\\');
+        if ((unsigned char) str[i] < 0x20)
+            printf("\\u%04x", str[i]);
+        else
+            putchar(str[i]);
+    }
+    putchar('"');
+}
+
+static const char *wrapper_name(int wrapper) {
+    return wrapper < NUM_WRAPPERS ? wrapper_names[wrapper] : "?";
+}
+
+static void print_text(struct event *events, size_t num_events) {
+    uint64_t start = num_events ? events[0].rec->tr_time : 0;
+    size_t i;
+    int p;
+
+    for (p = 0; p < num_procs; p++) {
+        uint32_t lost = procs[p].hdr->th_next - procs[p].count;
+
+        printf("%*s%d %s", procs[p].depth * 2, "", procs[p].hdr->th_pid, procs[p].hdr->th_program);
+        if (procs[p].hdr->th_parent)
+            printf(" (parent %d)", procs[p].hdr->th_parent);
+        if (lost)
+            printf(", %u oldest records lost", lost);
+        putchar('\n');
+    }
+    if (num_procs)
+        putchar('\n');
+
+    for (i = 0; i < num_events; i++) {
+        struct TraceRec_s *rec = events[i].rec;
+
+        printf("%12.6f %*s[%d] ", (rec->tr_time - start) / 1e9, events[i].proc->depth * 2, "", events[i].proc->hdr->th_pid);
+        switch (rec->tr_event) {
+            case TEV_START:
+                printf("start %.*s\n", (int) sizeof(rec->tr_text), rec->tr_text);
+                break;
+            case TEV_EXIT:
+                printf("exit %d\n", rec->tr_ret);
+                break;
+            case TEV_CALL:
+                printf("%s(", wrapper_name(rec->tr_wrapper));
+                if (rec->tr_text[0])
+                    printf("\"%.*s\"", (int) sizeof(rec->tr_text), rec->tr_text);
+                else
+                    printf("%#x, %#x, %#x", rec->tr_args[0], rec->tr_args[1], rec->tr_args[2]);
+                printf(") = %d, %.3f us\n", rec->tr_ret, rec->tr_duration / 1e3);
+                break;
+            default:
+                printf("event %d\n", rec->tr_event);
+                break;
+        }
+    }
+}
+
+static void print_json(struct event *events, size_t num_events) {
+    size_t i;
+    int p;
+
+    printf("{\"processes\":[");
+    for (p = 0; p < num_procs; p++) {
+        struct TraceHdr_s *hdr = procs[p].hdr;
+
+        printf("%s{\"pid\":%d,\"parent\":%d,\"program\":", p ? "," : "", hdr->th_pid, hdr->th_parent);
+        print_json_string(hdr->th_program, sizeof(hdr->th_program));
+        printf(",\"start_ns\":%llu,\"records\":%u,\"lost\":%u}", (unsigned long long) hdr->th_start,
+            procs[p].count, hdr->th_next - procs[p].count);
+    }
+
+    printf("],\"events\":[");
+    for (i = 0; i < num_events; i++) {
+        struct TraceRec_s *rec = events[i].rec;
+
+        printf("%s\n{\"time_ns\":%llu,\"pid\":%d", i ? "," : "", (unsigned long long) rec->tr_time,
+            events[i].proc->hdr->th_pid);
+        switch (rec->tr_event) {
+            case TEV_START:
+                printf(",\"event\":\"start\",\"parent\":%d,\"program\":", rec->tr_ret);
+                print_json_string(rec->tr_text, sizeof(rec->tr_text));
+                break;
+            case TEV_EXIT:
+                printf(",\"event\":\"exit\",\"status\":%d", rec->tr_ret);
+                break;
+            default:
+                printf(",\"event\":\"call\",\"wrapper\":\"%s\",\"args\":[%u,%u,%u],\"ret\":%d,\"duration_ns\":%u",
+                    wrapper_name(rec->tr_wrapper), rec->tr_args[0], rec->tr_args[1], rec->tr_args[2],
+                    rec->tr_ret, rec->tr_duration);
+                if (rec->tr_text[0]) {
+                    printf(",\"path\":");
+                    print_json_string(rec->tr_text, sizeof(rec->tr_text));
+                }
+                break;
+        }
+        putchar('}');
+    }
+    printf("]}\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct event *events;
+    size_t num_events = 0, n;
+    struct dirent *dent;
+    int json = 0, p;
+    uint32_t r;
+    DIR *dir;
+
+    if (argc > 1 && !strcmp(argv[1], "-j")) {
+        json = 1;
+        argc--;
+        argv++;
+    }
+    if (argc != 2) {
+        PRINT_ERR("Usage: %s [-j] <dir>\n", progname);
+        return 2;
+    }
+
+    if ((dir = opendir(argv[1])) == NULL) {
+        PRINT_ERR("%s: cannot open \"%s\": ", progname, argv[1]);
+        perror(NULL);
+        return 1;
+    }
+    while ((dent = readdir(dir)) != NULL) {
+        size_t len = strlen(dent->d_name);
+        char *path;
+
+        if (strncmp(dent->d_name, "exe32-", 6) || len < 6 || strcmp(dent->d_name + len - 6, ".trace"))
+            continue;
+        path = malloc(strlen(argv[1]) + len + 2);
+        sprintf(path, "%s/%s", argv[1], dent->d_name);
+        add_trace(path);
+        free(path);
+    }
+    closedir(dir);
+    qsort(procs, num_procs, sizeof(*procs), compare_procs);
+
+    for (p = 0; p < num_procs; p++) {
+        procs[p].depth = proc_depth(&procs[p]);
+        num_events += procs[p].count;
+    }
+
+    events = malloc((num_events ? num_events : 1) * sizeof(*events));
+    for (p = 0, n = 0; p < num_procs; p++) {
+        for (r = 0; r < procs[p].count; r++) {
+            events[n].proc = &procs[p];
+            events[n].seq = r;
+            events[n++].rec = &procs[p].recs[(procs[p].first + r) % procs[p].hdr->th_nrecs];
+        }
+    }
+    qsort(events, num_events, sizeof(*events), compare_events);
+
+    if (json)
+        print_json(events, num_events);
+    else
+        print_text(events, num_events);
+
+    free(events);
+    for (p = 0; p < num_procs; p++)
+        free(procs[p].hdr);
+    free(procs);
+    return 0;
+}
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "common.h"
+#include "trace.h"
+
+/*  Tracing (EXE32_TRACE=<dir>)
+ *
+ *  Every loader maps its own trace file in <dir> (see trace.h) and writes a record when a
+ *  program starts, for each wrapper call it makes and when it exits. A record is a copy
+ *  into the mapping, nothing is formatted or written out: the kernel writes the pages back
+ *  whenever it likes, and they're there even if the loader crashes. The file is a ring of
+ *  EXE32_TRACE_SIZE records (4096 by default), so it keeps the last ones.
+ *
+ *  Each loader passes its pid to the ones it spawns in EXE32_TRACE_PARENT, and
+ *  exe32-tracedump puts the traces of a process tree back together.
+ */
+
+static struct TraceHdr_s *trace_hdr = NULL;
+static struct TraceRec_s *trace_recs;
+static size_t trace_size;
+static int64_t realtime_offset;  /* CLOCK_REALTIME - CLOCK_MONOTONIC */
+static int parent_pid;
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void trace_init(void) {
+    char *env_dir = getenv("EXE32_TRACE"), *env_parent = getenv("EXE32_TRACE_PARENT");
+    char *env_size = getenv("EXE32_TRACE_SIZE"), *path, pidstr[32];
+    long nrecs = env_size != NULL ? atol(env_size) : TRACE_DEFAULT_RECS;
+    int fd;
+
+    // a forked loader has its parent's trace mapped
+    if (trace_hdr != NULL) {
+        munmap(trace_hdr, trace_size);
+        trace_hdr = NULL;
+    }
+    if (env_dir == NULL || env_dir[0] == '\0')
+        return;
+
+    parent_pid = env_parent != NULL ? atoi(env_parent) : 0;
+    snprintf(pidstr, sizeof(pidstr), "%d", (int) getpid());
+    setenv("EXE32_TRACE_PARENT", pidstr, 1);
+
+    if (nrecs < 16)
+        nrecs = TRACE_DEFAULT_RECS;
+    trace_size = sizeof(struct TraceHdr_s) + nrecs * sizeof(struct TraceRec_s);
+
+    path = malloc(strlen(env_dir) + 32);
+    sprintf(path, "%s/exe32-%d.trace", env_dir, (int) getpid());
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1 || ftruncate(fd, trace_size)
+            || (trace_hdr = mmap(NULL, trace_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        PRINT_ERR("EXE32_TRACE: cannot create \"%s\": %s\n", path, strerror(errno));
+        trace_hdr = NULL;
+    }
+    if (fd != -1)
+        close(fd);
+    free(path);
+    if (trace_hdr == NULL)
+        return;
+
+    realtime_offset = (int64_t) (clock_ns(CLOCK_REALTIME) - clock_ns(CLOCK_MONOTONIC));
+    trace_recs = (struct TraceRec_s *) (trace_hdr + 1);
+    trace_hdr->th_version = TRACE_VERSION;
+    trace_hdr->th_pid = getpid();
+    trace_hdr->th_parent = parent_pid;
+    trace_hdr->th_nrecs = nrecs;
+    trace_hdr->th_next = 0;
+    trace_hdr->th_start = clock_ns(CLOCK_REALTIME);
+    // the magic last, a file without it is still being set up
+    trace_hdr->th_magic = TRACE_MAGIC;
+}
+
+int trace_active(void) {
+    return trace_hdr != NULL;
+}
+
+static struct TraceRec_s *new_record(int event, uint64_t time) {
+    struct TraceRec_s *rec = &trace_recs[trace_hdr->th_next % trace_hdr->th_nrecs];
+
+    memset(rec, 0, sizeof(*rec));
+    rec->tr_time = time;
+    rec->tr_event = event;
+    trace_hdr->th_next++;
+    return rec;
+}
+
+// keeps the end of a string that doesn't fit, it's the part of a path that tells the most
+static void set_text(struct TraceRec_s *rec, const char *text) {
+    size_t len = strlen(text);
+
+    if (len >= sizeof(rec->tr_text))
+        text += len - (sizeof(rec->tr_text) - 1);
+    strncpy(rec->tr_text, text, sizeof(rec->tr_text) - 1);
+}
+
+void trace_begin(const char *program) {
+    struct TraceRec_s *rec;
+
+    if (trace_hdr == NULL)
+        return;
+    rec = new_record(TEV_START, clock_ns(CLOCK_REALTIME));
+    rec->tr_ret = parent_pid;
+    set_text(rec, program);
+    strncpy(trace_hdr->th_program, program, sizeof(trace_hdr->th_program) - 1);
+}
+
+/*  a wrapper call that started at begin (CLOCK_MONOTONIC) and took duration ns. the
+ *  wrappers that are given a path get it in the record, the others their arguments.
+ */
+void trace_call(int wrapper, const uint32_t *args, int ret, uint64_t begin, uint64_t duration) {
+    struct TraceRec_s *rec;
+
+    if (trace_hdr == NULL)
+        return;
+
+    rec = new_record(TEV_CALL, begin + realtime_offset);
+    rec->tr_duration = duration > UINT32_MAX ? UINT32_MAX : duration;
+    rec->tr_wrapper = wrapper;
+    rec->tr_ret = ret;
+    memcpy(rec->tr_args, args, sizeof(rec->tr_args));
+
+    switch (wrapper) {
+        case 1: case 2: case 7: case 9: case 16: case 17: case 18: case 19: case 21: case 23:
+            if (args[0] != 0)
+                set_text(rec, (const char *) (uintptr_t) args[0]);
+            break;
+    }
+}
+
+void trace_finish(int status) {
+    if (trace_hdr == NULL)
+        return;
+    new_record(TEV_EXIT, clock_ns(CLOCK_REALTIME))->tr_ret = status;
+}
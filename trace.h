@@ -0,0 +1,65 @@
+#ifndef EXE32_TRACE_H
+#define EXE32_TRACE_H
+
+#include <stdint.h>
+
+/*  Trace file, one per process, as written with EXE32_TRACE=<dir>:
+ *
+ *    +--------------------------+ 0x0
+ *    | struct TraceHdr_s        |
+ *    +--------------------------+ sizeof(struct TraceHdr_s)
+ *    | struct TraceRec_s        |
+ *    | [th_nrecs], a ring that  |
+ *    | wraps around             |
+ *    +--------------------------+
+ *
+ *  The file is <dir>/exe32-<pid>.trace. Record number th_next is the next one written, at
+ *  th_next % th_nrecs, so once th_next passes th_nrecs the oldest record is the one there.
+ *  Times are CLOCK_REALTIME nanoseconds, so the traces of processes can be merged.
+ */
+#define TRACE_MAGIC   0x52543345 /* "E3TR" */
+#define TRACE_VERSION 1
+#define TRACE_DEFAULT_RECS 4096
+
+#define TEV_START 1  /* a program starts, tr_text is its name and tr_ret the parent's pid */
+#define TEV_CALL  2  /* a wrapper call, tr_args are its first arguments and tr_text a path it was given */
+#define TEV_EXIT  3  /* the program exits with tr_ret */
+
+struct TraceHdr_s {
+    uint32_t th_magic;
+    uint32_t th_version;
+    int32_t th_pid;
+    int32_t th_parent;      /* pid of the loader that spawned this one, or 0 */
+    uint32_t th_nrecs;
+    uint32_t th_next;
+    uint64_t th_start;
+    char th_program[224];
+};
+
+struct TraceRec_s {
+    uint64_t tr_time;
+    uint32_t tr_duration;   /* ns */
+    uint16_t tr_event;
+    uint16_t tr_wrapper;
+    int32_t tr_ret;
+    uint32_t tr_args[3];
+    char tr_text[32];       /* the end of it if it's longer */
+};
+
+/* the names of the wrappers by their number in io_wrappers */
+#define NUM_WRAPPERS 31
+static const char *const wrapper_names[NUM_WRAPPERS] = {
+    "realloc_segment", "open_file", "create_file", "write", "read", "close", "seek", "file_attrs",
+    "set_dta", "list_file", "list_file_next", "list_file_close", "isatty", "get_file_time",
+    "get_localtime", "set_file_time", "mkdir", "rmdir", "remove", "rename", "chdrive", "chdir",
+    "getdrive", "spawnve", "get_return_code", "dup", "dup2", "get_dos_version", "exit",
+    "direct_stdin", "sleep"
+};
+
+void trace_init(void);
+int trace_active(void);
+void trace_begin(const char *);
+void trace_call(int, const uint32_t *, int, uint64_t, uint64_t);
+void trace_finish(int);
+
+#endif // EXE32_TRACE_H
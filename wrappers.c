@@ -3,6 +3,7 @@
 #include <stddef.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <time.h>
 #include <errno.h>
 #include <sys/stat.h>
@@ -14,12 +15,22 @@
 #include "fd.h"
 #include "paths.h"
 #include "memmap.h"
+#include "main.h"
+#include "cache.h"
+#include "depfile.h"
+#include "memtmp.h"
+#include "tmpns.h"
+#include "dircache.h"
+#include "statcache.h"
+#include "find.h"
+#include "profile.h"
+
+extern char **environ;
 
 static struct wrapprog_exec_s *wpexec = NULL;
-static DIR *find_file_obj = NULL;
 
 #define SET_ERROR_CODE(errcode) *wpexec->wp_errcode_ptr = errcode
-#define GET_REAL_FILENO(fd) fileno(fd_fileptrs[fd])
+#define GET_REAL_FILENO(fd) (fd_handles[fd]->fd)
 
 // -- Extra parameters needed for init_first to satisfy the loaded program --
 // gcc.out also loads and runs certain programs inside this process's memory just like this exe32 program
@@ -29,7 +40,7 @@ static DIR *find_file_obj = NULL;
 #define EXE32_PARAMS 0x0, 0x87654321 /* the next 2 parameters are required */
 
 #define IS_VALID_FD(fd) \
-    if (fd < 0 || fd >= NUM_FILEPTRS || fd_fileptrs[fd] == NULL) { \
+    if (fd < 0 || fd >= fd_table_size || fd_handles[fd] == NULL) { \
         PRINT_DBG("fd no. %d is invalid or null\n", fd); \
         SET_ERROR_CODE(ERR_INVALID_HANDLE); \
         return -1; \
@@ -44,6 +55,9 @@ static DIR *find_file_obj = NULL;
     path##_fixed = fix_win_path(path##_fixed); \
     replace_case_path(path##_fixed)
 
+// EXE32_TMPNS=1 moves a fixed path of a temp file into the process tree's own temp directory
+#define TMPNS_PATH(path, create) tmpns_fix(&path##_fixed, &path##_fixed_dup, create)
+
 #define FREE_PATH(path) free(path##_fixed_dup)
 
 // TODO: the loaded program changes the stack pointer to the address of init_first function, decide whether or not add a code that restores the stack pointer temporarily before jumping to these wrappers?
@@ -57,38 +71,49 @@ CDECL static int realloc_segment_wrapper (uint addr_high) {
 CDECL static int open_file_wrapper (char *filename, exe32_fopen_mode mode) {
     // CreateFileA with OPEN_EXISTING flag
 
-    int fdno;
-    char *fopen_mode = NULL;
-    FILE *fp;
+    int fdno, host_fd, open_flags = -1;
     DEFINE_FIXED_PATH(filename);
 
     switch (mode) {
         case EXE32_FOPEN_R:
-            fopen_mode = "rb";
+            open_flags = O_RDONLY;
             break;
         case EXE32_FOPEN_W: 
-            fopen_mode = "r+b"; // "wb" truncates the file, and we dont want it to be, so...
+            open_flags = O_RDWR; // O_WRONLY | O_TRUNC truncates the file, and we dont want it to be, so...
             break;
         case EXE32_FOPEN_RW:
-            fopen_mode = "r+b";
+            open_flags = O_RDWR;
             break;
     }
-    if (fopen_mode == NULL) {
+    if (open_flags == -1) {
         PRINT_DBG("open_file: invalid access mode %d\n", mode);
         SET_ERROR_CODE(ERR_INVALID_ACCESS);
         return -1;
     }
 
     FIX_PATH(filename);
-    fp = fopen(filename_fixed, fopen_mode);
-    if (fp == NULL) {
+    TMPNS_PATH(filename, 0);
+    if ((host_fd = memtmp_open(filename_fixed, open_flags)) != -1)
+        cache_uncacheable("uses in-memory temp files");
+    else if (errno == ENOENT)
+        host_fd = open(filename_fixed, open_flags | O_CLOEXEC);
+    if (host_fd == -1) {
         PRINT_DBG("open_file: cannot open (%s)\n", strerror(errno));
+        if (errno == ENOENT || errno == ENOTDIR)
+            cache_note_lookup(filename_fixed, 0, 0);
+        else
+            cache_uncacheable("cannot open a file");
         SET_ERROR_CODE(ERR_FILE_NOT_FOUND);
         FREE_PATH(filename);
         return -1;
     }
+    cache_note_read(filename_fixed, mode != EXE32_FOPEN_R);
+    depfile_note(mode == EXE32_FOPEN_R ? 'R' : 'W', filename_fixed);
+    if (mode != EXE32_FOPEN_R)
+        statcache_forget(filename_fixed);
 
-    fdno = append_fd(fp);
+    if ((fdno = fd_open(host_fd, open_flags == O_RDONLY ? FD_READ : FD_READ | FD_WRITE)) == -1)
+        SET_ERROR_CODE(ERR_TOO_MANY_OPEN_FILES);
     PRINT_DBG("open_file: Open \"%s\" with flag %d, returned with fd %d\n", filename, mode, fdno);
     FREE_PATH(filename);
     return fdno;
@@ -97,22 +122,36 @@ CDECL static int open_file_wrapper (char *filename, exe32_fopen_mode mode) {
 CDECL static int create_file_wrapper (char *filename, UNUSED int attrs) {
     // CreateFileA with CREATE_ALWAYS flag
 
-    int fdno;
-    FILE *fp;
+    int fdno, host_fd;
     DEFINE_FIXED_PATH(filename);
 
     PRINT_DBG("create_file: Create \"%s\" with attributes %d\n", filename, attrs);
 
     FIX_PATH(filename);
-    fp = fopen(filename_fixed, "wb");
-    if (fp == NULL) {
+    TMPNS_PATH(filename, 1);
+    if (memtmp_match(filename_fixed)) {
+        cache_uncacheable("uses in-memory temp files");
+        host_fd = memtmp_create(filename_fixed);
+    }
+    else {
+        cache_prepare_create(filename_fixed);
+        host_fd = open(filename_fixed, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    }
+    if (host_fd == -1) {
         PRINT_DBG("create_file: cannot write (%s)\n", strerror(errno));
+        cache_uncacheable("cannot create a file");
         SET_ERROR_CODE(ERR_PATH_NOT_FOUND); // ???
         FREE_PATH(filename);
         return -1;
     }
-
-    fdno = append_fd(fp);
+    cache_note_create(filename_fixed);
+    depfile_note('W', filename_fixed);
+    dircache_add(filename_fixed);
+    statcache_forget(filename_fixed);
+    fd_files_changed();
+
+    if ((fdno = fd_open(host_fd, FD_WRITE)) == -1)
+        SET_ERROR_CODE(ERR_TOO_MANY_OPEN_FILES);
     FREE_PATH(filename);
     PRINT_DBG("create_file: returned with fd %d\n", fdno);
     return fdno;
@@ -122,8 +161,9 @@ CDECL static int write_wrapper (int fd, void *data, ulong size) {
     size_t b_write;
 
     IS_VALID_FD(fd)
-    b_write = fwrite(data, 1, size, fd_fileptrs[fd]);
-    fflush(fd_fileptrs[fd]);
+    b_write = fd_write(fd_handles[fd], data, size);
+    if (cache_recording && (fd_handles[fd]->flags & FD_STD))
+        cache_note_output(GET_REAL_FILENO(fd), data, b_write);
     PRINT_DBG("write: written %d bytes at fd %d\n", b_write, fd);
     return b_write;
 }
@@ -132,7 +172,9 @@ CDECL static int read_wrapper (int fd, void *data, ulong size) {
     size_t b_read;
 
     IS_VALID_FD(fd)
-    b_read = fread(data, 1, size, fd_fileptrs[fd]);
+    if ((fd_handles[fd]->flags & FD_STD) && GET_REAL_FILENO(fd) == 0)
+        cache_uncacheable("reads stdin");
+    b_read = fd_read(fd_handles[fd], data, size);
     PRINT_DBG("read: read %d bytes at fd %d\n", b_read, fd);
     return b_read;
 }
@@ -141,8 +183,14 @@ CDECL static int close_wrapper (int fd) {
     PRINT_DBG("close: closed fd %d\n", fd);
     IS_VALID_FD(fd)
 
-    fclose(fd_fileptrs[fd]);
-    fd_fileptrs[fd] = NULL;
+    // its time and size changed, for whatever path it was looked up by
+    if ((fd_handles[fd]->flags & (FD_WRITE | FD_STD)) == FD_WRITE)
+        statcache_forget_fd(GET_REAL_FILENO(fd));
+    // a full disk shows up when the buffer is written out
+    if (fd_release(fd)) {
+        SET_ERROR_CODE(ERR_WRITE_FAULT);
+        return -1;
+    }
     return 0;
 }
 
@@ -151,29 +199,47 @@ CDECL static int seek_wrapper (int fd, long offset, int whence) {
     long ret_offset;
 
     IS_VALID_FD(fd)
-    if (fseek(fd_fileptrs[fd], offset, whence)) {
+    if ((ret_offset = fd_seek(fd_handles[fd], offset, whence)) < 0) {
         PRINT_DBG("seek: seek error\n");
         SET_ERROR_CODE(ERR_SEEK);
         return -1;
     }
-    ret_offset = ftell(fd_fileptrs[fd]);
     return (uint)ret_offset;
 }
 
+// files open for writing change behind the stat cache, and may still have writes buffered
+static void sync_written_files(void) {
+    int i;
+
+    for (i = 0; i < fd_table_size; i++) {
+        struct fd_handle *handle = fd_handles[i];
+
+        if (handle != NULL && handle->changed && (handle->flags & FD_POSITIONAL)) {
+            fd_flush(handle);
+            statcache_forget_fd(handle->fd);
+            handle->changed = 0;
+        }
+    }
+}
+
 CDECL static int file_attrs_wrapper (char *filename, UNUSED uint f_attributes, UNUSED int set_attr) {
     int ret = 0;
     struct stat sfile;
     DEFINE_FIXED_PATH(filename);
 
     FIX_PATH(filename);
+    TMPNS_PATH(filename, 0);
     if (!set_attr) {
         PRINT_DBG("file_attrs: get attributes \"%s\"\n", filename);
-        if (stat(filename_fixed, &sfile)) {
+        sync_written_files();
+        if (memtmp_stat(filename_fixed, &sfile) && statcache_stat(filename_fixed, &sfile)) {
             PRINT_DBG("file_attrs: file not found!\n");
+            cache_note_lookup(filename_fixed, 0, 0);
             SET_ERROR_CODE(ERR_FILE_NOT_FOUND);
             ret = -1;
         }
         else {
+            cache_note_lookup(filename_fixed, 1, S_ISDIR(sfile.st_mode));
             switch (sfile.st_mode & S_IFMT) {
                 case S_IFLNK:
                 case S_IFREG:
@@ -208,107 +274,90 @@ CDECL static int set_dta_wrapper (struct unk_dta_s *dta) {
 void copy_stat_to_dta(struct stat *st, char *filename) {
     int attr = 0;
     struct unk_dta_s *dta = wpexec->wp_filedata;
-    struct tm *time;
+    ushort dos_date, dos_time;
 
     if (S_ISDIR(st->st_mode))
         attr = FILEATTR_DIRECTORY;
     else if (S_ISREG(st->st_mode))
         attr = FILEATTR_ARCHIVE;
 
-    time = localtime(&st->st_mtime);
     dta->attributes = attr;
-    dta->datetime.time =
-        (time->tm_sec / 2) |
-        (time->tm_min << 5) |
-        (time->tm_hour << 11);
-    dta->datetime.date =
-        (time->tm_mday) |
-        ((time->tm_mon + 1) << 5) |
-        ((time->tm_year - 80) << 9);
+    statcache_dostime(st->st_mtime, &dos_date, &dos_time);
+    dta->datetime.date = dos_date;
+    dta->datetime.time = dos_time;
     dta->filesize.low = st->st_size & 0xffff;
     dta->filesize.high = st->st_size >> 16;
     strncpy(dta->filename, filename, 255);
 }
 
-int copy_dirent_to_dta(struct dirent *dent) {
-    struct stat st;
-    if (stat(dent->d_name, &st)) {
-        PRINT_DBG("> copy_dirent_to_dta: cannot stat (%s)\n", strerror(errno));
-        return -1;
-    }
-    copy_stat_to_dta(&st, dent->d_name);
-    return 0;
-}
-
 CDECL static int list_file_close_wrapper (void) {
     PRINT_DBG("list_file_close: close\n");
-    if (find_file_obj) {
-        closedir(find_file_obj);
-        find_file_obj = NULL;
-    }
+    find_close(wpexec->wp_filedata);
     return 0;
 }
 
-CDECL static int list_file_wrapper (char *path, UNUSED uint attr_mask) {
+CDECL static int list_file_wrapper (char *path, uint attr_mask) {
     // This function does not set error code
-    if (find_file_obj) {
-        closedir(find_file_obj);
-        find_file_obj = NULL;
-    }
+    struct stat spath;
+    DEFINE_FIXED_PATH(path);
+    FIX_PATH(path);
 
-    if(!strcmp(".\\*.*", path)) {
-        struct dirent *dent;
-        PRINT_DBG("list_file: glob pattern (.\\*.*)\n");
-        if (!(find_file_obj = opendir("."))) {
-            PRINT_DBG("list_file: cannot opendir (%s)\n", strerror(errno));
-            return -1;
+    PRINT_DBG("list_file: path = \"%s\", attr_mask = 0x%04x\n", path, attr_mask);
+    sync_written_files();
+    if (find_is_pattern(basename(path_fixed))) {
+        char *pattern = basename(path_fixed), *dir = "";
+        const char *name;
+
+        cache_uncacheable("lists a directory");
+        if (pattern != path_fixed) {
+            dir = path_fixed;
+            pattern[-1] = '\0';
+            if (dir[0] == '\0')
+                dir = "/";
         }
-        if (!(dent = readdir(find_file_obj))) {
-            PRINT_DBG("list_file: cannot readdir (%s)\n", strerror(errno));
+        if (find_first(wpexec->wp_filedata, dir, pattern, attr_mask, &name, &spath)) {
+            PRINT_DBG("list_file: nothing matches \"%s\"\n", pattern);
+            FREE_PATH(path);
             return -1;
         }
-        PRINT_DBG("list_file: first file: \"%s\"\n", dent->d_name);
-        return copy_dirent_to_dta(dent);
+        PRINT_DBG("list_file: first file: \"%s\"\n", name);
+        copy_stat_to_dta(&spath, (char *) name);
+        FREE_PATH(path);
+        return 0;
     }
-    else {
-        struct stat spath;
-        DEFINE_FIXED_PATH(path);
-        FIX_PATH(path);
-
-        PRINT_DBG("list_file: path = \"%s\", attr_mask = 0x%04x\n", path, attr_mask);
-        if(stat(path_fixed, &spath)) {
-            PRINT_DBG("list_file: cannot stat (%s)\n", strerror(errno));
-            free(path_fixed_dup);
-            return -1;
-        }
-        if (S_ISDIR(spath.st_mode)) {
-            // TODO: implement opendir
-            PRINT_DBG("list_file: is a directory, opendir not implemented\n");
-            //free(path_fixed_dup);
-            //return -1;
-        }
-        else if (!S_ISREG(spath.st_mode)) {
-            PRINT_DBG("list_file: other types besides file, not implemented\n");
-            //free(path_fixed_dup);
-            //return -1;
-        }
 
-        copy_stat_to_dta(&spath, basename(path_fixed));
+    TMPNS_PATH(path, 0);
+    if (memtmp_stat(path_fixed, &spath) && statcache_stat(path_fixed, &spath)) {
+        PRINT_DBG("list_file: cannot stat (%s)\n", strerror(errno));
+        cache_note_lookup(path_fixed, 0, 0);
         FREE_PATH(path);
+        return -1;
+    }
+    cache_note_lookup(path_fixed, 1, S_ISDIR(spath.st_mode));
+    if (S_ISDIR(spath.st_mode)) {
+        // TODO: implement opendir
+        PRINT_DBG("list_file: is a directory, opendir not implemented\n");
+    }
+    else if (!S_ISREG(spath.st_mode)) {
+        PRINT_DBG("list_file: other types besides file, not implemented\n");
     }
 
+    copy_stat_to_dta(&spath, basename(path_fixed));
+    FREE_PATH(path);
     return 0;
 }
 
 CDECL static int list_file_next_wrapper (void) {
-    struct dirent *dent;
-    if (!(dent = readdir(find_file_obj))) {
-        //PRINT_DBG("list_file_next: cannot readdir (%s)\n", strerror(errno));
+    struct stat st;
+    const char *name;
+
+    if (find_next(wpexec->wp_filedata, &name, &st)) {
         PRINT_DBG("list_file_next: stop\n");
         return -1;
     }
-    PRINT_DBG("list_file_next: next file: \"%s\"\n", dent->d_name);
-    return copy_dirent_to_dta(dent);
+    PRINT_DBG("list_file_next: next file: \"%s\"\n", name);
+    copy_stat_to_dta(&st, (char *) name);
+    return 0;
 }
 
 CDECL static int isatty_wrapper (int fd) {
@@ -318,21 +367,14 @@ CDECL static int isatty_wrapper (int fd) {
 
 CDECL static int get_file_time_wrapper (int fd, struct dos_datetime_s *dos_dt) {
     struct stat fst;
-    struct tm *time;
 
     PRINT_DBG("get_file_time: fd %d\n", fd);
     IS_VALID_FD(fd)
 
+    // what's still buffered changes the time when it's written, by any handle on the file
+    fd_flush_file(fd_handles[fd]);
     fstat(GET_REAL_FILENO(fd), &fst);
-    time = localtime(&fst.st_mtime);
-    dos_dt->time =
-        (time->tm_sec / 2) |
-        (time->tm_min << 5) |
-        (time->tm_hour << 11);
-    dos_dt->date =
-        (time->tm_mday) |
-        ((time->tm_mon + 1) << 5) |
-        ((time->tm_year - 80) << 9);
+    statcache_dostime(fst.st_mtime, &dos_dt->date, &dos_dt->time);
     return 0;
 }
 
@@ -363,11 +405,16 @@ CDECL static int mkdir_wrapper (char *dirname) {
     FIX_PATH(dirname);
 
     PRINT_DBG("mkdir: \"%s\"\n", dirname);
+    cache_uncacheable("creates a directory");
     if(mkdir(dirname_fixed, 0777)) {
         PRINT_DBG("mkdir: cannot mkdir (%s)\n", strerror(errno));
         SET_ERROR_CODE(ERR_PATH_NOT_FOUND);
         ret = -1;
     }
+    else {
+        dircache_add(dirname_fixed);
+        statcache_forget(dirname_fixed);
+    }
 
     FREE_PATH(dirname);
     return ret;
@@ -379,11 +426,16 @@ CDECL static int rmdir_wrapper (char *dirname) {
     FIX_PATH(dirname);
 
     PRINT_DBG("rmdir: \"%s\"\n", dirname);
+    cache_uncacheable("removes a directory");
     if(rmdir(dirname_fixed)) {
         PRINT_DBG("rmdir: cannot rmdir (%s)\n", strerror(errno));
         SET_ERROR_CODE(ERR_PATH_NOT_FOUND);
         ret = -1;
     }
+    else {
+        dircache_remove(dirname_fixed);
+        statcache_flush();
+    }
 
     FREE_PATH(dirname);
     return ret;
@@ -393,13 +445,23 @@ CDECL static int remove_wrapper (char *path) {
     int ret = 0;
     DEFINE_FIXED_PATH(path);
     FIX_PATH(path);
+    TMPNS_PATH(path, 0);
 
     PRINT_DBG("remove: unlink \"%s\"\n", path);
-    if ((ret = remove(path_fixed))) {
+    if ((ret = memtmp_remove(path_fixed)) && errno == ENOENT)
+        ret = remove(path_fixed);
+    if (ret) {
         PRINT_DBG("remove: cannot unlink (%s)\n", strerror(errno));
+        cache_note_lookup(path_fixed, 0, 0);
         SET_ERROR_CODE(ERR_FILE_NOT_FOUND); // copied
         ret = -1;
     }
+    else {
+        cache_note_remove(path_fixed);
+        depfile_note('D', path_fixed);
+        dircache_remove(path_fixed);
+        statcache_forget(path_fixed);
+    }
 
     FREE_PATH(path);
     return ret;
@@ -407,17 +469,35 @@ CDECL static int remove_wrapper (char *path) {
 
 CDECL static int rename_wrapper (char *oldpath, char *newpath) {
     int ret = 0;
+    struct stat st_new;
     DEFINE_FIXED_PATH(oldpath);
     DEFINE_FIXED_PATH(newpath);
     FIX_PATH(oldpath);
     FIX_PATH(newpath);
+    TMPNS_PATH(oldpath, 0);
+    TMPNS_PATH(newpath, 1);
 
     PRINT_DBG("rename: move \"%s\" to \"%s\"\n", oldpath, newpath);
-    if (rename(oldpath_fixed, newpath_fixed)) {
+    if ((ret = memtmp_rename(oldpath_fixed, newpath_fixed)) && errno == ENOENT)
+        ret = rename(oldpath_fixed, newpath_fixed);
+    if (ret) {
         PRINT_DBG("rename: cannot mv (%s)\n", strerror(errno));
+        cache_uncacheable("cannot rename a file");
         SET_ERROR_CODE(ERR_PATH_NOT_FOUND);
         ret = -1;
     }
+    else {
+        cache_note_rename(oldpath_fixed, newpath_fixed);
+        depfile_note('D', oldpath_fixed);
+        depfile_note('W', newpath_fixed);
+        dircache_remove(oldpath_fixed);
+        dircache_add(newpath_fixed);
+        statcache_forget(oldpath_fixed);
+        statcache_forget(newpath_fixed);
+        // a directory takes the paths under it along
+        if (!statcache_stat(newpath_fixed, &st_new) && S_ISDIR(st_new.st_mode))
+            statcache_flush();
+    }
 
     FREE_PATH(oldpath);
     FREE_PATH(newpath);
@@ -439,10 +519,15 @@ CDECL static int chdrive_wrapper (char *new_cwd, UNUSED char drive_num) {
     }
     strrep_forwslashes(new_cwd + 3);
 #else
-    if (!getcwd(new_cwd, MAX_FILEPATH)) {
-        PRINT_DBG("chdrive: error getting current dir (%s)\n", strerror(errno));
-        SET_ERROR_CODE(ERR_PATH_NOT_FOUND);
-        return -1;
+    {
+        const char *cwd = statcache_getcwd();
+
+        if (cwd == NULL || strlen(cwd) >= MAX_FILEPATH) {
+            PRINT_DBG("chdrive: error getting current dir (%s)\n", cwd == NULL ? strerror(errno) : "too long");
+            SET_ERROR_CODE(ERR_PATH_NOT_FOUND);
+            return -1;
+        }
+        strcpy(new_cwd, cwd);
     }
     strrep_forwslashes(new_cwd);
 #endif
@@ -455,11 +540,15 @@ CDECL static int chdir_wrapper (char *dirname) {
     FIX_PATH(dirname);
 
     PRINT_DBG("chdir: dirname = %s\n", dirname);
+    cache_uncacheable("changes directories");
     if (chdir(dirname_fixed)) {
         PRINT_DBG("chdir: chdir error (%s)\n", strerror(errno));
         SET_ERROR_CODE(ERR_PATH_NOT_FOUND);
         ret = -1;
     }
+    // relative directories are cached by their relative path
+    dircache_flush();
+    statcache_chdir();
 
     FREE_PATH(dirname);
     return ret;
@@ -538,6 +627,76 @@ char **build_argv(char *progname, int *argcp, char *args) {
 
 static int return_code;
 
+/*  KMC programs spawned through exew32.exe or a symlink to this loader are run in a fork
+ *  of this process instead of exec'ing the loader again, so each program is only searched
+ *  for and parsed once by the parent. EXE32_NOFORK=1 always spawns a new loader.
+ */
+static char *self_exe_path = NULL;
+static char **nested_argv, **nested_env;
+
+static int is_nested_loader(const char *path) {
+    char *real_path, *nofork = getenv("EXE32_NOFORK");
+    int ret;
+
+    if (nofork != NULL && !strcmp(nofork, "1"))
+        return 0;
+    if (self_exe_path == NULL && (self_exe_path = realpath("/proc/self/exe", NULL)) == NULL)
+        return 0;
+    if ((real_path = realpath(path, NULL)) == NULL)
+        return 0;
+
+    ret = !strcmp(real_path, self_exe_path);
+    free(real_path);
+    return ret;
+}
+
+static char **dup_string_array(char **strs) {
+    char **ret;
+    int count = 0, i;
+
+    while (strs[count] != NULL)
+        count++;
+    ret = malloc((count + 1) * sizeof(char *));
+    for (i = 0; i < count; i++)
+        ret[i] = strdup(strs[i]);
+    ret[count] = NULL;
+
+    return ret;
+}
+
+// runs in the forked child on the host stack, so only globals can be used here
+static void _spawn_nested_child(void) {
+    reset_wrappers();
+    exec_nested(nested_argv, nested_env);
+    exit(0); // not reached
+}
+
+static pid_t spawn_nested(char **argv, char **env) {
+    char *name, **host_environ = environ;
+    int exe32_mode;
+    pid_t pid;
+
+    if ((name = nested_progname(argv, &exe32_mode)) == NULL)
+        return -1;
+
+    // the program is searched for with the child's PATH
+    environ = env;
+    load_cache_prime(name, exe32_mode);
+    environ = host_environ;
+    free(name);
+
+    fflush(NULL);
+    if ((pid = fork()) == 0) {
+        // the strings are in the guest memory, which is unmapped before the program is loaded
+        nested_argv = dup_string_array(argv);
+        nested_env = dup_string_array(env);
+        restore_stack_ptr();
+        _spawn_nested_child();
+    }
+
+    return pid;
+}
+
 CDECL static int spawnve_wrapper (char *progname, struct exec_s *exec_info) {
     // This function only does is to execute the program and wait for it to finish.
 
@@ -546,10 +705,13 @@ CDECL static int spawnve_wrapper (char *progname, struct exec_s *exec_info) {
     char **exec_env = build_env_array(exec_info->env), **exec_argv, *exec_wpname = NULL;
     DEFINE_FIXED_PATH(progname);
     DEFINE_FIXED_PATH(exec_wpname);
+    exec_wpname_fixed = exec_wpname_fixed_dup = NULL;
     args[strlen(args)-1] = '\0';
     FIX_PATH(progname);
 
     PRINT_DBG("spawnve: progname = \"%s\", args = \"%s\"\n", progname, args);
+    cache_uncacheable("spawns programs");
+    fd_flush_all(); // the child writes to the same files
     exec_argv = build_argv(progname_fixed, &exec_argc, args);
 
     if (!strcmp(basename(progname_fixed), "exew32.exe")) {
@@ -562,7 +724,8 @@ CDECL static int spawnve_wrapper (char *progname, struct exec_s *exec_info) {
         pid_t pid;
         int status = 0;
 
-        if (posix_spawn(&pid, progname_fixed, NULL, NULL, exec_argv, exec_env)) {
+        pid = is_nested_loader(progname_fixed) ? spawn_nested(exec_argv, exec_env) : -1;
+        if (pid == -1 && posix_spawn(&pid, progname_fixed, NULL, NULL, exec_argv, exec_env)) {
             PRINT_DBG("spawnve: cannot spawn (%s)\n", strerror(errno));
             ret = -1;
             goto spawnve_free;
@@ -584,6 +747,10 @@ CDECL static int spawnve_wrapper (char *progname, struct exec_s *exec_info) {
                 return_code = 255;
             }
         } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+        // the child may have replaced files with names of another case, and changed others
+        dircache_flush();
+        statcache_flush();
+        fd_files_changed();
     }
 
 spawnve_free:
@@ -595,6 +762,16 @@ spawnve_free:
     return ret;
 }
 
+// forgets what the last program left behind, before another one runs in this process
+void reset_wrappers(void) {
+    find_close_all();
+    // the next job of a batch runs in its own directory, and relative paths change with it
+    statcache_chdir();
+    dircache_flush();
+    return_code = 0;
+    wpexec = NULL;
+}
+
 CDECL static int get_return_code_wrapper (void) {
     return return_code;
 }
@@ -603,7 +780,10 @@ CDECL static int dup_wrapper (int fd) {
     int ret;
     IS_VALID_FD(fd)
 
-    ret = append_fd(fd_fileptrs[fd]);
+    if ((ret = fd_dup(fd)) == -1) {
+        SET_ERROR_CODE(ERR_TOO_MANY_OPEN_FILES);
+        return -1;
+    }
     PRINT_DBG("dup: duplicate fd %d to %d\n", fd, ret);
     return ret;
 }
@@ -613,10 +793,7 @@ CDECL static int dup2_wrapper (int src_fd, int dest_fd) {
     IS_VALID_FD(src_fd)
     IS_VALID_FD(dest_fd)
 
-    if (fd_fileptrs[dest_fd]) fclose(fd_fileptrs[dest_fd]);
-    fd_fileptrs[dest_fd] = fd_fileptrs[src_fd];
-
-    return dest_fd;
+    return fd_dup2(src_fd, dest_fd);
 }
 
 CDECL static int get_dos_version_wrapper (void) {
@@ -678,5 +855,5 @@ func_wrapper io_wrappers[] = {
 void exec_init_first(init_first_t init_first, struct wrapprog_exec_s *exec_info) {
     wpexec = exec_info;
     save_stack_ptr();
-	(*init_first)(EXE32_PARAMS, io_wrappers, exec_info);
+	(*init_first)(EXE32_PARAMS, profile_wrappers(io_wrappers), exec_info);
 }
@@ -137,6 +137,9 @@ typedef REGPARM2 void (*init_first_exe32)(uint, uint,
 
 typedef init_first_exe32 init_first_t;
 
+extern func_wrapper io_wrappers[];
+
 void exec_init_first(init_first_t, struct wrapprog_exec_s *);
+void reset_wrappers(void);
 
 #endif // EXE32_WRAPPERS_H